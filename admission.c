@@ -0,0 +1,99 @@
+#define _GNU_SOURCE
+#include "admission.h"
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+// Bytes of a ClientHello looked at, plenty for any gnutls or browser sends
+#define HELLO_PEEK 4096
+
+// TLS numbers the peek looks for
+#define TLS_HANDSHAKE 22
+#define TLS_CLIENT_HELLO 1
+#define TLS_EXT_SESSION_TICKET 35
+#define TLS_EXT_PRE_SHARED_KEY 41
+
+void admission_init(admission_t *a, size_t max_active, size_t max_waiting) {
+  *a = (admission_t){.max_active = max_active, .max_waiting = max_waiting};
+}
+
+int admission_offer(admission_t *a, int resumed) {
+  if (a->active < a->max_active && !(resumed ? a->waiting_resumed : a->waiting)) {
+    a->active++;
+    a->started++;
+    a->resumed += resumed != 0;
+    return ADMIT_ACTIVE;
+  }
+  if (a->waiting < a->max_waiting) {
+    a->waiting++;
+    a->waiting_resumed += resumed != 0;
+    a->waited++;
+    return ADMIT_WAITING;
+  }
+  a->rejected++;
+  return ADMIT_REJECTED;
+}
+
+int admission_room(const admission_t *a) {
+  return a->waiting && a->active < a->max_active;
+}
+
+void admission_begin(admission_t *a, int resumed) {
+  admission_end(a, ADMIT_WAITING, resumed);
+  a->active++;
+  a->started++;
+  a->resumed += resumed != 0;
+}
+
+void admission_end(admission_t *a, int state, int resumed) {
+  if (state == ADMIT_ACTIVE) {
+    a->active--;
+  } else if (state == ADMIT_WAITING) {
+    a->waiting--;
+    a->waiting_resumed -= resumed != 0;
+  }
+}
+
+static unsigned get16(const unsigned char *p) {
+  return (unsigned)p[0] << 8 | p[1];
+}
+
+int admission_hello(int fd) {
+  unsigned char buf[HELLO_PEEK];
+  ssize_t n = recv(fd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+  size_t len, end, p;
+
+  if (n < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? -1 : 0;
+  // Anything that isn't a handshake record is the handshake's problem
+  if (n < 5 || buf[0] != TLS_HANDSHAKE)
+    return 0;
+
+  // Only what's in of the first record is looked at
+  len = get16(buf + 3);
+  end = (size_t)n - 5 < len ? (size_t)n : 5 + len;
+
+  // Handshake header, version and random, then the session id, cipher suites
+  // and compression methods, each with its length
+  p = 5;
+  if (end < p + 4 + 34 + 1 || buf[p] != TLS_CLIENT_HELLO)
+    return 0;
+  p += 4 + 34;
+  p += 1 + buf[p];
+  if (end < p + 2)
+    return 0;
+  p += 2 + get16(buf + p);
+  if (end < p + 1)
+    return 0;
+  p += 1 + buf[p];
+  if (end < p + 2)
+    return 0;
+  p += 2;
+
+  for (; p + 4 <= end; p += 4 + get16(buf + p + 2)) {
+    unsigned type = get16(buf + p);
+    if (type == TLS_EXT_PRE_SHARED_KEY || (type == TLS_EXT_SESSION_TICKET && get16(buf + p + 2) > 0))
+      return 1;
+  }
+  return 0;
+}
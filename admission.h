@@ -0,0 +1,68 @@
+#ifndef __ADMISSION_H__
+#define __ADMISSION_H__
+
+#include <stddef.h>
+
+// Admission control for TLS handshakes, the most expensive thing either
+// server does.
+//
+// At most `max_active` handshakes run at once. Connections past that wait
+// for a turn without being read (up to `max_waiting` of them), and anything
+// past that is turned away as soon as it arrives, so a reconnect storm costs
+// the servers a bounded amount of CPU per pass and established connections
+// keep being served.
+//
+// A connection is only offered once its ClientHello starts coming in (see
+// `admission_hello()`), so the ones resuming a session, which skip the
+// certificate signature and key exchange, can be let in ahead of full
+// handshakes. Each server keeps its own waiting connections and starts them
+// with `admission_begin()` as `admission_room()` allows, resumed ones first.
+
+// What became of a connection that was offered
+#define ADMIT_NONE 0    // Not offered yet (or done with)
+#define ADMIT_ACTIVE 1  // Handshaking
+#define ADMIT_WAITING 2 // Waiting for a turn
+#define ADMIT_REJECTED 3
+
+typedef struct {
+  size_t max_active, max_waiting;
+  size_t active, waiting;
+  size_t waiting_resumed; // Waiting connections that are resuming a session
+
+  // Stats
+  unsigned long started; // Handshakes started
+  unsigned long resumed; // Of which were resuming a session
+  unsigned long waited;  // Connections that had to wait for a turn
+  unsigned long rejected;
+} admission_t;
+
+void admission_init(admission_t *a, size_t max_active, size_t max_waiting);
+
+// Offer a connection whose ClientHello has come in, `resumed` if it's
+// resuming a session. Resumed connections only wait behind each other, full
+// handshakes behind anything that's waiting.
+//
+// Returns ADMIT_ACTIVE if it can start its handshake now, ADMIT_WAITING if it
+// has to wait, ADMIT_REJECTED if it should be closed.
+int admission_offer(admission_t *a, int resumed);
+
+// Returns 1 if a waiting connection can start its handshake, 0 otherwise.
+int admission_room(const admission_t *a);
+
+// A waiting connection (`resumed` or not) starts its handshake.
+void admission_begin(admission_t *a, int resumed);
+
+// A connection that was in state `state` (ADMIT_*) finished its handshake or
+// went away.
+void admission_end(admission_t *a, int state, int resumed);
+
+// Peek at the ClientHello waiting on `fd` without reading it.
+//
+// Returns 1 if it offers to resume a session (a TLS 1.3 pre_shared_key or a
+// TLS 1.2 session ticket), 0 if it's a full handshake. A hello that isn't all
+// in yet (or doesn't look like TLS at all, for the handshake to reject) counts
+// as a full one, so nothing is left spinning on a half-sent hello. Returns -1
+// if nothing has come in yet.
+int admission_hello(int fd);
+
+#endif
@@ -0,0 +1,311 @@
+// Event loop benchmark for chatServer5, over in-memory connections.
+//
+// chatServer5.c is built into this program (with its main() renamed out of
+// the way) and its own functions are run on the harness's in-memory transport
+// (bench/harness.h), with bench/memnetio.c standing in for netio.c. A pass
+// here is a pass of the server's main loop minus the listening sockets and
+// timers: the write pass, then reading and handling whatever came in, none of
+// it making a system call. Clients connect, pick names, then take turns
+// sending messages picked with a fixed seed, so every run does the same work.
+//
+// Reports the server's CPU time and heap allocations per message, and per
+// frame it sent out, so a regression in the hot path stands out from the
+// noise a real network adds.
+//
+// With -g the messages come one at a time instead, `gap` us apart on a
+// simulated clock that the server's batching window (-w) runs on too, and
+// each window given is run in turn, reporting how long messages waited to go
+// out and how many went out per write alongside what they cost.
+//
+// Usage: bench/chatLoopBench [-p] [-g gap] [-w window,...] [clients] [messages]
+//   -p: plain TCP, like a topic without a certificate (TLS otherwise)
+//   -g: simulated time (us) between messages (0, the default, sends a burst
+//       every pass without any time passing)
+//   -w: batching windows (us) to run the workload with, e.g. 0,250,1000
+#define _GNU_SOURCE
+#include "harness.h"
+
+#define main chatserver5_main
+#include "chatServer5.c"
+#undef main
+
+// Messages sent between two passes, each by a different client
+#define BURST 8
+
+// Passes before measuring, so the pools and gnutls have warmed up
+#define WARMUP 200
+
+static harness_conn_t **conns;
+static size_t nconns;
+static struct conntable table;
+static harness_stats_t stats;
+
+// Simulated time (us) between messages, 0 for bursts
+static uint64_t gap;
+
+// When each message in the history was read, by its slot in the ring
+static uint64_t *readat;
+
+// How far each client had got through the history, to see what it was sent
+static uint64_t *seen;
+
+// How long messages waited to be sent (simulated us)
+static struct {
+  uint64_t total, max, count;
+} latency;
+
+// One pass of chatServer5's main loop: what the wait that ends at `nowus`
+// returned, then the write pass that follows it
+static void serverpass(void) {
+  static netio_event_t events[MAXEVENTS];
+  static struct entry *ready[MAXEVENTS];
+  int n, nevents, nready = 0;
+
+  nevents = netio_wait(&io, events, MAXEVENTS, 0);
+  now = nowus / 1000;
+  for (n = 0; n < nevents; n++) {
+    struct entry *e = events[n].conn->owner;
+    if ((events[n].mask & NETIO_READABLE) && !e->ready) {
+      e->ready = 1;
+      ready[nready++] = e;
+    }
+  }
+  for (n = 0; n < nready; n++) {
+    ready[n]->ready = 0;
+    readclient(&table, ready[n]->slot);
+  }
+  writeclients(&table);
+}
+
+// Notes when the messages read in the last pass came in, and how long the
+// ones sent in it waited
+static void tracklatency(uint64_t from) {
+  uint64_t seq, origin, mask = history.cap - 1;
+  size_t k;
+
+  for (seq = from; seq < history.next; seq++) {
+    readat[seq & mask] = nowus;
+  }
+  for (k = 0; k < table.len; k++) {
+    for (seq = seen[k]; seq < table.nextseq[k]; seq++) {
+      if (history_get(&history, seq, &origin) && origin != table.ent[k]->id) {
+        uint64_t waited = nowus - readat[seq & mask];
+        latency.total += waited;
+        latency.max = waited > latency.max ? waited : latency.max;
+        latency.count++;
+      }
+    }
+    seen[k] = table.nextseq[k];
+  }
+}
+
+// When the server would wake up for its batching window, if it has a batch
+// waiting (it sleeps in whole milliseconds)
+static uint64_t batchwake(void) {
+  return batchdue > nowus ? nowus + (batchdue - nowus + 999) / 1000 * 1000 : nowus;
+}
+
+// Has every client read what it was sent
+// Returns the frames they got
+static size_t drainclients(void) {
+  size_t k, bytes = 0;
+
+  for (k = 0; k < nconns; k++) {
+    bytes += harness_client_drain(conns[k]);
+  }
+  return bytes / MAX;
+}
+
+// Connects a client and takes it through the TLS handshake
+static harness_conn_t *connectclient(gnutls_certificate_credentials_t cred) {
+  harness_conn_t *c = harness_connect();
+  struct entry *e;
+  int slot;
+
+  if (TLSflag) {
+    harness_client_tls(c, priority_cache);
+  }
+  if ((slot = addclient(&table, c->fd, cred, LINK_CLIENT)) < 0) {
+    fprintf(stderr, "chatLoopBench: server dropped a client\n");
+    exit(1);
+  }
+  e = table.ent[slot];
+  if (!TLSflag) {
+    return c;
+  }
+
+  // The handshake began on the socket, it carries on in memory
+  harness_bind(e->session, c);
+  while (!harness_client_handshake(c) || table.state[e->slot] == CONN_HANDSHAKE) {
+    if (table.state[e->slot] == CONN_HANDSHAKE && handshakeclient(&table, e->slot) < 0) {
+      fprintf(stderr, "chatLoopBench: server handshake failed\n");
+      exit(1);
+    }
+  }
+  return c;
+}
+
+// Has `nmsgs` messages sent, and sent out, with the current batching window,
+// adding up what it cost the server if `measure` is set
+// Returns the frames the clients got
+static size_t runwindow(uint64_t *seed, size_t nmsgs, int measure) {
+  uint64_t arrival = nowus + gap, from;
+  size_t sent = 0, frames = 0, k, b, burst;
+  char frame[MAX];
+
+  while (sent < nmsgs || batchdue) {
+    burst = 0;
+    if (batchdue && (sent == nmsgs || (gap && batchwake() < arrival))) {
+      // Woken up by the window closing
+      nowus = batchwake();
+    } else {
+      // Every length a client can send, with a steady mix
+      if (gap) {
+        nowus = arrival;
+        arrival += gap;
+      }
+      burst = gap ? 1 : nmsgs - sent < BURST ? nmsgs - sent : BURST;
+      k = harness_rand(seed) % nconns;
+      for (b = 0; b < burst; b++) {
+        int len = 1 + harness_rand(seed) % (MAXMSGLEN - 1);
+        memset(frame, '\0', MAX);
+        memset(frame, 'a' + b, len);
+        harness_client_send(conns[(k + b) % nconns], frame, MAX);
+      }
+    }
+
+    from = history.next;
+    if (measure) {
+      harness_begin(&stats);
+    }
+    serverpass();
+    if (measure) {
+      harness_end(&stats);
+      stats.msgs += burst;
+    }
+    sent += burst;
+    tracklatency(from);
+    frames += drainclients();
+  }
+  return frames;
+}
+
+int main(int argc, char **argv) {
+  gnutls_certificate_credentials_t cred;
+  uint64_t seed = 0x2545f4914f6cdd1dULL;
+  size_t nmsgs = 100000, frames, k;
+  unsigned long batches, batched;
+  const char *windows = "0";
+  char frame[MAX], *end;
+  struct timespec start, stop;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "pg:w:")) != -1) {
+    switch (opt) {
+    case 'p':
+      TLSflag = 0;
+      break;
+    case 'g':
+      gap = strtoull(optarg, NULL, 10);
+      break;
+    case 'w':
+      windows = optarg;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-p] [-g gap] [-w window,...] [clients] [messages]\n", argv[0]);
+      exit(1);
+    }
+  }
+  nconns = optind < argc ? strtoul(argv[optind], NULL, 10) : 64;
+  if (optind + 1 < argc) {
+    nmsgs = strtoul(argv[optind + 1], NULL, 10);
+  }
+  if (nconns < BURST || nmsgs == 0) {
+    fprintf(stderr, "Need at least %d clients and one message\n", BURST);
+    exit(1);
+  }
+
+  log_set_level(LOG_LVL_WARN);
+  harness_init(&priority_cache, &cred);
+  if (gnutls_session_ticket_key_generate(&ticketkey) < 0) {
+    fprintf(stderr, "chatLoopBench: can't generate a session ticket key\n");
+    exit(1);
+  }
+  admission_init(&admission, MAX_HANDSHAKES, HANDSHAKE_QUEUE);
+  entryq_init(&waitq[0]);
+  entryq_init(&waitq[1]);
+  entryq_init(&paused);
+
+  // Everything main() sets up that a pass touches
+  if (pool_init(&entry_pool, sizeof(struct entry), nconns) < 0 || pool_init(&inbuf_pool, INBUF_SIZE, 0) < 0 ||
+      pool_init(&outbuf_pool, OUTBUF_SIZE, 0) < 0 || nameset_init(&names, nconns) < 0 ||
+      conntable_init(&table, nconns) < 0 || history_init(&history, HISTORY_LEN) < 0 ||
+      netio_init(&io, NETIO_EPOLL, nconns, MAXEVENTS) < 0 ||
+      (handshakefd = epoll_create1(EPOLL_CLOEXEC)) < 0 || !(conns = calloc(nconns, sizeof(*conns))) ||
+      !(readat = calloc(history.cap, sizeof(*readat))) || !(seen = calloc(nconns, sizeof(*seen)))) {
+    perror("chatLoopBench: can't set up the server");
+    exit(1);
+  }
+  nowus = clockus();
+  now = nowus / 1000;
+  timerwheel_init(&timers, TIMER_TICK, now);
+  snprintf(topic, MAXTOPICLEN, "Bench");
+
+  // Everyone connects and picks a name
+  for (k = 0; k < nconns; k++) {
+    conns[k] = connectclient(cred);
+  }
+  serverpass();
+  drainclients();
+  for (k = 0; k < nconns; k++) {
+    memset(frame, '\0', MAX);
+    snprintf(frame, MAX, "user%zu", k);
+    harness_client_send(conns[k], frame, MAX);
+  }
+  serverpass();
+  drainclients();
+  for (k = 0; k < nconns; k++) {
+    seen[k] = table.nextseq[k];
+  }
+
+  printf("%zu %s clients, ", nconns, TLSflag ? "TLS" : "plain");
+  if (gap) {
+    printf("a message every %llu us\n", (unsigned long long)gap);
+  } else {
+    printf("bursts of %d messages\n", BURST);
+  }
+
+  // Each message goes to everyone else, in the write pass after the one that
+  // read it once the window has closed
+  for (const char *w = windows; *w; w = end + (*end == ',')) {
+    batchwindow = strtoul(w, &end, 10);
+    if (end == w) {
+      fprintf(stderr, "chatLoopBench: can't parse window list %s\n", windows);
+      exit(1);
+    }
+    if (w == windows) {
+      runwindow(&seed, WARMUP * BURST, 0);
+    }
+
+    memset(&stats, 0, sizeof(stats));
+    memset(&latency, 0, sizeof(latency));
+    batches = metrics.batches;
+    batched = metrics.batched;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    frames = runwindow(&seed, nmsgs, 1);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    batches = metrics.batches - batches;
+    batched = metrics.batched - batched;
+
+    printf("Window %lu us:\n", batchwindow);
+    harness_report("  Messages", &stats, stop.tv_sec - start.tv_sec + (stop.tv_nsec - start.tv_nsec) / 1e9);
+    printf("  %zu frames sent in %lu writes (%.1f each): %.0f ns CPU and %.2f allocations per frame\n", frames,
+           batches, batches ? (double)batched / batches : 0, frames ? (double)stats.cpu_ns / frames : 0,
+           frames ? (double)stats.allocs / frames : 0);
+    if (gap) {
+      printf("  Waited to be sent: %.0f us on average, %llu us at most\n",
+             latency.count ? (double)latency.total / latency.count : 0, (unsigned long long)latency.max);
+    }
+  }
+  return 0;
+}
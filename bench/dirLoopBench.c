@@ -0,0 +1,222 @@
+// Event loop benchmark for directoryServer5, over in-memory connections.
+//
+// directoryServer5.c is built into this program (with its main() renamed out
+// of the way) and its own functions are run on the harness's in-memory
+// transport (bench/harness.h). A pass here is a pass of the directory's main
+// loop minus accepting and timers: fill_pollfds(), then serve_clients(),
+// remove_disconnected(), admit_waiting() and publish_lookups() with the
+// revents poll() would have given. Lookups are answered on the loop's own
+// thread, as with no lookup threads (-t). Chat servers register and clients ask for the topic list, then
+// clients ask for topics' servers while the servers send heartbeats, all
+// picked with a fixed seed so every run does the same work.
+//
+// Reports the directory's CPU time and heap allocations per command.
+//
+// Usage: bench/dirLoopBench [servers] [clients] [commands]
+#define _GNU_SOURCE
+#include "harness.h"
+
+#define main directoryserver5_main
+#include "directoryServer5.c"
+#undef main
+
+// Commands sent between two passes, each on a different connection: this
+// many lookups and one heartbeat
+#define BURST 8
+
+// Servers share a topic in pairs
+#define REPLICAS 2
+
+// Passes before measuring, so the pools and gnutls have warmed up
+#define WARMUP 200
+
+static client_t *table;
+static size_t table_len;
+static struct pollfd *pfds;
+static harness_conn_t **conns;
+static harness_stats_t stats;
+
+// One pass of directoryServer5's main loop, with `measure` counting the
+// directory's part of it if it's given
+static void dirpass(harness_stats_t *measure) {
+  size_t polled, i;
+
+  if (measure)
+    harness_begin(measure);
+  now = timerwheel_clock();
+  polled = fill_pollfds(table, table_len, -1, pfds);
+  if (measure)
+    harness_end(measure);
+
+  // What poll() would say: memory can always be written
+  for (i = 1; i < polled; i++) {
+    harness_conn_t *c = harness_conn(pfds[i].fd);
+    pfds[i].revents = pfds[i].events & (POLLOUT | (c && c->in.len ? POLLIN : 0));
+  }
+
+  if (measure)
+    harness_begin(measure);
+  serve_clients(table, table_len, pfds, polled);
+  remove_disconnected(table, &table_len);
+  admit_waiting(table, table_len);
+  publish_lookups(table, table_len);
+  if (measure)
+    harness_end(measure);
+}
+
+// Sends a command on connection `k`, padded to a frame like the programs do
+static void sendcmd(size_t k, const char *cmd) {
+  char frame[MAX] = {'\0'};
+
+  snprintf(frame, MAX, "%s", cmd);
+  harness_client_send(conns[k], frame, MAX);
+}
+
+static void drainall(size_t nconns) {
+  for (size_t k = 0; k < nconns; k++)
+    harness_client_drain(conns[k]);
+}
+
+// Has connection `k` send `cmd` over and over in one frame, and makes sure
+// the replies that come back fit in the directory's buffer and it drops the
+// connection rather than letting them run past it
+static void check_pipelined(size_t k, const char *cmd) {
+  char frame[MAX] = {'\0'};
+  size_t len = 0, got, before = table_len;
+
+  while (len + strlen(cmd) + 1 <= MAX)
+    len += snprintf(frame + len, MAX - len, "%s", cmd) + 1;
+  harness_client_send(conns[k], frame, len);
+  dirpass(NULL);
+  dirpass(NULL);
+  got = harness_client_drain(conns[k]);
+  if (got > MAX || table_len != before - 1) {
+    fprintf(stderr, "dirLoopBench: pipelined \"%s\" got %zu bytes back, %zu connections left of %zu\n",
+            cmd, got, table_len, before);
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv) {
+  size_t nservers = argc > 1 ? strtoul(argv[1], NULL, 10) : 16;
+  size_t nclients = argc > 2 ? strtoul(argv[2], NULL, 10) : 64;
+  uint64_t ncmds = argc > 3 ? strtoull(argv[3], NULL, 10) : 200000;
+  size_t nconns = nservers + nclients, ntopics = (nservers + REPLICAS - 1) / REPLICAS, k;
+  uint64_t seed = 0x2545f4914f6cdd1dULL;
+  char cmd[MAX];
+  struct timespec start, end;
+  int pass;
+
+  if (nservers < REPLICAS || nclients < BURST || ncmds == 0) {
+    fprintf(stderr, "Usage: %s [servers (%d+)] [clients (%d+)] [commands]\n", argv[0], REPLICAS, BURST);
+    exit(1);
+  }
+
+  log_set_level(LOG_LVL_WARN);
+  harness_init(&priority_cache, &x509_cred);
+  if (gnutls_session_ticket_key_generate(&ticket_key) < 0) {
+    fprintf(stderr, "dirLoopBench: can't generate a session ticket key\n");
+    exit(1);
+  }
+  admission_init(&admission, MAX_HANDSHAKES, HANDSHAKE_QUEUE);
+
+  // Everything main() sets up that a pass touches
+  max_clients = nconns;
+  max_servers = nservers;
+  if (pool_init(&buffer_pool, MAX + 1, 2 * max_clients) < 0 ||
+      pool_init(&topic_pool, MAXTOPICLEN + 1, max_servers) < 0 ||
+      !(table = calloc(max_clients, sizeof(client_t))) ||
+      !(pfds = calloc(max_clients + 1, sizeof(struct pollfd))) ||
+      !(conns = calloc(nconns, sizeof(*conns))) ||
+      rcu_init(&lookup_rcu, 0) < 0) {
+    perror("dirLoopBench: can't set up the directory");
+    exit(1);
+  }
+  now = timerwheel_clock();
+  timerwheel_init(&timers, TIMER_TICK, now);
+  publish_lookups(table, table_len);
+
+  // Servers come first, then clients, each from its own address. The
+  // directory takes the handshakes along as the passes go.
+  for (k = 0; k < nconns; k++) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(0x7f000001 + k)};
+
+    conns[k] = harness_connect();
+    harness_client_tls(conns[k], priority_cache);
+    if (add_client(table, &table_len, conns[k]->fd, &addr) < 0) {
+      fprintf(stderr, "dirLoopBench: directory dropped a connection\n");
+      exit(1);
+    }
+    // The handshake began on the socket, it carries on in memory
+    harness_bind(table[table_len - 1].session, conns[k]);
+  }
+  for (size_t pending = nconns; pending;) {
+    pending = 0;
+    for (k = 0; k < nconns; k++)
+      pending += !harness_client_handshake(conns[k]);
+    dirpass(NULL);
+    for (k = 0; k < table_len; k++)
+      pending += table[k].handshaking;
+  }
+
+  for (k = 0; k < nservers; k++) {
+    snprintf(cmd, MAX, "sTopic%zu; %zu", k / REPLICAS, 30000 + k);
+    sendcmd(k, cmd);
+  }
+  dirpass(NULL);
+  for (k = nservers; k < nconns; k++)
+    sendcmd(k, "cl");
+  dirpass(NULL);
+  dirpass(NULL);
+  drainall(nconns);
+  if (table_len != nconns) {
+    fprintf(stderr, "dirLoopBench: directory dropped a connection\n");
+    exit(1);
+  }
+
+  // Lookups from clients, and a heartbeat from a server, on every pass
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (pass = 0; stats.msgs < ncmds; pass++) {
+    harness_stats_t *measure = pass >= WARMUP ? &stats : NULL;
+
+    if (pass == WARMUP)
+      clock_gettime(CLOCK_MONOTONIC, &start);
+
+    k = harness_rand(&seed) % nclients;
+    for (int b = 0; b < BURST - 1; b++) {
+      snprintf(cmd, MAX, "crTopic%llu", (unsigned long long)(harness_rand(&seed) % ntopics));
+      sendcmd(nservers + (k + b) % nclients, cmd);
+    }
+    snprintf(cmd, MAX, "h%llu;%llu;%llu", (unsigned long long)(harness_rand(&seed) % 100),
+             (unsigned long long)(harness_rand(&seed) % 1000), (unsigned long long)(harness_rand(&seed) % 64));
+    sendcmd(harness_rand(&seed) % nservers, cmd);
+    if (measure)
+      stats.msgs += BURST;
+
+    dirpass(measure);
+    drainall(nconns);
+  }
+
+  // Send out the replies to the last pass
+  dirpass(&stats);
+  drainall(nconns);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (table_len != nconns) {
+    fprintf(stderr, "dirLoopBench: directory dropped %zu connections\n", nconns - table_len);
+    exit(1);
+  }
+  printf("%zu servers of %zu topics, %zu clients, %d passes of %d commands\n", nservers, ntopics,
+         nclients, pass - WARMUP, BURST);
+  harness_report("Commands", &stats, end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+  // Commands sent all at once are run before any reply goes out: lookups
+  // from a client, and a server joining its topic's mesh (only allowed once)
+  // while the other server of the topic is in it
+  check_pipelined(nservers, "crTopic0");
+  sendcmd(1, "m31001");
+  dirpass(NULL);
+  harness_client_drain(conns[1]);
+  check_pipelined(0, "m31000");
+  return 0;
+}
@@ -0,0 +1,166 @@
+// TLS handshake throughput benchmark, RSA against ECDSA and Ed25519.
+//
+// Creates a throwaway self-signed server certificate for each key type, then
+// runs full handshakes (no resumption) between a server and client session
+// over a socketpair, both driven from this thread. Sessions take their
+// priorities from one shared cache, like the servers and client do, so
+// CHAT_TLS_PRIORITY can be used to try other settings. Reports handshakes per
+// second and the server's CPU time per handshake, which is what the key type
+// changes.
+//
+// Usage: bench/handshakeBench [handshakes per key type]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+#include "tlsconf.h"
+
+typedef struct {
+  const char *name;
+  gnutls_pk_algorithm_t pk;
+  unsigned bits;
+  gnutls_digest_algorithm_t dig;
+} keytype_t;
+
+static double now(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void check(int ret, const char *what) {
+  if (ret < 0) {
+    fprintf(stderr, "handshakeBench: %s: %s\n", what, gnutls_strerror(ret));
+    exit(1);
+  }
+}
+
+// Credentials holding a new self-signed certificate for `type`
+static gnutls_certificate_credentials_t make_cred(const keytype_t *type) {
+  gnutls_certificate_credentials_t cred;
+  gnutls_x509_privkey_t key;
+  gnutls_x509_crt_t crt;
+  unsigned char serial = 1;
+  time_t t = time(NULL);
+
+  check(gnutls_x509_privkey_init(&key), "privkey init");
+  check(gnutls_x509_privkey_generate(key, type->pk, type->bits, 0), "key generation");
+
+  check(gnutls_x509_crt_init(&crt), "crt init");
+  check(gnutls_x509_crt_set_version(crt, 3), "crt version");
+  check(gnutls_x509_crt_set_serial(crt, &serial, sizeof(serial)), "crt serial");
+  check(gnutls_x509_crt_set_activation_time(crt, t - 60), "crt activation");
+  check(gnutls_x509_crt_set_expiration_time(crt, t + 3600), "crt expiration");
+  check(gnutls_x509_crt_set_dn(crt, "CN=Birds", NULL), "crt dn");
+  check(gnutls_x509_crt_set_key(crt, key), "crt key");
+  check(gnutls_x509_crt_set_key_usage(crt, GNUTLS_KEY_DIGITAL_SIGNATURE), "crt key usage");
+  check(gnutls_x509_crt_sign2(crt, crt, key, type->dig, 0), "crt sign");
+
+  check(gnutls_certificate_allocate_credentials(&cred), "credentials");
+  check(gnutls_certificate_set_x509_key(cred, &crt, 1, key), "credentials key");
+
+  gnutls_x509_crt_deinit(crt);
+  gnutls_x509_privkey_deinit(key);
+  return cred;
+}
+
+// One full handshake, returning the server's share of the CPU time
+static double handshake(gnutls_certificate_credentials_t server_cred,
+                        gnutls_certificate_credentials_t client_cred,
+                        gnutls_priority_t prio) {
+  gnutls_session_t server, client;
+  int fds[2], server_done = 0, client_done = 0, ret;
+  double server_cpu = 0;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) < 0) {
+    perror("handshakeBench: socketpair");
+    exit(1);
+  }
+
+  double start = now(CLOCK_THREAD_CPUTIME_ID);
+  check(gnutls_init(&server, GNUTLS_SERVER | GNUTLS_NONBLOCK), "server init");
+  check(gnutls_credentials_set(server, GNUTLS_CRD_CERTIFICATE, server_cred), "server credentials");
+  check(gnutls_priority_set(server, prio), "server priorities");
+  gnutls_transport_set_int(server, fds[0]);
+  server_cpu += now(CLOCK_THREAD_CPUTIME_ID) - start;
+
+  check(gnutls_init(&client, GNUTLS_CLIENT | GNUTLS_NONBLOCK), "client init");
+  check(gnutls_credentials_set(client, GNUTLS_CRD_CERTIFICATE, client_cred), "client credentials");
+  check(gnutls_priority_set(client, prio), "client priorities");
+  gnutls_transport_set_int(client, fds[1]);
+
+  // Take turns until both sides are done
+  while (!server_done || !client_done) {
+    if (!client_done) {
+      ret = gnutls_handshake(client);
+      if (ret == 0)
+        client_done = 1;
+      else if (gnutls_error_is_fatal(ret))
+        check(ret, "client handshake");
+    }
+    if (!server_done) {
+      start = now(CLOCK_THREAD_CPUTIME_ID);
+      ret = gnutls_handshake(server);
+      server_cpu += now(CLOCK_THREAD_CPUTIME_ID) - start;
+      if (ret == 0)
+        server_done = 1;
+      else if (gnutls_error_is_fatal(ret))
+        check(ret, "server handshake");
+    }
+  }
+
+  gnutls_deinit(client);
+  gnutls_deinit(server);
+  close(fds[0]);
+  close(fds[1]);
+  return server_cpu;
+}
+
+int main(int argc, char **argv) {
+  int handshakes = argc > 1 ? atoi(argv[1]) : 500;
+  const keytype_t types[] = {
+    {"RSA 2048", GNUTLS_PK_RSA, 2048, GNUTLS_DIG_SHA256},
+    {"ECDSA P-256", GNUTLS_PK_ECDSA, GNUTLS_CURVE_TO_BITS(GNUTLS_ECC_CURVE_SECP256R1), GNUTLS_DIG_SHA256},
+    {"Ed25519", GNUTLS_PK_EDDSA_ED25519, GNUTLS_CURVE_TO_BITS(GNUTLS_ECC_CURVE_ED25519), GNUTLS_DIG_UNKNOWN},
+  };
+  gnutls_certificate_credentials_t client_cred;
+  gnutls_priority_t prio;
+
+  if (handshakes <= 0) {
+    fprintf(stderr, "Usage: %s [handshakes per key type]\n", argv[0]);
+    exit(1);
+  }
+
+  check(gnutls_global_init(), "global init");
+  if (tls_priority_init(&prio, NULL) < 0)
+    exit(1);
+  // Like chatClient5, the client doesn't check the server's certificate
+  check(gnutls_certificate_allocate_credentials(&client_cred), "client credentials");
+
+  printf("%-12s %12s %20s\n", "key", "handshakes/s", "server CPU/handshake");
+  for (size_t t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+    gnutls_certificate_credentials_t server_cred = make_cred(&types[t]);
+    double server_cpu = 0;
+
+    // Warm up, then measure
+    handshake(server_cred, client_cred, prio);
+    double start = now(CLOCK_MONOTONIC);
+    for (int i = 0; i < handshakes; i++)
+      server_cpu += handshake(server_cred, client_cred, prio);
+    double elapsed = now(CLOCK_MONOTONIC) - start;
+
+    printf("%-12s %12.0f %17.1f us\n", types[t].name, handshakes / elapsed,
+           server_cpu / handshakes * 1e6);
+    gnutls_certificate_free_credentials(server_cred);
+  }
+
+  gnutls_certificate_free_credentials(client_cred);
+  gnutls_priority_deinit(prio);
+  gnutls_global_deinit();
+  return 0;
+}
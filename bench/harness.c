@@ -0,0 +1,399 @@
+#define _GNU_SOURCE
+#include "harness.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <gnutls/x509.h>
+#include "tlsconf.h"
+
+// Connections by server descriptor
+static harness_conn_t **conns;
+static size_t nconns;
+
+// Connections with new input, oldest first
+static harness_conn_t *ready_head, **ready_tail = &ready_head;
+
+// Where CPU time and allocations go while measuring, NULL otherwise
+static harness_stats_t *measuring;
+static uint64_t started_ns;
+
+static void fail(const char *what, int ret) {
+  fprintf(stderr, "harness: %s: %s\n", what, ret < 0 ? gnutls_strerror(ret) : strerror(errno));
+  exit(1);
+}
+
+// ---------------- Allocation counting ----------------
+
+// These stand in for libc's, for the whole process, and pass every call on
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+
+// dlsym() can allocate before the real functions are known, it gets memory
+// from here (and never gives it back)
+static char bootstrap[4096] __attribute__((aligned(16)));
+static size_t bootstrap_used;
+
+static void *bootstrap_alloc(size_t size) {
+  size = (size + 15) & ~(size_t)15;
+  if (size > sizeof(bootstrap) - bootstrap_used)
+    return NULL;
+  bootstrap_used += size;
+  return bootstrap + bootstrap_used - size;
+}
+
+static int from_bootstrap(const void *p) {
+  return (const char *)p >= bootstrap && (const char *)p < bootstrap + sizeof(bootstrap);
+}
+
+// Returns 1 once the real functions can be called
+static int resolve(void) {
+  static int resolving;
+
+  if (real_free)
+    return 1;
+  if (resolving)
+    return 0;
+  resolving = 1;
+  real_malloc = (void *(*)(size_t))dlsym(RTLD_NEXT, "malloc");
+  real_calloc = (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "calloc");
+  real_realloc = (void *(*)(void *, size_t))dlsym(RTLD_NEXT, "realloc");
+  real_free = (void (*)(void *))dlsym(RTLD_NEXT, "free");
+  return real_free != NULL;
+}
+
+void *malloc(size_t size) {
+  if (!resolve())
+    return bootstrap_alloc(size);
+  if (measuring)
+    measuring->allocs++;
+  return real_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  if (!resolve())
+    return size && n > SIZE_MAX / size ? NULL : bootstrap_alloc(n * size);
+  if (measuring)
+    measuring->allocs++;
+  return real_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+  if (!resolve() || from_bootstrap(p)) {
+    void *q = malloc(size);
+    if (q && p) {
+      size_t left = bootstrap + sizeof(bootstrap) - (char *)p;
+      memcpy(q, p, size < left ? size : left);
+    }
+    return q;
+  }
+  if (measuring)
+    measuring->allocs++;
+  return real_realloc(p, size);
+}
+
+void free(void *p) {
+  if (!p || from_bootstrap(p))
+    return;
+  if (resolve())
+    real_free(p);
+}
+
+// ---------------- Measuring ----------------
+
+static uint64_t cpu_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void harness_begin(harness_stats_t *stats) {
+  measuring = stats;
+  started_ns = cpu_ns();
+}
+
+void harness_end(harness_stats_t *stats) {
+  stats->cpu_ns += cpu_ns() - started_ns;
+  measuring = NULL;
+}
+
+uint64_t harness_rand(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+void harness_report(const char *what, const harness_stats_t *stats, double wall_s) {
+  double msgs = stats->msgs ? stats->msgs : 1;
+
+  printf("%s: %llu in %.2f s, %.0f ns CPU and %.2f allocations each in the server\n", what,
+         (unsigned long long)stats->msgs, wall_s, stats->cpu_ns / msgs, stats->allocs / msgs);
+}
+
+// ---------------- TLS ----------------
+
+void harness_init(gnutls_priority_t *prio, gnutls_certificate_credentials_t *server_cred) {
+  gnutls_x509_privkey_t key;
+  gnutls_x509_crt_t crt;
+  unsigned char serial = 1;
+  time_t t = time(NULL);
+  int ret;
+
+  if ((ret = gnutls_global_init()) < 0)
+    fail("global init", ret);
+  if (tls_priority_init(prio, NULL) < 0)
+    exit(1);
+
+  // ECDSA keeps the handshakes of the setup short, they aren't measured
+  if ((ret = gnutls_x509_privkey_init(&key)) < 0 ||
+      (ret = gnutls_x509_privkey_generate(key, GNUTLS_PK_ECDSA,
+                                          GNUTLS_CURVE_TO_BITS(GNUTLS_ECC_CURVE_SECP256R1), 0)) < 0 ||
+      (ret = gnutls_x509_crt_init(&crt)) < 0 ||
+      (ret = gnutls_x509_crt_set_version(crt, 3)) < 0 ||
+      (ret = gnutls_x509_crt_set_serial(crt, &serial, sizeof(serial))) < 0 ||
+      (ret = gnutls_x509_crt_set_activation_time(crt, t - 60)) < 0 ||
+      (ret = gnutls_x509_crt_set_expiration_time(crt, t + 3600)) < 0 ||
+      (ret = gnutls_x509_crt_set_dn(crt, "CN=Harness", NULL)) < 0 ||
+      (ret = gnutls_x509_crt_set_key(crt, key)) < 0 ||
+      (ret = gnutls_x509_crt_set_key_usage(crt, GNUTLS_KEY_DIGITAL_SIGNATURE)) < 0 ||
+      (ret = gnutls_x509_crt_sign2(crt, crt, key, GNUTLS_DIG_SHA256, 0)) < 0 ||
+      (ret = gnutls_certificate_allocate_credentials(server_cred)) < 0 ||
+      (ret = gnutls_certificate_set_x509_key(*server_cred, &crt, 1, key)) < 0)
+    fail("server certificate", ret);
+  gnutls_x509_crt_deinit(crt);
+  gnutls_x509_privkey_deinit(key);
+}
+
+// ---------------- Pipes ----------------
+
+static size_t pipe_write(harness_pipe_t *p, const void *buf, size_t len) {
+  // Slide what's left to the front when the end is full
+  if (p->off + p->len + len > HARNESS_PIPE && p->off) {
+    memmove(p->buf, p->buf + p->off, p->len);
+    p->off = 0;
+  }
+  if (len > HARNESS_PIPE - p->off - p->len)
+    len = HARNESS_PIPE - p->off - p->len;
+  memcpy(p->buf + p->off + p->len, buf, len);
+  p->len += len;
+  return len;
+}
+
+static size_t pipe_read(harness_pipe_t *p, void *buf, size_t len) {
+  if (len > p->len)
+    len = p->len;
+  memcpy(buf, p->buf + p->off, len);
+  p->off += len;
+  p->len -= len;
+  if (!p->len)
+    p->off = 0;
+  return len;
+}
+
+harness_conn_t *harness_connect(void) {
+  harness_conn_t *c = calloc(1, sizeof(harness_conn_t));
+  int fds[2];
+
+  if (!c || socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0)
+    fail("connection", 0);
+  c->fd = fds[0];
+  c->peerfd = fds[1];
+
+  if ((size_t)c->fd >= nconns) {
+    size_t n = nconns ? nconns : 64;
+    while (n <= (size_t)c->fd)
+      n *= 2;
+    if (!(conns = realloc(conns, n * sizeof(*conns))))
+      fail("connection table", 0);
+    memset(conns + nconns, 0, (n - nconns) * sizeof(*conns));
+    nconns = n;
+  }
+  conns[c->fd] = c;
+  return c;
+}
+
+harness_conn_t *harness_conn(int fd) {
+  return fd >= 0 && (size_t)fd < nconns ? conns[fd] : NULL;
+}
+
+ssize_t harness_recv(harness_conn_t *c, void *buf, size_t len) {
+  if (!c->in.len) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return pipe_read(&c->in, buf, len);
+}
+
+// Stands in for libc's, so the servers' peeks at a ClientHello (admission.h)
+// see what's in the pipe, and passes anything else on
+ssize_t recv(int fd, void *buf, size_t len, int flags) {
+  static ssize_t (*real_recv)(int, void *, size_t, int);
+  harness_conn_t *c = harness_conn(fd);
+
+  if (c && !(flags & MSG_PEEK))
+    return harness_recv(c, buf, len);
+  if (c) {
+    if (!c->in.len) {
+      errno = EAGAIN;
+      return -1;
+    }
+    if (len > c->in.len)
+      len = c->in.len;
+    memcpy(buf, c->in.buf + c->in.off, len);
+    return len;
+  }
+  if (!real_recv)
+    real_recv = (ssize_t (*)(int, void *, size_t, int))dlsym(RTLD_NEXT, "recv");
+  return real_recv(fd, buf, len, flags);
+}
+
+ssize_t harness_send(harness_conn_t *c, const void *buf, size_t len) {
+  size_t n = pipe_write(&c->out, buf, len);
+
+  if (!n && len) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return n;
+}
+
+void harness_close(harness_conn_t *c) {
+  if (harness_conn(c->fd) == c)
+    conns[c->fd] = NULL;
+  close(c->peerfd);
+  c->closed = 1;
+}
+
+harness_conn_t *harness_next_ready(void) {
+  harness_conn_t *c = ready_head;
+
+  if (c) {
+    ready_head = c->next_ready;
+    if (!ready_head)
+      ready_tail = &ready_head;
+    c->ready = 0;
+  }
+  return c;
+}
+
+// ---------------- gnutls transport ----------------
+
+static ssize_t server_pull(gnutls_transport_ptr_t ptr, void *buf, size_t len) {
+  return harness_recv(ptr, buf, len);
+}
+
+static ssize_t server_push(gnutls_transport_ptr_t ptr, const void *buf, size_t len) {
+  return harness_send(ptr, buf, len);
+}
+
+static int server_pull_timeout(gnutls_transport_ptr_t ptr, unsigned int ms) {
+  (void)ms;
+  return ((harness_conn_t *)ptr)->in.len > 0;
+}
+
+void harness_bind(gnutls_session_t session, harness_conn_t *c) {
+  gnutls_transport_set_ptr(session, c);
+  gnutls_transport_set_pull_function(session, server_pull);
+  gnutls_transport_set_pull_timeout_function(session, server_pull_timeout);
+  gnutls_transport_set_push_function(session, server_push);
+}
+
+static ssize_t client_pull(gnutls_transport_ptr_t ptr, void *buf, size_t len) {
+  harness_conn_t *c = ptr;
+
+  if (!c->out.len) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return pipe_read(&c->out, buf, len);
+}
+
+// Clients send whole frames, so the pipe to the server never turns one away
+static ssize_t client_push(gnutls_transport_ptr_t ptr, const void *buf, size_t len) {
+  harness_conn_t *c = ptr;
+  size_t n = pipe_write(&c->in, buf, len);
+
+  if (n && !c->ready) {
+    c->ready = 1;
+    c->next_ready = NULL;
+    *ready_tail = c;
+    ready_tail = &c->next_ready;
+  }
+  if (!n && len) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return n;
+}
+
+static int client_pull_timeout(gnutls_transport_ptr_t ptr, unsigned int ms) {
+  (void)ms;
+  return ((harness_conn_t *)ptr)->out.len > 0;
+}
+
+void harness_client_tls(harness_conn_t *c, gnutls_priority_t prio) {
+  static gnutls_certificate_credentials_t cred;
+  int ret;
+
+  // Like chatClient5, the client doesn't check the server's certificate
+  if (!cred && (ret = gnutls_certificate_allocate_credentials(&cred)) < 0)
+    fail("client credentials", ret);
+  if ((ret = gnutls_init(&c->client, GNUTLS_CLIENT | GNUTLS_NONBLOCK)) < 0 ||
+      (ret = gnutls_credentials_set(c->client, GNUTLS_CRD_CERTIFICATE, cred)) < 0 ||
+      (ret = gnutls_priority_set(c->client, prio)) < 0)
+    fail("client session", ret);
+  gnutls_transport_set_ptr(c->client, c);
+  gnutls_transport_set_pull_function(c->client, client_pull);
+  gnutls_transport_set_pull_timeout_function(c->client, client_pull_timeout);
+  gnutls_transport_set_push_function(c->client, client_push);
+}
+
+int harness_client_handshake(harness_conn_t *c) {
+  int ret;
+
+  if (c->handshaken)
+    return 1;
+  ret = gnutls_handshake(c->client);
+  if (ret < 0 && gnutls_error_is_fatal(ret))
+    fail("client handshake", ret);
+  return c->handshaken = (ret == 0);
+}
+
+void harness_client_send(harness_conn_t *c, const void *frame, size_t len) {
+  ssize_t ret;
+
+  if (!c->client) {
+    if (client_push(c, frame, len) != (ssize_t)len)
+      fail("client send", 0);
+    return;
+  }
+  // Nothing can block, the pipe is far bigger than a record
+  ret = gnutls_record_send(c->client, frame, len);
+  if (ret != (ssize_t)len)
+    fail("client send", ret < 0 ? ret : 0);
+}
+
+size_t harness_client_drain(harness_conn_t *c) {
+  char buf[HARNESS_PIPE];
+  size_t total = 0;
+  ssize_t ret;
+
+  for (;;) {
+    ret = c->client ? gnutls_record_recv(c->client, buf, sizeof(buf)) : client_pull(c, buf, sizeof(buf));
+    if (ret <= 0)
+      break;
+    total += ret;
+  }
+  if (c->client && ret < 0 && ret != GNUTLS_E_AGAIN && ret != GNUTLS_E_INTERRUPTED &&
+      gnutls_error_is_fatal(ret))
+    fail("client receive", ret);
+  return total;
+}
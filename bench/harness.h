@@ -0,0 +1,107 @@
+#ifndef __HARNESS_H__
+#define __HARNESS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <gnutls/gnutls.h>
+
+// In-process transport for benchmarking the servers' connection handling
+// without the kernel's networking in the way.
+//
+// Each connection is a socketpair that never carries a byte, so the servers
+// still get real descriptors to watch and close, plus a pair of in-memory
+// pipes that every byte goes through instead. Server sessions are pointed at
+// the pipes with gnutls push/pull callbacks (`harness_bind()`), recv() on a
+// connection's descriptor reads (or peeks at) its pipe too, and the synthetic
+// client at the other end is driven from the same thread.
+//
+// While a measurement is running (between `harness_begin()` and
+// `harness_end()`) the thread's CPU time and every malloc, calloc and realloc
+// made by the process, gnutls included, are added up, so only what the
+// server code does is counted and not the simulated clients.
+
+// Bytes each pipe holds before writes to it block
+#define HARNESS_PIPE 16384
+
+typedef struct {
+  char buf[HARNESS_PIPE];
+  size_t off, len; // Unread bytes are buf[off, off + len)
+} harness_pipe_t;
+
+typedef struct harness_conn {
+  int fd;     // The server's descriptor
+  int peerfd; // The other end, kept open so the server never sees EOF
+
+  harness_pipe_t in;  // Client to server
+  harness_pipe_t out; // Server to client
+
+  gnutls_session_t client; // The synthetic client's session, if it uses TLS
+  int handshaken;          // Its handshake is done
+  int closed;              // The server closed its end
+  void *owner;             // Whatever the server's transport wants back
+
+  // Connections with new input for the server, for harness_next_ready()
+  int ready;
+  struct harness_conn *next_ready;
+} harness_conn_t;
+
+typedef struct {
+  uint64_t cpu_ns; // Thread CPU time spent measuring
+  uint64_t allocs; // Heap allocations made while measuring
+  uint64_t msgs;   // Messages the workload handed the server
+} harness_stats_t;
+
+// Set up gnutls, the TLS priorities ($CHAT_TLS_PRIORITY like the servers) and
+// a throwaway self-signed ECDSA certificate for the servers' side.
+void harness_init(gnutls_priority_t *prio, gnutls_certificate_credentials_t *server_cred);
+
+// New connection. Hand `fd` to the server like an accepted socket.
+harness_conn_t *harness_connect(void);
+
+// Connection whose server descriptor is `fd`, or NULL.
+harness_conn_t *harness_conn(int fd);
+
+// Route a server session's record I/O through the connection's pipes.
+void harness_bind(gnutls_session_t session, harness_conn_t *c);
+
+// Give the connection a TLS client session, talking through the pipes.
+void harness_client_tls(harness_conn_t *c, gnutls_priority_t prio);
+
+// The server's side of the pipes: like nonblocking recv() and send(), -1 with
+// errno EAGAIN when there's nothing to read or no room to write.
+ssize_t harness_recv(harness_conn_t *c, void *buf, size_t len);
+ssize_t harness_send(harness_conn_t *c, const void *buf, size_t len);
+
+// Server is done with the connection and has closed `fd`.
+void harness_close(harness_conn_t *c);
+
+// Next connection that got input for the server since it was last returned,
+// or NULL.
+harness_conn_t *harness_next_ready(void);
+
+// The client's side: send a whole frame (through TLS if it has a session).
+void harness_client_send(harness_conn_t *c, const void *frame, size_t len);
+
+// Read (and decrypt) everything the server has sent the client.
+//
+// Returns the bytes read.
+size_t harness_client_drain(harness_conn_t *c);
+
+// Take the client's TLS handshake as far as it goes without the server.
+//
+// Returns 1 once it's done, 0 while it isn't.
+int harness_client_handshake(harness_conn_t *c);
+
+// Start or stop counting CPU time and allocations into `stats`.
+void harness_begin(harness_stats_t *stats);
+void harness_end(harness_stats_t *stats);
+
+// Deterministic pseudo random numbers for the workloads (xorshift64)
+uint64_t harness_rand(uint64_t *state);
+
+// Print what each of the messages in `stats` cost, `what` saying what they
+// were.
+void harness_report(const char *what, const harness_stats_t *stats, double wall_s);
+
+#endif
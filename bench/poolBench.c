@@ -0,0 +1,98 @@
+// Connection churn benchmark for the pool allocator.
+//
+// Simulates the servers' accept/disconnect cycle: every "connection" takes a
+// connection object plus an RX and TX buffer, holds them while up to `LIVE`
+// other connections come and go, then gives them back. Reports the heap calls
+// made per connection once the pools have warmed up, next to plain malloc.
+//
+// Usage: bench/poolBench [connections]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "common.h"
+#include "pool.h"
+
+// Roughly the size of chatServer5's `struct entry`
+#define CONN_SIZE (sizeof(int) + MAXNAMELEN + 2 * sizeof(char *) + 2 * MAX + 2 * sizeof(void *))
+#define LIVE 1024
+#define WARMUP (4 * LIVE)
+
+typedef struct {
+  void *conn, *rx, *tx;
+} conn_t;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  size_t connections = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  static conn_t live[LIVE];
+  pool_t conn_pool, buffer_pool;
+  pool_stats_t cs, bs;
+
+  // Pool: warm up, then measure steady state
+  if (pool_init(&conn_pool, CONN_SIZE, LIVE) < 0 ||
+      pool_init(&buffer_pool, MAX + 1, 2 * LIVE) < 0) {
+    perror("poolBench: can't allocate pools");
+    exit(1);
+  }
+
+  size_t warm_calls = 0;
+  double start = 0;
+  for (size_t i = 0; i < WARMUP + connections; i++) {
+    if (i == WARMUP) {
+      pool_get_stats(&conn_pool, &cs);
+      pool_get_stats(&buffer_pool, &bs);
+      warm_calls = cs.heap_calls + bs.heap_calls;
+      start = now();
+    }
+
+    conn_t *c = &live[i % LIVE];
+    if (c->conn) {
+      pool_free(&buffer_pool, c->tx);
+      pool_free(&buffer_pool, c->rx);
+      pool_free(&conn_pool, c->conn);
+    }
+    c->conn = pool_alloc(&conn_pool);
+    c->rx = pool_alloc(&buffer_pool);
+    c->tx = pool_alloc(&buffer_pool);
+    memset(c->conn, 0, CONN_SIZE);
+  }
+  double pool_time = now() - start;
+
+  pool_get_stats(&conn_pool, &cs);
+  pool_get_stats(&buffer_pool, &bs);
+  size_t pool_calls = cs.heap_calls + bs.heap_calls - warm_calls;
+
+  // malloc: every connection is three heap calls in and three out
+  memset(live, 0, sizeof(live));
+  start = now();
+  for (size_t i = 0; i < connections; i++) {
+    conn_t *c = &live[i % LIVE];
+    if (c->conn) {
+      free(c->tx);
+      free(c->rx);
+      free(c->conn);
+    }
+    c->conn = malloc(CONN_SIZE);
+    c->rx = calloc(MAX + 1, 1);
+    c->tx = calloc(MAX + 1, 1);
+    memset(c->conn, 0, CONN_SIZE);
+  }
+  double malloc_time = now() - start;
+
+  printf("connections:        %zu (%d live)\n", connections, LIVE);
+  printf("pool   heap calls:  %zu total, %.3f per connection, %.1f ns per connection\n",
+         pool_calls, (double)pool_calls / connections, pool_time * 1e9 / connections);
+  printf("malloc heap calls:  %zu total, %.3f per connection, %.1f ns per connection\n",
+         6 * connections, 6.0, malloc_time * 1e9 / connections);
+
+  pool_destroy(&conn_pool);
+  pool_destroy(&buffer_pool);
+  return 0;
+}
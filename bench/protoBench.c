@@ -0,0 +1,123 @@
+// Directory command parsing benchmark.
+//
+// Feeds a stream of the directory's commands ("cl", "cr{TOPIC}" and
+// "s{TOPIC}; {PORT}", each in a `MAX` byte frame like the programs send) in
+// reads of a given size, and reports commands parsed per second by:
+//
+//  - sscanf : the old way, buffering each read and re-running every sscanf
+//             over the whole buffer until a command matches
+//  - dirproto : the incremental parser, which only looks at each byte once
+//
+// Usage: bench/protoBench [commands]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "common.h"
+#include "dirproto.h"
+
+#define FRAMES 3
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// What the old parse_client_msg() did on every read, returns 1 on a command
+static int sscanf_parse(const char *rx) {
+  char topic[MAX];
+  unsigned short port;
+
+  if (sscanf(rx, "cr%[^\n]", topic) == 1)
+    return 1;
+  if (strncmp(rx, "cl", 2) == 0)
+    return 1;
+  if (sscanf(rx, "s%[^;]; %hu", topic, &port) == 2)
+    return 1;
+  return 0;
+}
+
+static double run_sscanf(char frames[FRAMES][MAX], size_t commands, size_t chunk) {
+  char rx[MAX + 1];
+  size_t parsed = 0;
+
+  double start = now();
+  for (size_t n = 0; n < commands; n++) {
+    const char *frame = frames[n % FRAMES];
+    size_t rx_len = 0;
+
+    memset(rx, 0, sizeof(rx));
+    while (rx_len < MAX) {
+      size_t len = MAX - rx_len < chunk ? MAX - rx_len : chunk;
+      memcpy(rx + rx_len, frame + rx_len, len);
+      rx_len += len;
+      if (sscanf_parse(rx)) {
+        parsed++;
+        break;
+      }
+    }
+  }
+  double elapsed = now() - start;
+
+  if (parsed != commands) {
+    fprintf(stderr, "protoBench: sscanf parsed %zu of %zu commands\n", parsed, commands);
+    exit(1);
+  }
+  return commands / elapsed;
+}
+
+static double run_dirproto(char frames[FRAMES][MAX], size_t commands, size_t chunk) {
+  dirproto_t parser;
+  size_t parsed = 0, used, off;
+  int cmd;
+
+  dirproto_init(&parser);
+  double start = now();
+  for (size_t n = 0; n < commands; n++) {
+    const char *frame = frames[n % FRAMES];
+
+    for (size_t pos = 0; pos < MAX; pos += chunk) {
+      size_t len = MAX - pos < chunk ? MAX - pos : chunk;
+      for (off = 0; off < len; off += used) {
+        if ((cmd = dirproto_parse(&parser, frame + pos + off, len - off, &used)) < 0) {
+          fprintf(stderr, "protoBench: dirproto rejected a command\n");
+          exit(1);
+        }
+        if (cmd)
+          parsed++;
+      }
+    }
+  }
+  double elapsed = now() - start;
+
+  if (parsed != commands) {
+    fprintf(stderr, "protoBench: dirproto parsed %zu of %zu commands\n", parsed, commands);
+    exit(1);
+  }
+  return commands / elapsed;
+}
+
+int main(int argc, char **argv) {
+  size_t commands = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  const size_t chunks[] = {MAX, 16, 4};
+  static char frames[FRAMES][MAX];
+
+  if (!commands) {
+    fprintf(stderr, "Usage: %s [commands]\n", argv[0]);
+    exit(1);
+  }
+
+  snprintf(frames[0], MAX, "cl");
+  snprintf(frames[1], MAX, "crFlipper Hacks\n");
+  snprintf(frames[2], MAX, "sFlipper Hacks; 45001");
+
+  printf("%-10s %14s %14s\n", "read size", "sscanf cmd/s", "dirproto cmd/s");
+  for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+    printf("%-10zu %14.0f %14.0f\n", chunks[c],
+           run_sscanf(frames, commands, chunks[c]),
+           run_dirproto(frames, commands, chunks[c]));
+  }
+  return 0;
+}
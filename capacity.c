@@ -0,0 +1,45 @@
+#define _GNU_SOURCE
+#include "capacity.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+int parse_count(const char *arg, size_t *count) {
+  char *end;
+
+  errno = 0;
+  unsigned long long n = strtoull(arg, &end, 10);
+  if (errno || end == arg || *end != '\0' || n == 0 || arg[0] == '-')
+    return -1;
+
+  *count = n;
+  return 0;
+}
+
+size_t raise_fd_limit(size_t conns) {
+  struct rlimit lim;
+
+  if (getrlimit(RLIMIT_NOFILE, &lim) < 0) {
+    perror("can't get open file limit");
+    return conns;
+  }
+
+  rlim_t wanted = conns + FD_RESERVE;
+  if (lim.rlim_cur >= wanted)
+    return conns;
+
+  lim.rlim_cur = (lim.rlim_max != RLIM_INFINITY && lim.rlim_max < wanted)
+                     ? lim.rlim_max
+                     : wanted;
+  if (setrlimit(RLIMIT_NOFILE, &lim) < 0) {
+    perror("can't raise open file limit");
+    getrlimit(RLIMIT_NOFILE, &lim);
+  }
+
+  if (lim.rlim_cur >= wanted)
+    return conns;
+  if (lim.rlim_cur <= FD_RESERVE)
+    return 1;
+  return lim.rlim_cur - FD_RESERVE;
+}
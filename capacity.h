@@ -0,0 +1,22 @@
+#ifndef __CAPACITY_H__
+#define __CAPACITY_H__
+
+#include <stddef.h>
+
+// File descriptors kept back for everything other than client connections
+// (listening and directory sockets, certificate files, stdio, logs...)
+#define FD_RESERVE 16
+
+// Parse a positive count given on the command line.
+//
+// Returns 0 on success, -1 if `arg` isn't a positive number.
+int parse_count(const char *arg, size_t *count);
+
+// Raise the soft RLIMIT_NOFILE so `conns` connections fit alongside
+// `FD_RESERVE` other descriptors, going as high as the hard limit allows.
+//
+// Returns how many connections fit, which is less than `conns` if the hard
+// limit is too low.
+size_t raise_fd_limit(size_t conns);
+
+#endif
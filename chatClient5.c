@@ -8,6 +8,8 @@
 #include <gnutls/x509.h>
 #include "inet.h"
 #include "common.h"
+#include "tlsconf.h"
+#include "regshm.h"
 
 // TLS certificate files, located in /certificates
 #define CAFILE "openssl/rootCACert.pem" //set file location here
@@ -19,17 +21,20 @@
 // Prevents an unnecessary warning
 size_t strnlen(const char *s, size_t maxlen);
 
+int locallookup(unsigned long*, unsigned short*);
+void dirlookup(gnutls_certificate_credentials_t, gnutls_priority_t, unsigned long*, unsigned short*);
+
 int main()
 {
-	char s[MAX], input[MAX-2] = {'\0'};
+	char s[MAX];
 	fd_set			readset;
-	int				sockfd;
-	struct sockaddr_in dir_addr, serv_addr;
+	int				sockfd, handshake;
+	struct sockaddr_in serv_addr;
 	int				nread;	/* number of characters */
 	size_t				msglen;
 	unsigned short port;
 	unsigned long ip_addr;
-	//gnutls_priority_t priority_cache;
+	gnutls_priority_t priority_cache; // Parsed once, shared by both sessions
 	
 	// TLS Initialization
 	gnutls_session_t 	session;
@@ -50,6 +55,179 @@ int main()
 		gnutls_certificate_free_credentials(x509_cred);
 		exit(1);
 	}
+	if (tls_priority_init(&priority_cache, NULL) < 0) {
+		gnutls_global_deinit();
+		gnutls_certificate_free_credentials(x509_cred);
+		exit(1);
+	}
+
+	// Clients on the directory's host can find the server without talking to it
+	if (!locallookup(&ip_addr, &port)) {
+		dirlookup(x509_cred, priority_cache, &ip_addr, &port);
+	}
+
+
+	// Resume normal operations from Assignment 3
+
+	// Connect to server
+
+	/* Set up the address of the server to be contacted. */
+	memset((char *) &serv_addr, 0, sizeof(serv_addr));
+	serv_addr.sin_family			= AF_INET;
+	serv_addr.sin_addr.s_addr		= ip_addr;
+	serv_addr.sin_port			= htons(port);
+
+	/* Connect to the server. */
+	if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		perror("client: can't open stream socket (2)");
+		exit(1);
+	}
+
+	if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+		perror("client: can't connect to server");
+		exit(1);
+	}
+
+	if (gnutls_init(&session, GNUTLS_CLIENT) < 0) {
+		perror("client: TLS error: failed to initialize TLS session");
+		exit(1);
+	}
+	if(gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, x509_cred)<0 ){
+		perror("client: TLS error: failed credentials set");
+        exit(1);
+	}
+	if(gnutls_priority_set(session, priority_cache) < 0){
+        perror("client: TLS error: failed priority set");
+        exit(1);
+    }
+
+	// TLS Handshake with chat Server
+	gnutls_transport_set_int(session, sockfd);
+
+	if ((handshake = gnutls_handshake(session)) < 0){
+		fprintf(stderr, "%s:%d Server Handshake failed: %d:%s\n", __FILE__, __LINE__, handshake, gnutls_strerror(handshake));
+		close(sockfd);
+		gnutls_global_deinit();
+		gnutls_certificate_free_credentials(x509_cred);
+		exit(1);
+	}
+	else {
+		fprintf(stderr, "chat client: Server Handshake completed!\n");
+	}
+
+	for(;;) {
+
+		FD_ZERO(&readset);
+		FD_SET(STDIN_FILENO, &readset);
+		FD_SET(sockfd, &readset);
+
+		if (select(sockfd+1, &readset, NULL, NULL, NULL) > 0)
+		{
+			/* Check whether there's user input to read */
+			if (FD_ISSET(STDIN_FILENO, &readset)) {
+				if (fgets(s, MAX, stdin) != NULL) {
+					/* Send the user's message to the server */
+					// Handles that pesky extra newline
+					msglen = strnlen(s, MAX);
+					if (msglen > 0 && s[msglen - 1] == '\n') {
+						s[msglen - 1] = '\0';
+					}
+					gnutls_record_send(session, s, MAX);
+				} else {
+					printf("Error reading or parsing user input\n");
+				}
+			}
+
+			/* Check whether there's a message from the server to read */
+			/* (Catching up can send several at once, and gnutls may already
+			   hold the later ones, which select() can't see) */
+			if (FD_ISSET(sockfd, &readset)) {
+				do {
+					nread = gnutls_record_recv(session, s, MAX);
+					if (nread == GNUTLS_E_AGAIN || nread == GNUTLS_E_INTERRUPTED) {
+						// Only a session ticket came in
+					} else if (nread < 0) {
+						perror("Error reading from server\n");
+						exit(1);
+					} else if (nread == 0) {
+						printf("Server disconnected, shutting down client\n");
+						exit(0);
+					} else {
+						printf("%s\n", s);
+					}
+				} while (gnutls_record_check_pending(session) > 0);
+			}
+		}
+	}
+	gnutls_bye(session, GNUTLS_SHUT_RDWR);
+	close(sockfd);
+	gnutls_certificate_free_credentials(x509_cred);
+	gnutls_deinit(session);
+	gnutls_priority_deinit(priority_cache);
+	gnutls_global_deinit();
+}
+
+// Looks the user's topic up in the directory's shared memory snapshot, if
+// there's a fresh one on this host, picking its least loaded server
+// Returns 1 if it was looked up, 0 if the directory has to be asked instead
+int locallookup(unsigned long *ip_addr, unsigned short *port)
+{
+	static regshm_server_t servers[REGSHM_SERVERS];
+	char list[REGSHM_SERVERS * MAXTOPICLEN + 1] = {'\0'}, input[MAX-2] = {'\0'};
+	const regshm_t *registry;
+	const regshm_server_t *best = NULL;
+	size_t len = 0, inlen;
+	int i, j, count;
+
+	if ((registry = regshm_open(regshm_path())) == NULL || (count = regshm_read(registry, servers)) < 0) {
+		return 0;
+	}
+	fprintf(stderr, "chat client: Using the directory's registry snapshot\n");
+
+	// Same list the directory sends, each topic once
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < i; j++) {
+			if (strncmp(servers[j].topic, servers[i].topic, MAXTOPICLEN) == 0 && !servers[j].overloaded) {
+				break;
+			}
+		}
+		if (j == i && !servers[i].overloaded) {
+			len += snprintf(list + len, sizeof(list) - len, "%s\n", servers[i].topic);
+		}
+	}
+	printf("Servers: %s\n", list);
+
+	if (fgets(input, MAX - 2, stdin) == NULL) {
+		printf("Error reading or parsing user input\n");
+	}
+	inlen = strnlen(input, MAX - 2);
+	if (inlen > 0 && input[inlen - 1] == '\n') {
+		input[inlen - 1] = '\0';
+	}
+
+	for (i = 0; i < count; i++) {
+		if (strncmp(servers[i].topic, input, MAXTOPICLEN) == 0 && !servers[i].overloaded &&
+		    (best == NULL || servers[i].load < best->load)) {
+			best = &servers[i];
+		}
+	}
+	if (best == NULL) {
+		printf("No server for that topic, shutting down client\n");
+		exit(0);
+	}
+	*ip_addr = best->ip;
+	*port = best->port;
+	return 1;
+}
+
+// Asks the directory for the list of topics, then for the server of the one the user picks
+void dirlookup(gnutls_certificate_credentials_t x509_cred, gnutls_priority_t priority_cache, unsigned long *ip_addr, unsigned short *port)
+{
+	char s[MAX] = {'\0'}, input[MAX-2] = {'\0'};
+	int				sockfd, handshake;
+	struct sockaddr_in dir_addr;
+	int				nread;	/* number of characters */
+	gnutls_session_t 	session;
 
 	/* Set up the address of the directory to be contacted. */
 	memset((char *) &dir_addr, 0, sizeof(dir_addr));
@@ -77,7 +255,7 @@ int main()
 		perror("client: TLS error: failed credentials set");
         exit(1);
 	}
-	if(gnutls_set_default_priority(session) < 0){
+	if(gnutls_priority_set(session, priority_cache) < 0){
         perror("client: TLS error: failed priority set");
         exit(1);
     }
@@ -85,7 +263,6 @@ int main()
 
 	// TLS Handshake with Directory Server
 	gnutls_transport_set_int(session, sockfd);
-	int handshake;
 	LOOP_CHECK(handshake, gnutls_handshake(session));
 	if (handshake < 0){
 		// TLS Handshake error handling
@@ -110,8 +287,9 @@ int main()
 	snprintf(s, MAX, "cl");
 	gnutls_record_send(session, s, MAX);
 
-	// Read server list
-	if ((nread = gnutls_record_recv(session, s, MAX)) < 0) {
+	// Read server list (past any session tickets the directory sends first)
+	LOOP_CHECK(nread, gnutls_record_recv(session, s, MAX));
+	if (nread < 0) {
 		perror("Error reading server list from directory server");
 		exit(1);
 	} else if (nread == 0) {
@@ -125,12 +303,15 @@ int main()
 	if (fgets(input, MAX - 2, stdin) == NULL) {
 		printf("Error reading or parsing user input\n");
 	}
+	// The frame still holds the server list, clear it so none of that trails the request
+	memset(s, 0, MAX);
 	snprintf(s, MAX, "cr%s", input);
 
 	gnutls_record_send(session, s, MAX);
 
 	// Read server connection info
-	if ((nread = gnutls_record_recv(session, s, MAX)) < 0) {
+	LOOP_CHECK(nread, gnutls_record_recv(session, s, MAX));
+	if (nread < 0) {
 		printf("Error reading server connection info from directory server\n");
 		exit(1);
 	} else if (nread == 0) {
@@ -138,7 +319,7 @@ int main()
 		exit(0);
 	} else {
 		// Parsing
-		if (sscanf(s, "%lu;%hu", &ip_addr, &port) != 2) {
+		if (sscanf(s, "%lu;%hu", ip_addr, port) != 2) {
 			printf("Input parsing failed, closing client\n");
 			exit(1);
 		}
@@ -146,96 +327,4 @@ int main()
 		close(sockfd);
 		gnutls_deinit(session);
 	}
-
-
-	// Resume normal operations from Assignment 3
-
-	// Connect to server
-
-	/* Set up the address of the server to be contacted. */
-	memset((char *) &serv_addr, 0, sizeof(serv_addr));
-	serv_addr.sin_family			= AF_INET;
-	serv_addr.sin_addr.s_addr		= ip_addr;
-	serv_addr.sin_port			= htons(port);
-
-	/* Connect to the server. */
-	if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		perror("client: can't open stream socket (2)");
-		exit(1);
-	}
-
-	if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-		perror("client: can't connect to server");
-		exit(1);
-	}
-
-	if (gnutls_init(&session, GNUTLS_CLIENT) < 0) {
-		perror("client: TLS error: failed to initialize TLS session");
-		exit(1);
-	}
-	if(gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, x509_cred)<0 ){
-		perror("client: TLS error: failed credentials set");
-        exit(1);
-	}
-	if(gnutls_set_default_priority(session) < 0){
-        perror("client: TLS error: failed priority set");
-        exit(1);
-    }
-
-	// TLS Handshake with chat Server
-	gnutls_transport_set_int(session, sockfd);
-
-	if ((handshake = gnutls_handshake(session)) < 0){
-		fprintf(stderr, "%s:%d Server Handshake failed: %d:%s\n", __FILE__, __LINE__, handshake, gnutls_strerror(handshake));
-		close(sockfd);
-		gnutls_global_deinit();
-		gnutls_certificate_free_credentials(x509_cred);
-		exit(1);
-	}
-	else {
-		fprintf(stderr, "chat client: Server Handshake completed!\n");
-	}
-
-	for(;;) {
-
-		FD_ZERO(&readset);
-		FD_SET(STDIN_FILENO, &readset);
-		FD_SET(sockfd, &readset);
-
-		if (select(sockfd+1, &readset, NULL, NULL, NULL) > 0)
-		{
-			/* Check whether there's user input to read */
-			if (FD_ISSET(STDIN_FILENO, &readset)) {
-				if (fgets(s, MAX, stdin) != NULL) {
-					/* Send the user's message to the server */
-					// Handles that pesky extra newline
-					msglen = strnlen(s, MAX);
-					if (msglen > 0 && s[msglen - 1] == '\n') {
-						s[msglen - 1] = '\0';
-					}
-					gnutls_record_send(session, s, MAX);
-				} else {
-					printf("Error reading or parsing user input\n");
-				}
-			}
-
-			/* Check whether there's a message from the server to read */
-			if (FD_ISSET(sockfd, &readset)) {
-				if ((nread = gnutls_record_recv(session, s, MAX)) < 0) {
-					perror("Error reading from server\n");
-					exit(1);
-				} else if (nread == 0) {
-					printf("Server disconnected, shutting down client\n");
-					exit(0);
-				} else {
-					printf("%s\n", s);
-				}
-			}
-		}
-	}
-	gnutls_bye(session, GNUTLS_SHUT_RDWR);
-	close(sockfd);
-	gnutls_certificate_free_credentials(x509_cred);
-	gnutls_deinit(session);
-	gnutls_global_deinit();
 }
@@ -1,15 +1,36 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <stddef.h>
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
+#include <time.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/queue.h>
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
 #include "inet.h"
 #include "common.h"
+#include "pool.h"
+#include "nameset.h"
+#include "capacity.h"
+#include "netio.h"
+#include "ktls.h"
+#include "tlsconf.h"
+#include "log.h"
+#include "history.h"
+#include "msglog.h"
+#include "timerwheel.h"
+#include "relay.h"
+#include "presence.h"
+#include "admission.h"
+#include "ratelimit.h"
+#include "handoff.h"
 
 // TLS certificate files, located in /certificates-- individual server key and certificate files are defined in main
 #define CAFILE "openssl/rootCACert.pem" //set file location here
@@ -18,37 +39,305 @@
 		rval = cmd;   \
 	} while (rval == GNUTLS_E_AGAIN || rval == GNUTLS_E_INTERRUPTED)
 int TLSflag = 1; //whether or not server is certified 
+int KTLSflag = 0; //whether to hand record encryption to the kernel after handshakes
+gnutls_priority_t priority_cache; //TLS priorities, parsed once for every session
 
-// Prevents an unnecessary warning
-size_t strnlen(const char *s, size_t maxlen);
+// Most messages sent to a client (or peer) in one write
+#define BATCH_FRAMES 8
 
+// Sizes of the connections' I/O buffers
+#define INBUF_SIZE RELAY_FRAME
+#define OUTBUF_SIZE (BATCH_FRAMES * RELAY_FRAME)
+
+// Per-connection data that is only touched once a client is known to be
+// ready (cold). The fields checked for every client on every pass of the main
+// loop live in `struct conntable` instead.
 struct entry {
-	int fd;
+	uint64_t id; // Sender id of the client's messages in the history
+	size_t slot; // Where the client is in the table
+	int ready;   // Already queued for the read pass
+	int link;    // What's at the other end (LINK_*)
 	char name[MAXNAMELEN];
-	char *inptr, *outptr;
-	char inBuffer[MAX], outBuffer[MAX];
+	// I/O buffers, only held while there's a frame partly read or something
+	// to write, so idle clients don't tie them up (NULL otherwise)
+	char *inptr;
+	char *inBuffer;  // Peers send records, clients MAX byte frames (INBUF_SIZE)
+	char *outBuffer; // A reply, or a batch of messages from the history (OUTBUF_SIZE)
+	short outlen; // Bytes in outBuffer being written (one frame unless it's a batch)
 	gnutls_session_t session; //TLS session
-	LIST_ENTRY(entry) entries;
+	unsigned ktls; // Directions (KTLS_RX, KTLS_TX) the kernel does TLS for
+	netio_conn_t conn;
+	twtimer_t timer;    // Handshake, naming or idle deadline
+	int admit;          // Where its handshake is in admission control (ADMIT_*)
+	int resumed;        // Its ClientHello resumes a session
+	// Place among the handshakes waiting a turn, or the clients paused by
+	// their rate limits (never both); qpprev is NULL on neither
+	struct entry *qnext, **qpprev;
+	ratebucket_t msgbucket, bytebucket; // What a client has sent, against the topic's limits
+	uint64_t lastheard; // When the client last sent something (ms)
+	uint64_t peerid;    // Id of the server at the other end of a peer link
+	uint64_t lastseq;   // Sequence number of the last message relayed by it
+};
+
+// Entries waiting for something, oldest first
+struct entryq {
+	struct entry *head, **tail;
+};
+
+// Kinds of connection
+#define LINK_CLIENT	0 // A chat client
+#define LINK_PEERIN	1 // Another server of the topic, which connected to this one
+#define LINK_PEEROUT	2 // Another server of the topic, which this one connected to
+
+// Connection states
+#define CONN_NAMING	0 // Waiting for the client to pick a username
+#define CONN_CHATTING	1 // Client has a name and receives chat messages
+#define CONN_HANDSHAKE	2 // TLS handshake still going, not yet doing I/O through `io`
+#define CONN_PEERING	3 // Peer link waiting for the other server's hello
+#define CONN_PEER	4 // Peer link relaying messages
+
+// Most I/O events handled per pass of the main loop
+#define MAXEVENTS 1024
+
+// Messages between a server and the new one taking over from it (-H), in
+// this order: a hello each way, the listening sockets, the history, then
+// every client that can be moved without breaking its connection
+#define HANDOFF_HELLO	1 // struct handoffhello
+#define HANDOFF_READY	2 // The new server is registered and set up (empty)
+#define HANDOFF_LISTENER	3 // The clients' listening socket (empty)
+#define HANDOFF_MESHLISTENER	4 // The mesh listening socket, with its port
+#define HANDOFF_MESSAGE	5 // struct handoffmsg
+#define HANDOFF_CLIENT	6 // struct handoffclient, with the client's socket
+#define HANDOFF_WAITING	7 // A client yet to start its handshake (empty, just the socket)
+#define HANDOFF_DONE	8
+
+// Longest session ticket key handed over (gnutls makes 64 byte ones)
+#define TICKET_KEY_MAX 64
+
+struct handoffhello {
+	char topic[MAXTOPICLEN];
+	unsigned short port, meshport;
+	uint64_t nextid;
+	int firstuser;
+	unsigned keylen;
+	unsigned char ticketkey[TICKET_KEY_MAX]; // So the clients that were dropped can resume
+};
+
+struct handoffmsg {
+	uint64_t seq, origin;
+	char frame[MAX];
+};
+
+// A naming or chatting client, as far as the new server needs to carry on
+// with it: what it was in the middle of reading and writing goes along
+struct handoffclient {
+	uint64_t id, nextseq, lastheard;
+	ratebucket_t msgbucket, bytebucket;
+	unsigned char state;
+	unsigned ktls;
+	char name[MAXNAMELEN];
+	short inlen, outlen;
+	char in[INBUF_SIZE];
+	char out[OUTBUF_SIZE];
 };
 
-LIST_HEAD(listhead, entry);
+// Table of connected clients, laid out as a struct of arrays so the write
+// pass and broadcasts walk contiguous memory instead of chasing list
+// pointers. Slot `i` of every array belongs to the same client, and the
+// table is kept dense by moving the last client into any slot that is freed.
+//
+// Every array is allocated up front for `cap` clients, so accepting a client
+// never allocates.
+struct conntable {
+	size_t len, cap;
+	// Hot fields
+	unsigned char *state;
+	short *outleft; // Bytes of outBuffer still to be written
+	uint64_t *nextseq; // Next history message to send (chatting clients)
+	// Cold fields
+	struct entry **ent;
+};
+
+// Connection entries are recycled through a pool so client churn doesn't
+// fragment the heap
+pool_t entry_pool;
+
+// Connections take I/O buffers from these while they're busy and give them
+// back once they're idle, so the pools only grow to what's busy at once
+pool_t inbuf_pool, outbuf_pool;
+
+// Usernames of every chatting client, for O(1) repeated name checks
+nameset_t names;
+
+// Client socket I/O (epoll, or io_uring when asked for)
+netio_t io;
+
+// Clients still in their TLS handshake talk to their sockets directly, and
+// are watched through their own epoll instance until they're done
+int handshakefd;
+
+// Client handshakes let in at once (peers skip it), and the clients waiting
+// for a turn, oldest first, one list for resumed sessions and one for full
+// handshakes ([1] and [0])
+admission_t admission;
+struct entryq waitq[2];
+
+// Key for the session tickets clients resume with
+gnutls_datum_t ticketkey;
+
+// Connection deadlines, and the time the current pass of the main loop started
+timerwheel_t timers;
+uint64_t now;
+uint64_t nowus; // The same in microseconds, for the batching window
+
+// Messages are held back for up to `batchwindow` us (-w, 0 sends them right
+// away) so everyone gets the ones that arrive together in one write.
+// `batchdue` is when the messages gathering now go out (0 if there are none),
+// or sooner once there are BATCH_FRAMES of them from `batchfirst` on.
+unsigned long batchwindow;
+uint64_t batchdue, batchfirst;
+
+// Load reports to the directory, every HEARTBEAT_INTERVAL
+twtimer_t heartbeat;
+struct {
+	uint64_t seq, time; // History position and time of the last one
+	int pending;        // The last one couldn't be sent in full
+} lastheartbeat;
+
+int firstuser = 1;
+
+// How many messages and bytes a second each client can send (-r), with a
+// burst of CLIENT_BURST seconds' worth. Clients over them aren't read until
+// they're under again, and wait here until `pausetimer` goes off at
+// `pausedue` (us) for the first of them.
+ratelimit_t msglimit, bytelimit;
+struct entryq paused;
+twtimer_t pausetimer;
+uint64_t pausedue;
+
+// Joins and leaves since the last presence digest, sent out every
+// PRESENCE_INTERVAL while there are any
+presence_t presence;
+twtimer_t presencetimer;
+
+char topic[MAXTOPICLEN];
+
+// Ports clients, and the other servers of the topic (with -m), connect on
+unsigned short port, meshport;
 
+// Links to the other servers of the topic (only with -m)
+uint64_t serverid; // Origin of this server's messages on them
+size_t npeers;     // Peer links in the client table
+
+// Recent messages, for clients catching up
+history_t history;
+
+// On-disk copy of the history (only used with -l)
+msglog_t msglog = { .fd = -1 };
+
+// Next sender id for a new client
+uint64_t nextid = 1;
+
+// Where recently departed users had got to in the history, so they can pick
+// up from there if they come back under the same name
+#define DEPARTED_LEN 64
+struct departed {
+	char name[MAXNAMELEN];
+	uint64_t id, nextseq;
+} departed[DEPARTED_LEN];
+size_t departedpos = 0;
+
+// Set by SIGINT, the main loop reports and exits once its wait returns
+volatile sig_atomic_t caughtsignal;
+
+// Counters reported when the server shuts down
+struct metrics {
+	unsigned long accepted;      // Connections accepted
+	unsigned long rejected;      // Accepted connections closed because the server was full
+	unsigned long acceptbatches; // Wakeups that accepted at least one connection
+	int maxbatch;                // Most connections accepted in one wakeup
+	unsigned long ktls;          // Sessions offloaded to kernel TLS both ways
+	unsigned long resumed;       // Clients that caught up on missed messages
+	unsigned long missed;        // Messages clients fell too far behind to get
+	unsigned long timedout;      // Clients dropped for taking too long or going quiet
+	unsigned long relayedout;    // Messages relayed to peers (once per peer)
+	unsigned long relayedin;     // Messages relayed by peers
+	unsigned long relaydropped;  // Records from peers dropped as duplicates or loops
+	unsigned long batches;       // Writes of history messages to clients and peers
+	unsigned long batched;       // Messages in them
+	unsigned long paused;        // Times a client's reads were paused by its rate limits
+	size_t conns;                // Connections in the client table
+	size_t inbufs, outbufs;      // I/O buffers they hold
+} metrics;
+
+void entryq_init(struct entryq*);
+void entryq_push(struct entryq*, struct entry*);
+void entryq_remove(struct entryq*, struct entry*);
+int conntable_init(struct conntable*, size_t);
+int conntable_add(struct conntable*, struct entry*);
+void conntable_remove(struct conntable*, size_t);
+int openlistener(unsigned short, size_t);
+int addclient(struct conntable*, int, gnutls_certificate_credentials_t, int);
+int dialpeer(struct conntable*, struct sockaddr_in*, gnutls_certificate_credentials_t);
+int handshakeclient(struct conntable*, size_t);
+int admitclient(struct conntable*, size_t);
+void admitwaiting(struct conntable*);
+void unadmit(struct entry*);
+int startnaming(struct conntable*, size_t);
+int startpeer(struct conntable*, size_t);
+void expireclient(struct conntable*, struct entry*);
+void sendheartbeat(gnutls_session_t, struct conntable*);
+void removeclient(struct conntable*, size_t);
+void writeclients(struct conntable*);
+int readclient(struct conntable*, size_t);
+uint64_t ratewait(struct entry*);
+void pauseclient(struct entry*, uint64_t);
+void resumeclients(struct conntable*);
+int writeclient(struct conntable*, size_t);
+int handlemsg(struct conntable*, size_t);
+int handlepeer(struct conntable*, size_t);
 int nonblockread(struct entry*);
-void setoutmsgs(struct listhead*, struct entry*, char*);
+size_t framesize(struct entry*);
+void setoutmsgs(struct conntable*, size_t, char*);
+int sendreply(struct conntable*, size_t, const char*);
+char *outbuffer(struct entry*);
+void dropinbuffer(struct entry*);
+void dropoutbuffer(struct entry*);
+void appendmsg(const char*, uint64_t);
+int loadhistory(struct conntable*, size_t);
+void resumeclient(struct conntable*, size_t, uint64_t);
+void rejoinclient(struct conntable*, size_t);
+void notepresence(struct entry*, int);
+void sendpresence(void);
+void handover(struct conntable*, int, int, int);
+int freezeclient(struct conntable*, size_t);
+void packclient(struct conntable*, size_t, struct handoffclient*);
+void takeover(struct conntable*, int, int*, int*, gnutls_certificate_credentials_t);
+int takeclient(struct conntable*, int, const struct handoffclient*);
+void closemsglog(void);
+int waittimeout(void);
+uint64_t clockus(void);
 void sighandler(int);
+void printstats(int);
 
 int main(int argc, char **argv)
 {
-	int		sockfd, newsockfd, maxsockfd, dirsockfd, i, j, k, nwritten;
-	unsigned short	port;
-	unsigned int	clilen;
-	struct sockaddr_in cli_addr, serv_addr, dir_addr;
-	char msg[MAXMSGLEN], outmsg[MAX], topic[MAXTOPICLEN];
-	fd_set readset, writeset;
-	struct listhead clilist;
-	struct entry *currentry, *e2;
-	int firstuser = 1;
-	int numClients = 0;
+	int		sockfd, newsockfd, dirsockfd, i, j, n, nevents, nready, acceptready, meshready;
+	int		listenwatch, dirwatch, handshakewatch, iokind = NETIO_EPOLL;
+	int		resumeready = 0;
+	unsigned long	msgrate = CLIENT_MSG_RATE, byterate = CLIENT_BYTE_RATE;
+	int		meshfd = -1, meshwatch = -1, npeerlist = 0;
+	int		handoffsock = -1, handofffd = -1, handoffwatch = -1;
+	struct sockaddr_in dir_addr, peerlist[MAX_PEERS];
+	char outmsg[MAX], dirmsg[MAX + 1];
+	struct conntable ct;
+	size_t maxclients = MAX_CLIENTS, maxpeers = 0, backlog = 0, fits;
+	static netio_event_t events[MAXEVENTS];
+	static struct entry *ready[MAXEVENTS];
+	static struct epoll_event hsevents[MAXEVENTS];
+	twtimer_t *t, *tnext;
+	const char *priostr = NULL, *logdir = NULL, *handoffpath = NULL;
+	struct handoffhello hello;
 	
 
 	// TLS credential Initialization
@@ -61,6 +350,11 @@ int main(int argc, char **argv)
 		perror("chat server: TLS error: can't global init gnuTLS");
 		exit(1);
 	}
+	if (gnutls_session_ticket_key_generate(&ticketkey) < 0) {
+		perror("chat server: TLS error: can't generate session ticket key");
+		gnutls_global_deinit();
+		exit(1);
+	}
 	if (gnutls_certificate_allocate_credentials(&x509_cred) < 0){
 		perror("chat server: TLS error: failed to allocated x509 credentials");
 		gnutls_global_deinit();
@@ -74,19 +368,86 @@ int main(int argc, char **argv)
 	}
 	
 	//user input parse
-	if (argc != 3) {
+	while ((i = getopt(argc, argv, "c:b:ukp:l:m:w:r:H:")) != -1) {
+		switch (i) {
+		case 'c': // Max number of clients
+			if (parse_count(optarg, &maxclients) < 0) {
+				printf("Could not parse client capacity\n");
+				exit(0);
+			}
+			break;
+		case 'b': // Listen backlog
+			if (parse_count(optarg, &backlog) < 0) {
+				printf("Could not parse listen backlog\n");
+				exit(0);
+			}
+			break;
+		case 'u': // Use io_uring for client I/O
+			iokind = NETIO_URING;
+			break;
+		case 'k': // Use kernel TLS once clients finish their handshake
+			KTLSflag = 1;
+			break;
+		case 'p': // TLS priority string
+			priostr = optarg;
+			break;
+		case 'l': // Directory to log messages in
+			logdir = optarg;
+			break;
+		case 'm': // Port to link with the other servers of the topic on
+			if (sscanf(optarg, "%hu", &meshport) != 1 || meshport == 0) {
+				printf("Could not parse mesh port number\n");
+				exit(0);
+			}
+			maxpeers = MAX_PEERS;
+			break;
+		case 'w': // Broadcast batching window (us)
+			if (sscanf(optarg, "%lu", &batchwindow) != 1) {
+				printf("Could not parse batching window\n");
+				exit(0);
+			}
+			break;
+		case 'r': // Messages (and bytes) each client can send a second, 0 for no limit
+			byterate = 0;
+			if (sscanf(optarg, "%lu,%lu", &msgrate, &byterate) < 1) {
+				printf("Could not parse client rate limits\n");
+				exit(0);
+			}
+			break;
+		case 'H': // Unix socket to take over from the server running at (and hand over to the next one at)
+			handoffpath = optarg;
+			break;
+		default:
+			printf("Usage: %s [-c max clients] [-b listen backlog] [-u] [-k] [-p tls priorities] [-l log dir] [-m mesh port] [-w batching window (us)] [-r msgs[,bytes] per second] [-H handoff socket] topic port\n", argv[0]);
+			exit(0);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (log_init() < 0) {
+		perror("chat server: can't start log writer, logging directly");
+	}
+
+	if (tls_priority_init(&priority_cache, priostr) < 0) {
+		gnutls_global_deinit();
+		gnutls_certificate_free_credentials(x509_cred);
+		exit(1);
+	}
+
+	if (argc != 2) {
 		printf("Two arguments required: topic and port\n");
 		exit(0);
 	}
 
 	// Issue warning to server but continue (since it won't break anything)
-	if (strnlen(argv[1], MAXTOPICLEN) > MAXTOPICLEN - 1) {
+	if (strnlen(argv[0], MAXTOPICLEN) > MAXTOPICLEN - 1) {
 		printf("Topic name too long, will be truncated\n");
 	}
 
-	snprintf(topic, MAXTOPICLEN, "%s", argv[1]);
+	snprintf(topic, MAXTOPICLEN, "%s", argv[0]);
 
-	if (sscanf(argv[2], "%hu", &port) != 1) {
+	if (sscanf(argv[1], "%hu", &port) != 1) {
 		printf("Could not parse port number\n");
 		exit(0);
 	}
@@ -97,6 +458,28 @@ int main(int argc, char **argv)
 		exit(0);
 	}
 
+	// Take over from the server running at the handoff socket, if there is
+	// one; it carries on until this one has registered and set up (see takeover())
+	if (handoffpath && (handoffsock = handoff_connect(handoffpath, HANDOFF_TIMEOUT)) >= 0) {
+		int type, fd;
+
+		if (handoff_recv(handoffsock, &type, &hello, sizeof(hello), &fd) != sizeof(hello) || type != HANDOFF_HELLO) {
+			printf("The server at %s didn't say hello\n", handoffpath);
+			exit(1);
+		}
+		if (strncmp(hello.topic, topic, MAXTOPICLEN) != 0 || hello.port != port) {
+			printf("The server at %s is for %.*s on port %hu\n", handoffpath, MAXTOPICLEN, hello.topic, hello.port);
+			exit(1);
+		}
+		// New clients keep getting new ids, and old ones can resume their sessions
+		nextid = hello.nextid;
+		firstuser = hello.firstuser;
+		if (hello.keylen == ticketkey.size) {
+			memcpy(ticketkey.data, hello.ticketkey, hello.keylen);
+		}
+		printf("Taking over from the server at %s\n", handoffpath);
+	}
+
 	// register with directory (and keep connection open)
 	memset((char*) &dir_addr, 0, sizeof(dir_addr));
 	dir_addr.sin_family		= AF_INET;
@@ -108,8 +491,8 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 	
-	// TODO / FIXME : We probably don't need to set the Server -> Directory socket to nonblocking, right?
-	// If we don't need to, then there should be a comment here about why we don't need it to be nonblocking
+	// The socket blocks for the handshake and registration, then is made nonblocking so a
+	// stalled directory can't hold up the main loop when heartbeats are sent
 
 	if (connect(dirsockfd, (struct sockaddr *) &dir_addr, sizeof(dir_addr)) < 0) {
 		perror("server: can't connect to directory");
@@ -126,7 +509,7 @@ int main(int argc, char **argv)
 		perror("chat server: TLS error: failed credentials set");
         exit(1);
 	}
-	if(gnutls_set_default_priority(dSession) < 0){
+	if(gnutls_priority_set(dSession, priority_cache) < 0){
         perror("chat server: TLS error: failed priority set");
         exit(1);
     }
@@ -137,12 +520,12 @@ int main(int argc, char **argv)
 	LOOP_CHECK(handshake, gnutls_handshake(dSession));
 	if (handshake < 0){
 		// TLS Handshake error handling
-		fprintf(stderr, "%s:%d Directory Handshake failed: %s\n", __FILE__, __LINE__, gnutls_strerror(handshake));
+		LOG_ERROR("Directory Handshake failed: %s", gnutls_strerror(handshake));
 		gnutls_datum_t out;
 		int type = gnutls_certificate_type_get(dSession);
 		unsigned status = gnutls_session_get_verify_cert_status(dSession);
 		gnutls_certificate_verification_status_print(status, type, &out, 0);
-		fprintf(stderr, "cert verify output: %s\n", out.data);
+		LOG_ERROR("cert verify output: %s", out.data);
 		gnutls_free(out.data);
 		close(dirsockfd);
 		gnutls_global_deinit();
@@ -150,14 +533,44 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 	else {
-          fprintf(stderr, "chat server: Directory Handshake completed!\n");
+          LOG_INFO("Directory Handshake completed!");
     }
 
 	// Write topic and port to directory (and keep socket open so the directory knows
 	// the server is still up)
+	// (The directory reads whole frames, so the rest has to be zeros)
+	memset(outmsg, '\0', MAX);
 	snprintf(outmsg, MAX, "s%s; %hu", topic, port);
 	gnutls_record_send(dSession, outmsg, MAX);
 
+	// Join the topic's mesh, the directory answers with the servers in it to link to
+	if (meshport) {
+		if (relay_newid(&serverid) < 0) {
+			perror("server: can't pick a server id");
+			exit(1);
+		}
+		memset(outmsg, '\0', MAX);
+		snprintf(outmsg, MAX, "m%hu", meshport);
+		gnutls_record_send(dSession, outmsg, MAX);
+		memset(dirmsg, '\0', sizeof(dirmsg));
+		// (Past any session tickets the directory sends first)
+		LOOP_CHECK(handshake, gnutls_record_recv(dSession, dirmsg, MAX));
+		if (handshake <= 0 ||
+		    (npeerlist = relay_parse_peers(dirmsg, peerlist, MAX_PEERS)) < 0) {
+			printf("Directory refused the server or sent a bad peer list\n");
+			exit(1);
+		}
+		if (npeerlist > MAX_PEERS) {
+			LOG_WARN("Only linking to %d of %d peers", MAX_PEERS, npeerlist);
+			npeerlist = MAX_PEERS;
+		}
+	}
+
+	if (fcntl(dirsockfd, F_SETFL, fcntl(dirsockfd, F_GETFL) | O_NONBLOCK) < 0) {
+		perror("server: can't make directory socket nonblocking");
+		exit(1);
+	}
+
 	// TLS: Setting Certified server:
 	if (0 == strncmp("Birds", topic, MAXTOPICLEN)){
 		snprintf(keyFile, MAX, "openssl/serverBirdsKey.pem");
@@ -196,263 +609,268 @@ int main(int argc, char **argv)
 
 	// Continue with normal server operations
 
-	LIST_INIT(&clilist);
+	// Make sure every client (and peer) can get a socket, then size everything for them
+	if ((fits = raise_fd_limit(maxclients + maxpeers)) < maxclients + maxpeers) {
+		maxclients = fits > maxpeers ? fits - maxpeers : 0;
+		printf("Open file limit only allows %zu clients\n", maxclients);
+	}
+	if (backlog == 0) {
+		backlog = maxclients;
+	}
+
+	if (pool_init(&entry_pool, sizeof(struct entry), maxclients + maxpeers) < 0) {
+		perror("server: can't allocate client entry pool");
+		exit(1);
+	}
+	// Mostly idle clients don't need a buffer each, these grow as they get busy
+	if (pool_init(&inbuf_pool, INBUF_SIZE, 0) < 0 || pool_init(&outbuf_pool, OUTBUF_SIZE, 0) < 0) {
+		perror("server: can't allocate I/O buffer pools");
+		exit(1);
+	}
+
+	if (nameset_init(&names, maxclients) < 0) {
+		perror("server: can't allocate username set");
+		exit(1);
+	}
+
+	if (conntable_init(&ct, maxclients + maxpeers) < 0) {
+		perror("server: can't allocate client table");
+		exit(1);
+	}
+
+	admission_init(&admission, MAX_HANDSHAKES, HANDSHAKE_QUEUE);
+	entryq_init(&waitq[0]);
+	entryq_init(&waitq[1]);
+	entryq_init(&paused);
+	ratelimit_init(&msglimit, msgrate, msgrate * CLIENT_BURST);
+	ratelimit_init(&bytelimit, byterate, byterate * CLIENT_BURST);
+
+	if (history_init(&history, HISTORY_LEN) < 0) {
+		perror("server: can't allocate message history");
+		exit(1);
+	}
+
+	// Pick up the history from the last run
+	if (logdir) {
+		uint64_t seq, origin;
+
+		if (msglog_open(&msglog, logdir, &history) < 0) {
+			perror("server: can't open message log");
+			exit(1);
+		}
+		atexit(closemsglog);
+		printf("Recovered %lu messages from %s in %.2f ms\n", msglog.recovered, logdir, msglog.recovery_ms);
+
+		// New clients mustn't get the ids of old messages' senders
+		for (seq = history_first(&history); seq < history.next; seq++) {
+			history_get(&history, seq, &origin);
+			if (!relay_is_remote(origin) && origin >= nextid) {
+				nextid = origin + 1;
+			}
+		}
+	}
 
 	signal(SIGINT, sighandler);
 
-	/* Create communication endpoint */
-	if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		perror("server: can't open stream socket");
+	// Falls back to epoll on its own if io_uring was asked for but isn't available
+	if (netio_init(&io, iokind, maxclients + maxpeers, MAXEVENTS) < 0) {
+		perror("server: can't set up client I/O");
 		exit(1);
 	}
+	printf("Using %s for client I/O\n", netio_name(&io));
 
-	/* Add SO_REAUSEADDR option to prevent address in use errors (modified from: "Hands-On Network
-	* Programming with C" Van Winkle, 2019. https://learning.oreilly.com/library/view/hands-on-network-programming/9781789349863/5130fe1b-5c8c-42c0-8656-4990bb7baf2e.xhtml */
-	int true = 1;
-	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (void *)&true, sizeof(true)) < 0) {
-		perror("server: can't set stream socket address reuse option");
+	if ((handshakefd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror("server: can't create handshake epoll instance");
 		exit(1);
 	}
 
-	/* Bind socket to local address */
-	memset((char *) &serv_addr, 0, sizeof(serv_addr));
-	serv_addr.sin_family = AF_INET;
-	serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	serv_addr.sin_port		= htons(port);
+	nowus = clockus();
+	now = nowus / 1000;
+	timerwheel_init(&timers, TIMER_TICK, now);
 
-	if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-		perror("server: can't bind local address");
+	// Listening sockets and clients of the server being taken over, then
+	// whatever it didn't hand over
+	sockfd = -1;
+	if (handoffsock >= 0) {
+		takeover(&ct, handoffsock, &sockfd, &meshfd, x509_cred);
+	}
+	if (sockfd < 0) {
+		sockfd = openlistener(port, backlog);
+	}
+	if (meshport && meshfd < 0) {
+		meshfd = openlistener(meshport, maxpeers);
+	}
+	// Ready to hand over to the next one in turn
+	if (handoffpath && (handofffd = handoff_listen(handoffpath)) < 0) {
+		perror("server: can't listen on handoff socket");
 		exit(1);
 	}
 
-	/* now we're ready to start accepting client connections */
-	listen(sockfd, 5);
+	if ((listenwatch = netio_watch(&io, sockfd)) < 0 || (dirwatch = netio_watch(&io, dirsockfd)) < 0 ||
+	    (handshakewatch = netio_watch(&io, handshakefd)) < 0) {
+		perror("server: can't watch listening and directory sockets");
+		exit(1);
+	}
+	if (meshfd >= 0 && (meshwatch = netio_watch(&io, meshfd)) < 0) {
+		perror("server: can't watch mesh socket");
+		exit(1);
+	}
+	if (handofffd >= 0 && (handoffwatch = netio_watch(&io, handofffd)) < 0) {
+		perror("server: can't watch handoff socket");
+		exit(1);
+	}
+
+	lastheartbeat.seq = history.next;
+	lastheartbeat.time = now;
+	timerwheel_arm(&timers, &heartbeat, now, HEARTBEAT_INTERVAL);
+
+	// Servers that joined the mesh before this one wait for it to link to them
+	for (n = 0; n < npeerlist; n++) {
+		dialpeer(&ct, &peerlist[n], x509_cred);
+	}
 
 	for (;;) {
 
-		FD_ZERO(&readset);
-		FD_ZERO(&writeset);
-		FD_SET(sockfd, &readset);
-		FD_SET(dirsockfd, &readset);
+		// Everything logged during the last pass goes to disk in one go, before
+		// any of it is sent out
+		if (msglog.fd >= 0 && msglog_commit(&msglog) < 0) {
+			LOG_ERROR("Can't sync message log: %s", strerror(errno));
+		}
+
+		// Writing to clients
+		// (With io_uring this only queues the data, it's all sent at once by netio_wait)
+		writeclients(&ct);
 
-		maxsockfd = sockfd;
+		// Sleep until there's I/O or the next deadline
+		if ((nevents = netio_wait(&io, events, MAXEVENTS, waittimeout())) < 0) {
+			perror("server: can't wait for client I/O");
+			exit(1);
+		}
+		if (caughtsignal) {
+			printstats(caughtsignal);
+			exit(0);
+		}
+		nowus = clockus();
+		now = nowus / 1000;
 
-		LIST_FOREACH(currentry, &clilist, entries) {
-			FD_SET(currentry->fd, &readset);
-			// TODO / FIXME: Test this to make sure it works
-			//FD_SET(currentry->fd, &writeset);
-			if (&(currentry->outBuffer[MAX]) - currentry->outptr > 0) {
-				FD_SET(currentry->fd, &writeset);
+		nready = 0;
+		acceptready = 0;
+		meshready = 0;
+		for (n = 0; n < nevents; n++) {
+			if (events[n].type == NETIO_EV_WATCH) {
+				// If directory socket closes
+				if (events[n].id == dirwatch) {
+					// The directory only ever sends session tickets after
+					// registering, anything else means it's closed
+					int r = gnutls_record_recv(dSession, dirmsg, MAX);
+					if (r != GNUTLS_E_AGAIN && r != GNUTLS_E_INTERRUPTED) {
+						exit(1);
+					}
+					continue;
+				}
+				// A new server taking over, which this one only comes back from if it doesn't
+				if (events[n].id == handoffwatch) {
+					handover(&ct, handofffd, sockfd, meshfd);
+					continue;
+				}
+				// Move along every handshake that can make progress
+				if (events[n].id == handshakewatch) {
+					int nhs = epoll_wait(handshakefd, hsevents, MAXEVENTS, 0);
+					for (j = 0; j < nhs; j++) {
+						struct entry *e = hsevents[j].data.ptr;
+						handshakeclient(&ct, e->slot);
+					}
+					continue;
+				}
+				acceptready |= (events[n].id == listenwatch);
+				meshready |= (events[n].id == meshwatch);
+			} else if (events[n].type == NETIO_EV_RELEASE) {
+				// A client removed earlier is finally done with
+				pool_free(&entry_pool, events[n].conn->owner);
+			} else if (events[n].mask & NETIO_READABLE) {
+				struct entry *e = events[n].conn->owner;
+				if (!e->ready) {
+					e->ready = 1;
+					ready[nready++] = e;
+				}
 			}
-			if (maxsockfd < currentry->fd) {maxsockfd = currentry->fd;}
 		}
 
-		if ((i=select(maxsockfd+1, &readset, &writeset, NULL, NULL)) > 0) {
-			// If directory socket closes
-			if (FD_ISSET(dirsockfd, &readset)) {
-				// Anytime it is set, it must be closed
-				exit(1);
-			}
-			
-			/* Handle listening socket */
-			if (FD_ISSET(sockfd, &readset)) {
-				clilen = sizeof(cli_addr);
-				newsockfd = accept(sockfd, (struct sockaddr *) &cli_addr, &clilen);
+		/* Handle listening socket */
+		// Drain the backlog (up to a budget, so a connection storm can't starve existing clients)
+		if (acceptready) {
+			for (j = 0; j < ACCEPT_BUDGET; j++) {
+				newsockfd = accept4(sockfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
 				if (newsockfd < 0) {
-					perror("server: accept error");
-				} else {
-					if (numClients >= 5) {
-						printf("Too many clients, closing socket\n");
-						close(newsockfd);
+					if (errno == ECONNABORTED || errno == EINTR) {
+						continue;
 					}
-					if (fcntl(newsockfd, F_SETFL, O_NONBLOCK) != 0 ) {
-						perror("server: couldn't set new client socket to nonblocking");
-						close(newsockfd);
-					} else {
-						// Handle successful connection (set up new entry)
-						struct entry *newentry = malloc(sizeof(struct entry));
-						newentry->fd = newsockfd;
-						memset(newentry->name, '\0', MAXNAMELEN);
-						memset(newentry->inBuffer, '\0', MAX);
-						memset(newentry->outBuffer, '\0', MAX);
-						newentry->inptr = newentry->inBuffer;
-						newentry->outptr = newentry->outBuffer;
-
-						
-						//gnuTLS session setup if user is verified 
-						if(TLSflag){
-							if(gnutls_init(&newentry->session, GNUTLS_SERVER) < 0){
-								perror("directoryServer -- TLS error: failed to initialize session");
-								close(newsockfd);
-								free(newentry);
-								continue;
-							}
-							if(gnutls_credentials_set(newentry->session, GNUTLS_CRD_CERTIFICATE, x509_cred) < 0){
-								perror("directoryServer -- TLS error: failed to set credentials");
-								close(newsockfd);
-								free(newentry);
-								continue;
-							}
-							if(gnutls_set_default_priority(newentry->session) < 0){
-								perror("directoryServer -- TLS error: failed priority set");
-								close(newsockfd);
-								free(newentry);
-								continue;
-							}
-
-							// Set up transport layer
-							gnutls_transport_set_int(newentry->session, newsockfd);
-							
-							//TLS handshake with client
-							int handshake;
-							LOOP_CHECK(handshake, gnutls_handshake(newentry->session));
-							if (handshake < 0 ) {
-								//handshake failed, disconnect client
-								close(newsockfd);
-								free(newentry);
-
-								// TLS Handshake error handling
-								fprintf(stderr, "%s:%d Client Handshake failed: %d:%s\n", __FILE__, __LINE__, handshake, gnutls_strerror(handshake));
-								gnutls_datum_t out;
-								int type = gnutls_certificate_type_get(newentry->session);
-								unsigned status = gnutls_session_get_verify_cert_status(newentry->session);
-								gnutls_certificate_verification_status_print(status, type, &out, 0);
-								fprintf(stderr, "cert verify output: %s\n", out.data);
-								gnutls_free(out.data);
-
-								continue;
-							}
-							else { //successful handshake connection! add Client to list and begin communication
-								fprintf(stderr, "chat Server: Client Handshake completed!\n");
-								numClients = numClients + 1;
-							}
-							
-						
-						}
-						LIST_INSERT_HEAD(&clilist, newentry, entries);
-						snprintf(newentry->outBuffer, MAX, "Please input a username (max ten chars):");
+					if (errno != EAGAIN && errno != EWOULDBLOCK) {
+						perror("server: accept error");
 					}
+					break;
+				}
+				metrics.accepted++;
+				if (ct.len - npeers >= maxclients) {
+					LOG_WARN("Too many clients, closing socket");
+					close(newsockfd);
+					metrics.rejected++;
+				} else {
+					addclient(&ct, newsockfd, x509_cred, LINK_CLIENT);
 				}
 			}
-
-			// Reading from clients
-			currentry = LIST_FIRST(&clilist);
-			while (currentry != NULL) {
-				e2 = LIST_NEXT(currentry, entries);
-				if (FD_ISSET(currentry->fd, &readset)) {
-					// nonblockread returns 1 on finished receiving msg, 0 on partial read, -1 on failure or closed connection
-					if ((j=nonblockread(currentry)) == 1) {
-						// Client has no set name, name will be set based on message
-						if (strncmp(currentry->name, "\0", MAXNAMELEN) == 0) {
-							if (strncmp(currentry->inBuffer, "\0", MAXNAMELEN) == 0) {
-								snprintf(currentry->outBuffer, MAX, "An empty username is invalid, please enter a new name:");
-								currentry->outptr = currentry->outBuffer;
-							}
-							else {
-								int repeatname = 0;
-								struct entry *ent;
-								LIST_FOREACH(ent, &clilist, entries) {
-									if ((strncmp(ent->name, "\0", MAXNAMELEN) != 0) && (strncmp(currentry->inBuffer, ent->name, MAXNAMELEN-1) == 0)) {
-										repeatname = 1;
-									}
-								}
-								if (repeatname) {
-									snprintf(currentry->outBuffer, MAX, "That username is already taken, please enter a new name:");
-									currentry->outptr = currentry->outBuffer;
-								}
-								else {
-									// Add username
-									// This line has a truncation warning.  It's intended to truncate if the input is too large, so the warning is expected and fine.
-									snprintf(currentry->name, MAXNAMELEN, "%s", currentry->inBuffer);
-									if (firstuser) {
-										snprintf(currentry->outBuffer, MAX, "You are the first user to join the chat\nYou may now begin chatting (max msg length is 87 chars)");
-										firstuser = 0;
-									} else {
-										snprintf(currentry->outBuffer, MAX, "You may now begin chatting (max message length is 87 chars)");
-									}
-									currentry->outptr = currentry->outBuffer;
-									snprintf(outmsg, MAX, "%s has joined the chat", currentry->name);
-									setoutmsgs(&clilist, currentry, outmsg);
-								}
-							}
-						} else {
-							// User has name and sent message
-							if (snprintf(msg, MAXMSGLEN, "%s", currentry->inBuffer) > (MAXMSGLEN - 1)) {
-								snprintf(currentry->outBuffer, MAX, "Truncated: %s", msg);
-								currentry->outptr = currentry->outBuffer;
-							}
-							snprintf(outmsg, MAX, "%s: %s", currentry->name, msg);
-							// Send message to all clients except the writer
-							setoutmsgs(&clilist, currentry, outmsg);
-						}
-						// Reset client's buffer and pointer
-						memset(currentry->inBuffer, '\0', MAX);
-						currentry->inptr = currentry->inBuffer;
-					} else if (j == -1) { //FIX -- close TLS here
-						// Close socket, free entry, remove from list
-						gnutls_bye(currentry->session, GNUTLS_SHUT_RDWR);
-						close(currentry->fd);
-						gnutls_deinit(currentry->session);
-						if (strncmp(currentry->name, "\0", MAXNAMELEN) != 0) {
-							snprintf(outmsg, MAX, "%s has left the chat", currentry->name);
-							setoutmsgs(&clilist, currentry, outmsg);
-						}
-						LIST_REMOVE(currentry, entries);
-						free(currentry);
-						numClients = numClients - 1;
-					}
-					// Do nothing on partial read
+			if (j > 0) {
+				metrics.acceptbatches++;
+				if (j > metrics.maxbatch) {
+					metrics.maxbatch = j;
 				}
-				currentry = e2;
 			}
+		}
 
-			// Writing to clients
-			currentry = LIST_FIRST(&clilist);
-			while (currentry != NULL) {
-				e2 = LIST_NEXT(currentry, entries);
-				if (FD_ISSET(currentry->fd, &writeset) && ((k = &(currentry->outBuffer[MAX]) - currentry->outptr) > 0)) {
-					// Send message
-					if(!TLSflag) { //non TLS write
-						if ((nwritten = write(currentry->fd, currentry->outptr, k)) < 0) {
-							if (errno != EWOULDBLOCK && errno != EAGAIN) {
-								perror("server: write error on client socket");
-								// Close socket, free entry, remove from list
-								close(currentry->fd);
-								if (strncmp(currentry->name, "\0", MAXNAMELEN) != 0) {
-									snprintf(outmsg, MAX, "%s has left the chat", currentry->name);
-									setoutmsgs(&clilist, currentry, outmsg);
-								}
-								LIST_REMOVE(currentry, entries);
-								free(currentry);
-								numClients = numClients - 1;
-							}
-						} else {
-							currentry->outptr += nwritten;
-						}
-					}
-					else { //TLS write
-						if ((nwritten = gnutls_record_send(currentry->session, currentry->outptr, k)) < 0) {
-							if (errno != EWOULDBLOCK && errno != GNUTLS_E_INTERRUPTED && errno != GNUTLS_E_AGAIN) {
-								perror("server: write error on client socket");
-								// Close socket, free entry, remove from list
-								//FIX --add TLS memory cleanup
-								close(currentry->fd);
-								if (strncmp(currentry->name, "\0", MAXNAMELEN) != 0) {
-									snprintf(outmsg, MAX, "%s has left the chat", currentry->name);
-									setoutmsgs(&clilist, currentry, outmsg);
-								}
-								LIST_REMOVE(currentry, entries);
-								free(currentry);
-								numClients = numClients - 1;
-							}
-						} else {
-							currentry->outptr += nwritten;
-						}
-					}
+		// Servers of the topic that joined after this one linking to it
+		if (meshready) {
+			while ((newsockfd = accept4(meshfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+				if (npeers >= maxpeers) {
+					LOG_WARN("Too many peers, closing socket");
+					close(newsockfd);
+				} else {
+					addclient(&ct, newsockfd, x509_cred, LINK_PEERIN);
 				}
-				currentry = e2;
 			}
-		} /* end of if select */
+		}
+
+		// Reading from clients with something to read
+		// (Slots can move as clients leave, so each entry knows its own)
+		for (n = 0; n < nready; n++) {
+			ready[n]->ready = 0;
+			readclient(&ct, ready[n]->slot);
+		}
+
+		// Drop clients that ran out of time (and report to the directory when it's due)
+		for (t = timerwheel_expire(&timers, now); t != NULL; t = tnext) {
+			tnext = t->next;
+			if (t == &heartbeat) {
+				sendheartbeat(dSession, &ct);
+				continue;
+			}
+			if (t == &presencetimer) {
+				sendpresence();
+				continue;
+			}
+			if (t == &pausetimer) {
+				// Once the clients this pass is done with are gone
+				resumeready = 1;
+				continue;
+			}
+			expireclient(&ct, (struct entry *) ((char *) t - offsetof(struct entry, timer)));
+		}
+		if (resumeready) {
+			resumeready = 0;
+			resumeclients(&ct);
+		}
+
+		// Handshakes that finished or went away this pass make room for waiting ones
+		admitwaiting(&ct);
 	} /* end of infinite for loop */
 	//FIX-- Add TLS memory clean up here
 	close(sockfd);
@@ -460,36 +878,315 @@ int main(int argc, char **argv)
 	//return or exit(0) is implied; no need to do anything because main() ends
 }
 
+// Write pass: sends every client (and peer) what it has waiting, then what it
+// hasn't seen of the history, until it's caught up or can't take any more
+// (History only goes out once the batching window has closed)
+void writeclients(struct conntable *ct) {
+	size_t i;
+	int flush = !batchdue || nowus >= batchdue || history.next - batchfirst >= BATCH_FRAMES;
+
+	if (flush) {
+		batchdue = 0;
+	}
+	for (i = 0; i < ct->len; i++) {
+		while (!(ct->ent[i]->conn.flags & NETIO_WBLOCKED)) {
+			// Once a client's last message is out, it gets the next ones it hasn't seen
+			if (ct->outleft[i] == 0 && ((ct->state[i] != CONN_CHATTING && ct->state[i] != CONN_PEER) ||
+			    ct->nextseq[i] == history.next || !flush || !loadhistory(ct, i))) {
+				break;
+			}
+			if (writeclient(ct, i) < 0) {
+				// The last client was moved into this slot
+				i--;
+				break;
+			}
+			if (ct->outleft[i] > 0) {
+				break;
+			}
+		}
+	}
+}
+
+// Reads every full message a client has sent so far and handles each one
+// Returns 0, or -1 if the client was removed
+int readclient(struct conntable *ct, size_t i) {
+	struct entry *e = ct->ent[i];
+	uint64_t wait;
+	int j = 0;
+
+	// Left alone until its rate limits let it go on
+	if (e->qpprev) {
+		return 0;
+	}
+	e->lastheard = now;
+
+	// nonblockread returns 1 on finished receiving msg, 0 on partial read, -1 on failure or closed connection
+	// Keep going until there's nothing left, the backend won't report data that was already there
+	// (or until the client is over its rate limits, then it's read again once it isn't)
+	while (!(wait = ratewait(e)) && (j = nonblockread(e)) == 1) {
+		if (e->link == LINK_CLIENT) {
+			ratelimit_take(&msglimit, &e->msgbucket, nowus, 1);
+			ratelimit_take(&bytelimit, &e->bytebucket, nowus, strnlen(e->inBuffer, MAX));
+		}
+		if (handlemsg(ct, i) < 0) {
+			return -1;
+		}
+		// Reset client's buffer and pointer
+		memset(e->inBuffer, '\0', framesize(e));
+		e->inptr = e->inBuffer;
+	}
+
+	if (j == -1) {
+		// Close socket, free entry, remove from table
+		removeclient(ct, i);
+		return -1;
+	}
+	if (wait) {
+		pauseclient(e, wait);
+	}
+	// Keep the buffer for a partial read, there's nothing in it otherwise
+	if (e->inptr == e->inBuffer) {
+		dropinbuffer(e);
+	}
+	return 0;
+}
+
+// Returns how long (us) until the client `e` can send its next message, 0
+// if it can now (and for peers, which aren't limited)
+uint64_t ratewait(struct entry *e) {
+	uint64_t msgwait, bytewait;
+
+	if (e->link != LINK_CLIENT) {
+		return 0;
+	}
+	msgwait = ratelimit_wait(&msglimit, &e->msgbucket, nowus);
+	bytewait = ratelimit_wait(&bytelimit, &e->bytebucket, nowus);
+	return msgwait > bytewait ? msgwait : bytewait;
+}
+
+// Stops reading the client `e` for `wait` us, until it's under its rate
+// limits again; what it sends meanwhile waits in its socket
+void pauseclient(struct entry *e, uint64_t wait) {
+	entryq_push(&paused, e);
+	metrics.paused++;
+	if (!twtimer_armed(&pausetimer) || nowus + wait < pausedue) {
+		pausedue = nowus + wait;
+		timerwheel_arm(&timers, &pausetimer, now, (wait + 999) / 1000);
+	}
+}
+
+// Reads the paused clients that are under their rate limits again, and has
+// the rest looked at again when the first of them will be
+void resumeclients(struct conntable *ct) {
+	struct entry *e, *enext;
+	uint64_t wait, soonest = 0;
+
+	// Clients read here can be paused again, at the end of the list
+	for (e = paused.head; e != NULL; e = enext) {
+		enext = e->qnext;
+		if ((wait = ratewait(e)) > 0) {
+			if (!soonest || wait < soonest) {
+				soonest = wait;
+			}
+			continue;
+		}
+		entryq_remove(&paused, e);
+		readclient(ct, e->slot);
+	}
+	if (soonest && (!twtimer_armed(&pausetimer) || nowus + soonest < pausedue)) {
+		pausedue = nowus + soonest;
+		timerwheel_arm(&timers, &pausetimer, now, (soonest + 999) / 1000);
+	}
+}
+
+// Acts on a full message from the client in slot `i`
+// Returns 0, or -1 if the client was removed
+int handlemsg(struct conntable *ct, size_t i) {
+	char msg[MAXMSGLEN], outmsg[MAX];
+	struct entry *currentry = ct->ent[i];
+
+	if (currentry->link != LINK_CLIENT) {
+		return handlepeer(ct, i);
+	}
+
+	// Client has no set name, name will be set based on message
+	if (ct->state[i] == CONN_NAMING) {
+		if (strncmp(currentry->inBuffer, "\0", MAXNAMELEN) == 0) {
+			sendreply(ct, i, "An empty username is invalid, please enter a new name:");
+		}
+		else {
+			// Claims the name if it's free
+			int added = nameset_insert(&names, currentry->inBuffer);
+			if (added == 0) {
+				sendreply(ct, i, "That username is already taken, please enter a new name:");
+			}
+			else if (added < 0) {
+				perror("server: can't grow username set");
+				sendreply(ct, i, "The server is full, please try again later");
+			}
+			else {
+				// Add username
+				// Truncates on purpose if the input is too large
+				snprintf(currentry->name, MAXNAMELEN, "%s", currentry->inBuffer);
+				ct->state[i] = CONN_CHATTING;
+				// New messages only, unless they were here before
+				ct->nextseq[i] = history.next;
+				timerwheel_arm(&timers, &currentry->timer, now, IDLE_TIMEOUT);
+				rejoinclient(ct, i);
+				if (firstuser) {
+					sendreply(ct, i, "You are the first user to join the chat\nYou may now begin chatting (max msg length is 87 chars)");
+					firstuser = 0;
+				} else {
+					sendreply(ct, i, "You may now begin chatting (max message length is 87 chars)");
+				}
+				notepresence(currentry, 1);
+			}
+		}
+	} else if (strncmp(currentry->inBuffer, RESUME_CMD, strlen(RESUME_CMD)) == 0 &&
+		   (currentry->inBuffer[strlen(RESUME_CMD)] == ' ' || currentry->inBuffer[strlen(RESUME_CMD)] == '\0')) {
+		// "/resume [seq]": send everything after `seq` that's still kept (everything if no seq)
+		resumeclient(ct, i, strtoull(currentry->inBuffer + strlen(RESUME_CMD), NULL, 10));
+	} else {
+		// User has name and sent message
+		if (snprintf(msg, MAXMSGLEN, "%s", currentry->inBuffer) > (MAXMSGLEN - 1)) {
+			snprintf(outmsg, MAX, "Truncated: %s", msg);
+			sendreply(ct, i, outmsg);
+		}
+		snprintf(outmsg, MAX, "%s: %s", currentry->name, msg);
+		// Send message to all clients except the writer
+		setoutmsgs(ct, i, outmsg);
+	}
+	return 0;
+}
+
+// Acts on a full record from the peer link in slot `i`
+// Returns 0, or -1 if the link was removed
+int handlepeer(struct conntable *ct, size_t i) {
+	struct entry *e = ct->ent[i];
+	uint64_t origin, seq;
+	const char *frame = relay_decode(e->inBuffer, &origin, &seq);
+	size_t k;
+
+	if (ct->state[i] == CONN_PEERING) {
+		if (seq != RELAY_HELLO || strncmp(frame, topic, MAX) != 0) {
+			LOG_WARN("Peer isn't a server of this topic, dropping the link");
+			removeclient(ct, i);
+			return -1;
+		}
+		// Linked to itself, or to a server it already has a link to
+		for (k = 0; k < ct->len; k++) {
+			if (ct->state[k] == CONN_PEER && ct->ent[k]->peerid == origin) {
+				break;
+			}
+		}
+		if (origin == serverid || k < ct->len) {
+			LOG_WARN("Already linked to peer %016llx, dropping the new link", (unsigned long long) origin);
+			removeclient(ct, i);
+			return -1;
+		}
+		LOG_INFO("Linked to peer %016llx", (unsigned long long) origin);
+		e->peerid = origin;
+		e->lastseq = 0;
+		ct->state[i] = CONN_PEER;
+		// It gets messages sent from now on
+		ct->nextseq[i] = history.next;
+		timerwheel_cancel(&timers, &e->timer);
+		return 0;
+	}
+
+	// Only the server at the other end relays on its link, and only its own
+	// messages, each once and in order
+	if (origin != e->peerid || seq == RELAY_HELLO || seq <= e->lastseq) {
+		metrics.relaydropped++;
+		return 0;
+	}
+	e->lastseq = seq;
+	metrics.relayedin++;
+	appendmsg(frame, origin);
+	return 0;
+}
+
+// Writes as much of a client's out buffer as it will take
+// Returns 0, or -1 if the client was removed
+int writeclient(struct conntable *ct, size_t i) {
+	struct entry *currentry = ct->ent[i];
+	int k = ct->outleft[i];
+	char *out = &currentry->outBuffer[currentry->outlen - k];
+	int nwritten;
+
+	// Send message
+	if(!TLSflag || (currentry->ktls & KTLS_TX)) { //non TLS (or kernel TLS) write
+		nwritten = netio_send(&currentry->conn, out, k);
+		if (nwritten < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+			return 0;
+		}
+	}
+	else { //TLS write
+		nwritten = gnutls_record_send(currentry->session, out, k);
+		if (nwritten == GNUTLS_E_AGAIN || nwritten == GNUTLS_E_INTERRUPTED) {
+			return 0;
+		}
+	}
+	if (nwritten < 0) {
+		perror("server: write error on client socket");
+		// Close socket, free entry, remove from table
+		removeclient(ct, i);
+		return -1;
+	}
+	// All written, the buffer can go back until there's more
+	if ((ct->outleft[i] -= nwritten) == 0) {
+		dropoutbuffer(currentry);
+	}
+	return 0;
+}
+
+// Bytes in each message on a connection: records on peer links, frames from clients
+size_t framesize(struct entry *e) {
+	return e->link == LINK_CLIENT ? MAX : RELAY_FRAME;
+}
+
 // Attempts to read from a given client's socket
 // Returns 1 on reading full message, 0 on partial read, and -1 on read failure or closed connection
 int nonblockread(struct entry *e) {
+	char *end;
 	int nread = 0;
-	if(!TLSflag){ //non TLS read
-		if ((nread = read(e->fd, e->inptr, &e->inBuffer[MAX] - e->inptr)) < 0) {
+
+	// Idle clients have no buffer until they send something
+	if (!e->inBuffer) {
+		if (!(e->inBuffer = pool_alloc(&inbuf_pool))) {
+			LOG_ERROR("Can't allocate a read buffer, client connection removed");
+			return -1;
+		}
+		metrics.inbufs++;
+		memset(e->inBuffer, '\0', INBUF_SIZE);
+		e->inptr = e->inBuffer;
+	}
+	end = &e->inBuffer[framesize(e)];
+	if(!TLSflag || (e->ktls & KTLS_RX)){ //non TLS (or kernel TLS) read
+		if ((nread = netio_recv(&e->conn, e->inptr, end - e->inptr)) < 0) {
 			if (errno == EWOULDBLOCK || errno == EAGAIN) {
-				return 0; // msg not fully received; shouldn't happen, but best to be safe
+				return 0; // msg not fully received
 			}
-			fprintf(stderr, "%s:%d Error reading from client, client connection removed\n", __FILE__, __LINE__);
+			LOG_INFO("Error reading from client, client connection removed: %s", strerror(errno));
 			return -1;
 		}
 	}
 	else { //TLS read
-		if ((nread = gnutls_record_recv(e->session, e->inptr, &e->inBuffer[MAX] - e->inptr)) < 0) {
-			if (nread == -10) {
-				return -1; // Client disconnected, for WHATEVER REASON nread gets set to -10 instead of -1, DON'T ASK ME WHY
-			}
-			if (errno == EWOULDBLOCK || errno == GNUTLS_E_INTERRUPTED || errno == GNUTLS_E_AGAIN) {
-				return 0; // msg not fully received; shouldn't happen, but best to be safe
+		if ((nread = gnutls_record_recv(e->session, e->inptr, end - e->inptr)) < 0) {
+			if (nread == GNUTLS_E_AGAIN || nread == GNUTLS_E_INTERRUPTED) {
+				return 0; // msg not fully received
 			}
-			fprintf(stderr, "%s:%d TLS Error reading from client, client connection removed %d\n", __FILE__, __LINE__, errno);
+			// Includes GNUTLS_E_PREMATURE_TERMINATION (-110) and GNUTLS_E_UNEXPECTED_PACKET_LENGTH (-9/-10)
+			// when the client just drops the connection
+			LOG_INFO("TLS Error reading from client, client connection removed: %s", gnutls_strerror(nread));
 			return -1;
 		}
 	}
 	if (nread > 0) {
 		e->inptr += nread;
 		// Need to check if msg fully received
-		// Client always writes MAX
-		if (&(e->inBuffer[MAX]) == e->inptr) {
+		// Client always writes MAX (peers RELAY_FRAME)
+		if (end == e->inptr) {
 			return 1;
 		}
 		return 0;
@@ -498,19 +1195,1019 @@ int nonblockread(struct entry *e) {
 	return -1;
 }
 
-// Sets all clients' out buffers to the given message, other than the specified client
-void setoutmsgs(struct listhead *clilist, struct entry *currentry, char *outmsg) {
-	struct entry *readent;
+// Opens a nonblocking socket listening on `lport` (on every address)
+// Returns the socket
+int openlistener(unsigned short lport, size_t backlog) {
+	struct sockaddr_in serv_addr;
+	int sockfd;
 
-	LIST_FOREACH(readent, clilist, entries) {
-		if (readent != currentry && strncmp(readent->name, "\0", MAXNAMELEN) != 0) {
-			snprintf(readent->outBuffer, MAX, "%s", outmsg);
-			readent->outptr = readent->outBuffer;
-		}
+	/* Create communication endpoint */
+	// Nonblocking so the backlog can be drained until it's empty
+	if ((sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+		perror("server: can't open stream socket");
+		exit(1);
 	}
-}
 
-void sighandler(int signo) {
-	printf("\nCaught signal: %d\n", signo);
-	exit(0);
+	/* Add SO_REAUSEADDR option to prevent address in use errors (modified from: "Hands-On Network
+	* Programming with C" Van Winkle, 2019. https://learning.oreilly.com/library/view/hands-on-network-programming/9781789349863/5130fe1b-5c8c-42c0-8656-4990bb7baf2e.xhtml */
+	int true = 1;
+	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (void *)&true, sizeof(true)) < 0) {
+		perror("server: can't set stream socket address reuse option");
+		exit(1);
+	}
+
+	/* Bind socket to local address */
+	memset((char *) &serv_addr, 0, sizeof(serv_addr));
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	serv_addr.sin_port		= htons(lport);
+
+	if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+		perror("server: can't bind local address");
+		exit(1);
+	}
+
+	/* now we're ready to start accepting client connections */
+	if (listen(sockfd, backlog > INT_MAX ? INT_MAX : (int) backlog) < 0) {
+		perror("server: can't listen on local address");
+		exit(1);
+	}
+	return sockfd;
+}
+
+// Connects to another server of the topic, at the mesh port the directory gave for it, and adds the link to the table
+// Returns the link's slot, or -1 if it couldn't be made
+int dialpeer(struct conntable *ct, struct sockaddr_in *addr, gnutls_certificate_credentials_t x509_cred) {
+	int fd;
+
+	if (ct->len >= ct->cap) {
+		return -1;
+	}
+	if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		perror("server: can't open peer socket");
+		return -1;
+	}
+	// Only done at startup, like connecting to the directory, so this can block
+	if (connect(fd, (struct sockaddr *) addr, sizeof(*addr)) < 0 ||
+	    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+		LOG_WARN("Can't link to peer on port %hu: %s", ntohs(addr->sin_port), strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return addclient(ct, fd, x509_cred, LINK_PEEROUT);
+}
+
+// Sets up a new entry (and TLS session) for a freshly accepted, nonblocking client socket (or peer link, see LINK_*) and adds it to the table
+// Returns the client's slot, or -1 if the client was dropped
+int addclient(struct conntable *ct, int newsockfd, gnutls_certificate_credentials_t x509_cred, int link) {
+	int i;
+
+	struct entry *newentry = pool_alloc(&entry_pool);
+	if (newentry == NULL) {
+		perror("server: can't allocate client entry");
+		close(newsockfd);
+		return -1;
+	}
+	memset(newentry->name, '\0', MAXNAMELEN);
+	newentry->inptr = newentry->inBuffer = newentry->outBuffer = NULL;
+	newentry->ready = 0;
+	newentry->link = link;
+	newentry->ktls = 0;
+	newentry->session = NULL;
+	newentry->id = nextid++;
+	// Not on netio until its handshake is done, but writeclients() looks at its flags before then
+	memset(&newentry->conn, 0, sizeof(newentry->conn));
+	newentry->conn.fd = newsockfd;
+	newentry->timer.pprev = NULL;
+	newentry->lastheard = now;
+	newentry->peerid = 0;
+	newentry->lastseq = 0;
+	newentry->admit = ADMIT_NONE;
+	newentry->resumed = 0;
+	newentry->qpprev = NULL;
+	newentry->msgbucket = 0;
+	newentry->bytebucket = 0;
+
+	if (link != LINK_CLIENT) {
+		// Peer links can go quiet for as long as no one chats, let TCP notice if the other end is gone
+		int on = 1;
+		setsockopt(newsockfd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+		npeers++;
+	}
+	
+	//gnuTLS session setup if user is verified 
+	if(TLSflag){
+		// The server that connected is the TLS client on a peer link
+		if(gnutls_init(&newentry->session, link == LINK_PEEROUT ? GNUTLS_CLIENT : GNUTLS_SERVER) < 0){
+			perror("directoryServer -- TLS error: failed to initialize session");
+			goto fail;
+		}
+		if(gnutls_credentials_set(newentry->session, GNUTLS_CRD_CERTIFICATE, x509_cred) < 0){
+			perror("directoryServer -- TLS error: failed to set credentials");
+			goto fail_tls;
+		}
+		if(gnutls_priority_set(newentry->session, priority_cache) < 0){
+			perror("directoryServer -- TLS error: failed priority set");
+			goto fail_tls;
+		}
+		if (link != LINK_PEEROUT && gnutls_session_ticket_enable_server(newentry->session, &ticketkey) < 0) {
+			perror("server: TLS error: can't enable session tickets");
+			goto fail_tls;
+		}
+
+		// Set up transport layer
+		// (The handshake talks to the socket directly, whenever it's ready)
+		gnutls_transport_set_int(newentry->session, newsockfd);
+		struct epoll_event ev = {.events = EPOLLIN, .data.ptr = newentry};
+		if (epoll_ctl(handshakefd, EPOLL_CTL_ADD, newsockfd, &ev) < 0) {
+			perror("server: can't watch client handshake");
+			goto fail_tls;
+		}
+
+		i = conntable_add(ct, newentry);
+		ct->state[i] = CONN_HANDSHAKE;
+		timerwheel_arm(&timers, &newentry->timer, now, HANDSHAKE_TIMEOUT);
+
+		// The ClientHello is often here already
+		return handshakeclient(ct, i) < 0 ? -1 : i;
+	}
+
+	i = conntable_add(ct, newentry);
+	if (link != LINK_CLIENT) {
+		return startpeer(ct, i) < 0 ? -1 : i;
+	}
+	return startnaming(ct, i) < 0 ? -1 : i;
+
+fail_tls:
+	gnutls_deinit(newentry->session);
+	newentry->session = NULL;
+fail:
+	if (link != LINK_CLIENT) {
+		npeers--;
+	}
+	close(newsockfd);
+	pool_free(&entry_pool, newentry);
+	return -1;
+}
+
+// Takes the TLS handshake of the client in slot `i` as far as it can go
+// without blocking, and starts naming once it's done
+// Returns 0, or -1 if the client was removed
+int handshakeclient(struct conntable *ct, size_t i) {
+	struct entry *e = ct->ent[i];
+	int handshake;
+
+	// Clients don't get any further until they're let in
+	if (e->link == LINK_CLIENT && e->admit != ADMIT_ACTIVE && (handshake = admitclient(ct, i)) <= 0) {
+		return handshake;
+	}
+
+	handshake = gnutls_handshake(e->session);
+	if (handshake == GNUTLS_E_AGAIN || handshake == GNUTLS_E_INTERRUPTED) {
+		// Wait for whichever way gnutls got stuck
+		struct epoll_event ev = {.events = gnutls_record_get_direction(e->session) ? EPOLLOUT : EPOLLIN, .data.ptr = e};
+		epoll_ctl(handshakefd, EPOLL_CTL_MOD, e->conn.fd, &ev);
+		return 0;
+	}
+	if (handshake < 0) {
+		// TLS Handshake error handling
+		LOG_WARN("%s Handshake failed: %d:%s", e->link == LINK_CLIENT ? "Client" : "Peer", handshake, gnutls_strerror(handshake));
+		gnutls_datum_t out;
+		int type = gnutls_certificate_type_get(e->session);
+		unsigned status = gnutls_session_get_verify_cert_status(e->session);
+		gnutls_certificate_verification_status_print(status, type, &out, 0);
+		LOG_WARN("cert verify output: %s", out.data);
+		gnutls_free(out.data);
+		removeclient(ct, i);
+		return -1;
+	}
+	//successful handshake connection! begin communication
+	LOG_INFO("%s Handshake completed!", e->link == LINK_CLIENT ? "Client" : "Peer");
+	epoll_ctl(handshakefd, EPOLL_CTL_DEL, e->conn.fd, NULL);
+	unadmit(e);
+
+	// Let the kernel encrypt and decrypt records from here on, which makes TLS
+	// clients plain reads and writes for the rest of the server
+	if (KTLSflag) {
+		int k = ktls_enable(e->session, e->conn.fd);
+		if (k < 0 && errno == ENOENT) {
+			// No tls kernel module, so don't try again for every client
+			LOG_WARN("kTLS unavailable, using gnutls for records: %s", strerror(errno));
+			KTLSflag = 0;
+		} else if (k > 0) {
+			e->ktls = k;
+			if (k == (KTLS_RX | KTLS_TX)) {
+				metrics.ktls++;
+			}
+		}
+	}
+	if (e->link != LINK_CLIENT) {
+		return startpeer(ct, i);
+	}
+	return startnaming(ct, i);
+}
+
+// Hands the client in slot `i` to the I/O backend and asks it for a username
+// Returns 0, or -1 if the client was removed
+int startnaming(struct conntable *ct, size_t i) {
+	struct entry *e = ct->ent[i];
+
+	// The handshake talked to the socket directly, from here on it goes through the I/O backend
+	if (netio_add(&io, &e->conn, e->conn.fd, e) < 0) {
+		perror("server: can't set up client I/O");
+		removeclient(ct, i);
+		return -1;
+	}
+	if (TLSflag) {
+		netio_set_session(e->session, &e->conn);
+	}
+
+	ct->state[i] = CONN_NAMING;
+	timerwheel_arm(&timers, &e->timer, now, NAMING_TIMEOUT);
+	sendreply(ct, i, "Please input a username (max ten chars):");
+	return 0;
+}
+
+// Lets the client in slot `i` start its handshake, once its ClientHello
+// comes in, if there's room for it; otherwise it waits for a turn without
+// being read, or is dropped if too many are waiting already
+// Returns 1 if it can go ahead, 0 if not yet, -1 if it was removed
+int admitclient(struct conntable *ct, size_t i) {
+	struct entry *e = ct->ent[i];
+	int resumed = admission_hello(e->conn.fd);
+
+	// The handshake epoll says when it comes in
+	if (resumed < 0) {
+		return 0;
+	}
+	e->resumed = resumed;
+	e->admit = admission_offer(&admission, resumed);
+	if (e->admit == ADMIT_WAITING) {
+		epoll_ctl(handshakefd, EPOLL_CTL_DEL, e->conn.fd, NULL);
+		entryq_push(&waitq[resumed], e);
+		return 0;
+	}
+	if (e->admit == ADMIT_REJECTED) {
+		LOG_WARN("Too many handshakes waiting, closing socket");
+		removeclient(ct, i);
+		return -1;
+	}
+	return 1;
+}
+
+// Starts the handshakes of waiting clients (resumed sessions first) while
+// there's room
+void admitwaiting(struct conntable *ct) {
+	struct entry *e;
+
+	while (admission_room(&admission)) {
+		e = waitq[1].head ? waitq[1].head : waitq[0].head;
+		entryq_remove(&waitq[e->resumed], e);
+		admission_begin(&admission, e->resumed);
+		e->admit = ADMIT_ACTIVE;
+		struct epoll_event ev = {.events = EPOLLIN, .data.ptr = e};
+		epoll_ctl(handshakefd, EPOLL_CTL_ADD, e->conn.fd, &ev);
+		handshakeclient(ct, e->slot);
+	}
+}
+
+// Takes entry `e` out of admission control, when its handshake is done or it
+// goes away
+void unadmit(struct entry *e) {
+	if (e->admit == ADMIT_WAITING) {
+		entryq_remove(&waitq[e->resumed], e);
+	}
+	admission_end(&admission, e->admit, e->resumed);
+	e->admit = ADMIT_NONE;
+}
+
+// Hands the peer link in slot `i` to the I/O backend and says hello on it
+// Returns 0, or -1 if the link was removed
+int startpeer(struct conntable *ct, size_t i) {
+	struct entry *e = ct->ent[i];
+	char frame[MAX] = {'\0'};
+
+	if (netio_add(&io, &e->conn, e->conn.fd, e) < 0) {
+		perror("server: can't set up peer I/O");
+		removeclient(ct, i);
+		return -1;
+	}
+	if (TLSflag) {
+		netio_set_session(e->session, &e->conn);
+	}
+
+	// The other server has as long as a handshake takes to say hello back
+	ct->state[i] = CONN_PEERING;
+	timerwheel_arm(&timers, &e->timer, now, HANDSHAKE_TIMEOUT);
+	if (!outbuffer(e)) {
+		LOG_ERROR("Can't allocate a buffer for the peer hello, dropping the link");
+		removeclient(ct, i);
+		return -1;
+	}
+	snprintf(frame, MAX, "%s", topic);
+	relay_encode(e->outBuffer, serverid, RELAY_HELLO, frame);
+	e->outlen = ct->outleft[i] = RELAY_FRAME;
+	return 0;
+}
+
+// Called when the deadline of client `e` passes: drops it unless it has been
+// heard from since the timer was armed
+void expireclient(struct conntable *ct, struct entry *e) {
+	size_t i = e->slot;
+
+	// Chatting clients only get their idle timer pushed back when it fires,
+	// rather than on every message
+	if (ct->state[i] == CONN_CHATTING && now - e->lastheard < IDLE_TIMEOUT) {
+		timerwheel_arm(&timers, &e->timer, now, IDLE_TIMEOUT - (now - e->lastheard));
+		return;
+	}
+
+	LOG_INFO("Client %s timed out, removing it", ct->state[i] == CONN_HANDSHAKE ? "handshake" :
+		ct->state[i] == CONN_NAMING ? "naming" : ct->state[i] == CONN_PEERING ? "peer hello" : "idle");
+	metrics.timedout++;
+	removeclient(ct, i);
+}
+
+// Adds a message from the client in slot `skip` to the history, from which
+// it's sent to every other chatting client (and every peer) by the write pass
+void setoutmsgs(struct conntable *ct, size_t skip, char *outmsg) {
+	appendmsg(outmsg, ct->ent[skip]->id);
+}
+
+// Queues a one frame reply to the client in slot `i`
+// Returns 0, or -1 if there was no buffer for it and it was dropped
+int sendreply(struct conntable *ct, size_t i, const char *msg) {
+	struct entry *e = ct->ent[i];
+
+	if (!outbuffer(e)) {
+		LOG_ERROR("Can't allocate a buffer for a reply, dropping it");
+		return -1;
+	}
+	// strncpy pads the rest of the frame with zeros
+	strncpy(e->outBuffer, msg, MAX - 1);
+	e->outBuffer[MAX - 1] = '\0';
+	e->outlen = ct->outleft[i] = MAX;
+	return 0;
+}
+
+// Gives entry `e` an out buffer from the pool, unless it has one already
+// Returns the buffer, or NULL if the pool couldn't grow
+char *outbuffer(struct entry *e) {
+	if (!e->outBuffer && (e->outBuffer = pool_alloc(&outbuf_pool)) != NULL) {
+		metrics.outbufs++;
+	}
+	return e->outBuffer;
+}
+
+// Hand entry `e`'s read (or write) buffer back to its pool, if it has one
+void dropinbuffer(struct entry *e) {
+	if (e->inBuffer) {
+		pool_free(&inbuf_pool, e->inBuffer);
+		e->inBuffer = e->inptr = NULL;
+		metrics.inbufs--;
+	}
+}
+
+void dropoutbuffer(struct entry *e) {
+	if (e->outBuffer) {
+		pool_free(&outbuf_pool, e->outBuffer);
+		e->outBuffer = NULL;
+		metrics.outbufs--;
+	}
+}
+
+// Adds a message sent by `origin` (a client, or another server of the topic)
+// to the history and the log
+void appendmsg(const char *outmsg, uint64_t origin) {
+	uint64_t seq = history_append(&history, outmsg, origin);
+
+	if (batchwindow && !batchdue) {
+		batchdue = nowus + batchwindow;
+		batchfirst = seq;
+	}
+
+	if (msglog.fd >= 0 && msglog_append(&msglog, seq, history_get(&history, seq, NULL), origin) < 0) {
+		LOG_ERROR("Can't write message log, no longer logging: %s", strerror(errno));
+		msglog_close(&msglog);
+	}
+}
+
+// Loads the next history messages the client in slot `i` hasn't seen (and
+// didn't send) into its out buffer, up to BATCH_FRAMES of them to go out in
+// one write. Peers only get messages sent on this server, as records.
+// Returns 1 if any were loaded, 0 if it's caught up
+int loadhistory(struct conntable *ct, size_t i) {
+	struct entry *e = ct->ent[i];
+	const char *frame;
+	uint64_t seq, origin, first = history_first(&history);
+	size_t size = framesize(e), len = 0;
+
+	// Fell so far behind that messages were overwritten before it got them
+	if (ct->nextseq[i] < first) {
+		metrics.missed += first - ct->nextseq[i];
+		ct->nextseq[i] = first;
+	}
+	// Try again on the next pass if there's no buffer to be had
+	if (!outbuffer(e)) {
+		return 0;
+	}
+
+	while (ct->nextseq[i] < history.next && len < BATCH_FRAMES * size) {
+		seq = ct->nextseq[i]++;
+		frame = history_get(&history, seq, &origin);
+		if (e->link != LINK_CLIENT) {
+			// Messages from other servers were relayed by them already
+			if (!relay_is_remote(origin)) {
+				relay_encode(e->outBuffer + len, serverid, seq, frame);
+				len += RELAY_FRAME;
+				metrics.relayedout++;
+			}
+		} else if (origin != e->id) {
+			// Frames are stored exactly as sent, so this is just a copy
+			memcpy(e->outBuffer + len, frame, MAX);
+			len += MAX;
+		}
+	}
+	if (len == 0) {
+		dropoutbuffer(e);
+		return 0;
+	}
+	e->outlen = ct->outleft[i] = len;
+	metrics.batches++;
+	metrics.batched += len / size;
+	return 1;
+}
+
+// Has the client in slot `i` catch up on every message after `seq` that is
+// still in the history
+void resumeclient(struct conntable *ct, size_t i, uint64_t seq) {
+	uint64_t first = history_first(&history);
+
+	if (seq + 1 < first) {
+		seq = first - 1;
+	}
+	if (seq + 1 < ct->nextseq[i]) {
+		ct->nextseq[i] = seq + 1;
+		metrics.resumed++;
+	}
+}
+
+// Picks up where a user who left recently got to, if the client in slot `i`
+// took the same name
+void rejoinclient(struct conntable *ct, size_t i) {
+	struct entry *e = ct->ent[i];
+	size_t n, k;
+
+	// Newest departures first
+	for (n = 1; n <= DEPARTED_LEN; n++) {
+		k = (departedpos - n) % DEPARTED_LEN;
+		if (departed[k].nextseq && strncmp(departed[k].name, e->name, MAXNAMELEN) == 0) {
+			// Same sender as before, so their own messages aren't sent back to them
+			e->id = departed[k].id;
+			resumeclient(ct, i, departed[k].nextseq - 1);
+			departed[k].nextseq = 0;
+			return;
+		}
+	}
+}
+
+// Notes that the user of entry `e` joined the chat (or left it, if `joined`
+// is 0), for the next presence digest
+void notepresence(struct entry *e, int joined) {
+	if (presence_add(&presence, e->name, e->id, joined)) {
+		timerwheel_arm(&timers, &presencetimer, now, PRESENCE_INTERVAL);
+	}
+}
+
+// Adds the digest of the joins and leaves since the last one to the history
+// (one message, however many there were)
+void sendpresence(void) {
+	char frame[MAX];
+	uint64_t origin;
+
+	if (presence_flush(&presence, frame, &origin)) {
+		appendmsg(frame, origin);
+	}
+}
+
+// Hands the listening sockets, history and clients over to a new server
+// connecting on the handoff socket `listenfd` (see HANDOFF_*), then exits.
+// Only returns, carrying on as before, if the new server never got ready.
+void handover(struct conntable *ct, int listenfd, int sockfd, int meshfd) {
+	static struct handoffclient c;
+	struct handoffhello hello = { .port = port, .meshport = meshport, .nextid = nextid, .firstuser = firstuser };
+	struct handoffmsg m;
+	struct entry *e;
+	uint64_t seq;
+	size_t i, moved = 0, dropped = 0;
+	int sock, type, fd;
+
+	if ((sock = handoff_accept(listenfd, HANDOFF_TIMEOUT)) < 0) {
+		perror("server: can't accept on handoff socket");
+		return;
+	}
+	memcpy(hello.topic, topic, MAXTOPICLEN);
+	if (ticketkey.size <= TICKET_KEY_MAX) {
+		hello.keylen = ticketkey.size;
+		memcpy(hello.ticketkey, ticketkey.data, ticketkey.size);
+	}
+	// It registers with the directory meanwhile, which drops this server
+	if (handoff_send(sock, HANDOFF_HELLO, &hello, sizeof(hello), -1) < 0 ||
+	    handoff_recv(sock, &type, NULL, 0, &fd) < 0 || type != HANDOFF_READY) {
+		LOG_WARN("New server didn't take over: %s", strerror(errno));
+		close(sock);
+		return;
+	}
+	printf("Handing over to the new server\n");
+
+	// Nothing more is read or sent from here on. Clients that can't be moved
+	// are dropped first, so the new server tells everyone they left, and
+	// what the others sent is handled, so it's in the history handed over.
+	if (netio_freeze(&io, HANDOFF_TIMEOUT) < 0) {
+		// Nothing has been handed over yet, so this server carries on (and
+		// the new one gives up)
+		perror("server: can't stop client I/O, not handing over");
+		close(sock);
+		return;
+	}
+	for (i = 0; i < ct->len; i++) {
+		e = ct->ent[i];
+		if (e->link != LINK_CLIENT) {
+			continue;
+		}
+		// Clients that haven't started their handshake haven't been read, so
+		// the new server can start them from scratch
+		if (ct->state[i] == CONN_HANDSHAKE ? e->admit == ADMIT_ACTIVE : freezeclient(ct, i) < 0) {
+			removeclient(ct, i--);
+			dropped++;
+		}
+	}
+	sendpresence();
+	if (msglog.fd >= 0) {
+		msglog_close(&msglog);
+	}
+
+	if (handoff_send(sock, HANDOFF_LISTENER, NULL, 0, sockfd) < 0 ||
+	    (meshfd >= 0 && handoff_send(sock, HANDOFF_MESHLISTENER, &meshport, sizeof(meshport), meshfd) < 0)) {
+		perror("server: handoff failed");
+		exit(1);
+	}
+	for (seq = history_first(&history); seq < history.next; seq++) {
+		m.seq = seq;
+		memcpy(m.frame, history_get(&history, seq, &m.origin), MAX);
+		if (handoff_send(sock, HANDOFF_MESSAGE, &m, sizeof(m), -1) < 0) {
+			perror("server: handoff failed");
+			exit(1);
+		}
+	}
+	for (i = 0; i < ct->len; i++) {
+		e = ct->ent[i];
+		if (e->link != LINK_CLIENT) {
+			continue;
+		}
+		if (ct->state[i] == CONN_HANDSHAKE) {
+			type = handoff_send(sock, HANDOFF_WAITING, NULL, 0, e->conn.fd);
+		} else {
+			packclient(ct, i, &c);
+			type = handoff_send(sock, HANDOFF_CLIENT, &c, sizeof(c), e->conn.fd);
+		}
+		if (type == 0) {
+			moved++;
+		} else {
+			dropped++;
+		}
+	}
+	handoff_send(sock, HANDOFF_DONE, NULL, 0, -1);
+
+	// Peer links just close, the new server links to the peers itself (and
+	// the clients that were dropped reconnect, resuming their TLS sessions)
+	printf("Handed over %zu clients, %zu couldn't be\n", moved, dropped);
+	log_flush();
+	exit(0);
+}
+
+// Handles everything the naming or chatting client in slot `i` sent that was
+// already read in (by the I/O backend or gnutls), and gets it ready to be
+// handed over. A TLS session can only move on kernel TLS, once gnutls holds
+// nothing of it, and a client only moves if what it has waiting to be
+// written fits a buffer.
+// Returns 0, or -1 if the client can't be moved
+int freezeclient(struct conntable *ct, size_t i) {
+	struct entry *e = ct->ent[i];
+	size_t nunsent;
+	int j = 0, k;
+
+	while ((netio_pending(&e->conn) ||
+	        (TLSflag && !(e->ktls & KTLS_RX) && gnutls_record_check_pending(e->session))) &&
+	       (j = nonblockread(e)) == 1) {
+		handlemsg(ct, i);
+		memset(e->inBuffer, '\0', framesize(e));
+		e->inptr = e->inBuffer;
+	}
+	netio_unsent(&e->conn, &nunsent);
+	if (j < 0 || nunsent + ct->outleft[i] > OUTBUF_SIZE) {
+		return -1;
+	}
+	if (TLSflag && e->ktls != (KTLS_RX | KTLS_TX)) {
+		// Records gnutls encrypted but didn't send can't go out on kernel TLS
+		if (e->ktls || nunsent) {
+			return -1;
+		}
+		if ((k = ktls_enable(e->session, e->conn.fd)) > 0) {
+			e->ktls = k;
+		}
+		if (k != (KTLS_RX | KTLS_TX)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Describes the client in slot `i`, readied by freezeclient(), in `c`
+void packclient(struct conntable *ct, size_t i, struct handoffclient *c) {
+	struct entry *e = ct->ent[i];
+	size_t nunsent;
+	const char *unsent = netio_unsent(&e->conn, &nunsent);
+
+	c->id = e->id;
+	c->nextseq = ct->nextseq[i];
+	c->lastheard = e->lastheard;
+	c->msgbucket = e->msgbucket;
+	c->bytebucket = e->bytebucket;
+	c->state = ct->state[i];
+	c->ktls = e->ktls;
+	memcpy(c->name, e->name, MAXNAMELEN);
+	c->inlen = e->inBuffer ? e->inptr - e->inBuffer : 0;
+	if (c->inlen > 0) {
+		memcpy(c->in, e->inBuffer, c->inlen);
+	}
+	// What the backend hadn't sent yet goes out before the rest of the out buffer
+	if (nunsent > 0) {
+		memcpy(c->out, unsent, nunsent);
+	}
+	if (ct->outleft[i] > 0) {
+		memcpy(c->out + nunsent, &e->outBuffer[e->outlen - ct->outleft[i]], ct->outleft[i]);
+	}
+	c->outlen = nunsent + ct->outleft[i];
+}
+
+// Takes over from the server at the other end of the handoff socket `sock`,
+// which has said hello: tells it this one is ready, then sets up the
+// listening sockets (in `*sockfd` and `*meshfd`), history and clients it
+// hands over
+void takeover(struct conntable *ct, int sock, int *sockfd, int *meshfd, gnutls_certificate_credentials_t x509_cred) {
+	static union {
+		struct handoffmsg m;
+		struct handoffclient c;
+		unsigned short port;
+	} msg;
+	size_t clients = 0, messages = 0;
+	ssize_t len;
+	int type, fd;
+
+	if (handoff_send(sock, HANDOFF_READY, NULL, 0, -1) < 0) {
+		perror("server: can't take over");
+		close(sock);
+		return;
+	}
+	while ((len = handoff_recv(sock, &type, &msg, sizeof(msg), &fd)) >= 0 && type != HANDOFF_DONE) {
+		switch (type) {
+		case HANDOFF_LISTENER:
+			*sockfd = fd;
+			break;
+		case HANDOFF_MESHLISTENER:
+			// Only if this server links to its peers on the same port
+			if (meshport && len == sizeof(msg.port) && msg.port == meshport) {
+				*meshfd = fd;
+			} else if (fd >= 0) {
+				close(fd);
+			}
+			break;
+		case HANDOFF_MESSAGE:
+			// Messages the log had are in the history already
+			if (len == sizeof(msg.m) && msg.m.seq >= history.next) {
+				history_restore(&history, msg.m.seq, msg.m.frame, msg.m.origin);
+				messages++;
+				if (msglog.fd >= 0 && msglog_append(&msglog, msg.m.seq, msg.m.frame, msg.m.origin) < 0) {
+					LOG_ERROR("Can't write message log, no longer logging: %s", strerror(errno));
+					msglog_close(&msglog);
+				}
+			}
+			break;
+		case HANDOFF_WAITING:
+			if (fd >= 0 && ct->len < ct->cap && addclient(ct, fd, x509_cred, LINK_CLIENT) >= 0) {
+				clients++;
+			}
+			break;
+		case HANDOFF_CLIENT:
+			if (len == sizeof(msg.c) && fd >= 0) {
+				clients += takeclient(ct, fd, &msg.c) >= 0;
+			} else if (fd >= 0) {
+				close(fd);
+			}
+			break;
+		default:
+			if (fd >= 0) {
+				close(fd);
+			}
+		}
+	}
+	if (len < 0) {
+		perror("server: handoff cut short");
+	}
+	close(sock);
+	printf("Took over %zu clients and %zu messages\n", clients, messages);
+}
+
+// Adds a client handed over by the server this one took over from to the
+// table, as it was there, on socket `fd`
+// Returns the client's slot, or -1 if it couldn't be taken (and `fd` is closed)
+int takeclient(struct conntable *ct, int fd, const struct handoffclient *c) {
+	struct entry *e;
+	int i;
+
+	// Only ever moved on kernel TLS, gnutls has no session for it here
+	if (ct->len >= ct->cap || (TLSflag && c->ktls != (KTLS_RX | KTLS_TX)) ||
+	    c->inlen < 0 || c->inlen >= MAX || c->outlen < 0 || c->outlen > OUTBUF_SIZE) {
+		close(fd);
+		return -1;
+	}
+	if ((e = pool_alloc(&entry_pool)) == NULL) {
+		perror("server: can't allocate client entry");
+		close(fd);
+		return -1;
+	}
+	memset(e, 0, sizeof(*e));
+	e->link = LINK_CLIENT;
+	e->id = c->id;
+	memcpy(e->name, c->name, MAXNAMELEN);
+	e->name[MAXNAMELEN - 1] = '\0';
+	e->ktls = TLSflag ? c->ktls : 0;
+	e->lastheard = c->lastheard;
+	e->msgbucket = c->msgbucket;
+	e->bytebucket = c->bytebucket;
+	e->admit = ADMIT_NONE;
+
+	i = conntable_add(ct, e);
+	ct->state[i] = c->state == CONN_CHATTING ? CONN_CHATTING : CONN_NAMING;
+	ct->nextseq[i] = c->nextseq;
+	if (netio_add(&io, &e->conn, fd, e) < 0) {
+		perror("server: can't set up client I/O");
+		ct->state[i] = CONN_NAMING;
+		removeclient(ct, i);
+		return -1;
+	}
+	if (ct->state[i] == CONN_CHATTING) {
+		nameset_insert(&names, e->name);
+		timerwheel_arm(&timers, &e->timer, now, IDLE_TIMEOUT);
+	} else {
+		timerwheel_arm(&timers, &e->timer, now, NAMING_TIMEOUT);
+	}
+
+	if (c->inlen > 0 && (e->inBuffer = pool_alloc(&inbuf_pool)) != NULL) {
+		metrics.inbufs++;
+		memset(e->inBuffer, '\0', INBUF_SIZE);
+		memcpy(e->inBuffer, c->in, c->inlen);
+		e->inptr = e->inBuffer + c->inlen;
+	}
+	if (c->outlen > 0 && outbuffer(e)) {
+		memcpy(e->outBuffer, c->out, c->outlen);
+		e->outlen = ct->outleft[i] = c->outlen;
+	}
+	return i;
+}
+
+// Empties `q`
+void entryq_init(struct entryq *q) {
+	q->head = NULL;
+	q->tail = &q->head;
+}
+
+// Adds entry `e` to the end of `q`
+void entryq_push(struct entryq *q, struct entry *e) {
+	e->qnext = NULL;
+	e->qpprev = q->tail;
+	*q->tail = e;
+	q->tail = &e->qnext;
+}
+
+// Takes entry `e` out of `q`, wherever it is in it
+void entryq_remove(struct entryq *q, struct entry *e) {
+	*e->qpprev = e->qnext;
+	if (e->qnext) {
+		e->qnext->qpprev = e->qpprev;
+	} else {
+		q->tail = e->qpprev;
+	}
+	e->qpprev = NULL;
+}
+
+// Allocates every array of the table with room for `cap` clients
+// Returns 0 on success, -1 on failure
+int conntable_init(struct conntable *ct, size_t cap) {
+	ct->len = 0;
+	ct->cap = cap;
+	ct->state = calloc(cap, sizeof(*ct->state));
+	ct->outleft = calloc(cap, sizeof(*ct->outleft));
+	ct->nextseq = calloc(cap, sizeof(*ct->nextseq));
+	ct->ent = calloc(cap, sizeof(*ct->ent));
+	if (!ct->state || !ct->outleft || !ct->nextseq || !ct->ent) {
+		return -1;
+	}
+	return 0;
+}
+
+// Appends a client to the table, which must not be full
+// Returns the client's slot
+int conntable_add(struct conntable *ct, struct entry *e) {
+	ct->state[ct->len] = CONN_NAMING;
+	ct->outleft[ct->len] = 0;
+	ct->nextseq[ct->len] = 0;
+	ct->ent[ct->len] = e;
+	e->slot = ct->len;
+	metrics.conns++;
+	return ct->len++;
+}
+
+// Removes the client in slot `i` by moving the last client into its place
+void conntable_remove(struct conntable *ct, size_t i) {
+	size_t last = --ct->len;
+
+	metrics.conns--;
+	if (i != last) {
+		ct->state[i] = ct->state[last];
+		ct->outleft[i] = ct->outleft[last];
+		ct->nextseq[i] = ct->nextseq[last];
+		ct->ent[i] = ct->ent[last];
+		ct->ent[i]->slot = i;
+	}
+}
+
+// Disconnects the client in slot `i`, tells everyone else they left, and frees its entry
+// The last client in the table is moved into slot `i`
+void removeclient(struct conntable *ct, size_t i) {
+	struct entry *e = ct->ent[i];
+
+	timerwheel_cancel(&timers, &e->timer);
+	if (e->link != LINK_CLIENT) {
+		if (ct->state[i] == CONN_PEER) {
+			LOG_INFO("Link to peer %016llx closed", (unsigned long long) e->peerid);
+		}
+		npeers--;
+	}
+
+	// Never got as far as the I/O backend, so there's no one to tell and nothing in flight
+	dropinbuffer(e);
+	dropoutbuffer(e);
+	if (ct->state[i] == CONN_HANDSHAKE) {
+		unadmit(e);
+		gnutls_deinit(e->session);
+		close(e->conn.fd);
+		conntable_remove(ct, i);
+		pool_free(&entry_pool, e);
+		return;
+	}
+
+	if (e->qpprev) {
+		entryq_remove(&paused, e);
+	}
+	// (Clients handed over on kernel TLS by the server this one took over from have no session)
+	if (TLSflag && e->session) {
+		// Only sends our close_notify, waiting for the client's could block
+		// (gnutls can't write records on a kernel TLS socket, so those just close)
+		if (!(e->ktls & KTLS_TX)) {
+			gnutls_bye(e->session, GNUTLS_SHUT_WR);
+		}
+		gnutls_deinit(e->session);
+	}
+	if (ct->state[i] == CONN_CHATTING) {
+		nameset_remove(&names, e->name);
+		notepresence(e, 0);
+
+		// Remember how far they got, in case they come back
+		memcpy(departed[departedpos].name, e->name, MAXNAMELEN);
+		departed[departedpos].id = e->id;
+		departed[departedpos].nextseq = ct->nextseq[i];
+		departedpos = (departedpos + 1) % DEPARTED_LEN;
+	}
+	conntable_remove(ct, i);
+	// With io_uring the kernel may still be using the entry's buffers,
+	// it's freed when the backend releases it instead
+	if (netio_close(&io, &e->conn)) {
+		pool_free(&entry_pool, e);
+	}
+}
+
+// Tells the directory how many clients are chatting, how many messages a
+// minute they've sent since the last heartbeat, and how many messages are
+// waiting to go out to them, then schedules the next heartbeat
+void sendheartbeat(gnutls_session_t session, struct conntable *ct) {
+	char frame[MAX] = {'\0'};
+	unsigned long long queued = 0, rate;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < ct->len; i++) {
+		if (ct->state[i] == CONN_CHATTING) {
+			queued += history.next - ct->nextseq[i] + (ct->outleft[i] > 0);
+		}
+	}
+	rate = now > lastheartbeat.time ? (history.next - lastheartbeat.seq) * 60000 / (now - lastheartbeat.time) : 0;
+	lastheartbeat.seq = history.next;
+	lastheartbeat.time = now;
+	timerwheel_arm(&timers, &heartbeat, now, HEARTBEAT_INTERVAL);
+
+	// Finish the last one first, gnutls has the rest of that record
+	if (lastheartbeat.pending) {
+		ret = gnutls_record_send(session, NULL, 0);
+		if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) {
+			LOG_WARN("Directory isn't taking heartbeats");
+			return;
+		}
+		lastheartbeat.pending = 0;
+	}
+
+	snprintf(frame, MAX, "h%zu;%llu;%llu", names.len,
+		rate > UINT32_MAX ? (unsigned long long) UINT32_MAX : rate,
+		queued > UINT32_MAX ? (unsigned long long) UINT32_MAX : queued);
+	ret = gnutls_record_send(session, frame, MAX);
+	if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) {
+		lastheartbeat.pending = 1;
+	} else if (ret < 0) {
+		// Same as the directory closing the connection
+		LOG_ERROR("Can't send heartbeat to directory: %s", gnutls_strerror(ret));
+		exit(1);
+	}
+}
+
+// How long (ms) the event loop can sleep: until the next deadline, or until
+// the batching window closes if messages are waiting for it (-1 for as long as
+// it takes)
+int waittimeout(void) {
+	int timeout = timerwheel_timeout(&timers, now);
+	uint64_t ms;
+
+	if (batchdue) {
+		// Rounded up, epoll can't sleep for less than a millisecond
+		ms = batchdue > nowus ? (batchdue - nowus + 999) / 1000 : 0;
+		if (timeout < 0 || ms < (uint64_t) timeout) {
+			timeout = ms;
+		}
+	}
+	return timeout;
+}
+
+// Current time (us) on the monotonic clock
+uint64_t clockus(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Flushes the message log at exit
+void closemsglog(void) {
+	msglog_close(&msglog);
+}
+
+void sighandler(int signo) {
+	caughtsignal = signo;
+}
+
+// Reports the counters on the way out, from the main loop
+void printstats(int signo) {
+	pool_stats_t stats;
+
+	log_flush();
+	printf("\nCaught signal: %d\n", signo);
+	pool_get_stats(&entry_pool, &stats);
+	printf("Entry pool: %zu entries, %zu heap calls\n", stats.capacity, stats.heap_calls);
+	printf("Memory: %zu bytes per connection (%zu-byte entry, %zu read and %zu write buffers held by %zu connections), %zu KB of heap in use\n",
+		sizeof(struct entry) + (INBUF_SIZE * metrics.inbufs + OUTBUF_SIZE * metrics.outbufs) /
+		(metrics.conns ? metrics.conns : 1), sizeof(struct entry), metrics.inbufs, metrics.outbufs, metrics.conns,
+		mallinfo2().uordblks / 1024);
+	printf("Accepted %lu connections (%lu rejected) in %lu batches, largest batch %d\n",
+		metrics.accepted, metrics.rejected, metrics.acceptbatches, metrics.maxbatch);
+	if (KTLSflag) {
+		printf("Kernel TLS: %lu of %lu sessions offloaded\n", metrics.ktls, metrics.accepted - metrics.rejected);
+	}
+	printf("Handshakes: %lu started (%lu resumed), %lu waited for a turn, %lu turned away\n",
+		admission.started, admission.resumed, admission.waited, admission.rejected);
+	printf("Timed out %lu clients\n", metrics.timedout);
+	if (msglimit.per || bytelimit.per) {
+		printf("Rate limits: clients paused %lu times\n", metrics.paused);
+	}
+	printf("History: %llu messages, %lu clients caught up, %lu messages missed by slow clients\n",
+		(unsigned long long) history.next - 1, metrics.resumed, metrics.missed);
+	if (msglog.fd >= 0) {
+		printf("Message log: %lu messages written in %lu syncs\n", msglog.appended, msglog.commits);
+	}
+	if (serverid) {
+		printf("Mesh: %zu peers, %lu messages relayed to them, %lu from them, %lu dropped\n",
+			npeers, metrics.relayedout, metrics.relayedin, metrics.relaydropped);
+	}
+	if (metrics.batches) {
+		printf("Broadcast: %lu messages in %lu writes\n", metrics.batched, metrics.batches);
+	}
+	printf("Client I/O (%s): %lu reads and writes in %lu syscalls\n", netio_name(&io), io.ops, io.syscalls);
 }
\ No newline at end of file
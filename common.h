@@ -3,10 +3,65 @@
 
 #define MAX 100
 
+// Default capacities, both servers can be given larger ones on the command line
 #define MAX_CLIENTS 5
 
 #define MAX_SERVERS 5
 
+// Most other servers of its topic a chat server links to (see relay.h)
+#define MAX_PEERS 4
+
+// How long (ms) a connection gets to finish its TLS handshake, to pick a
+// username (or send a directory command), and to stay quiet once chatting
+#define HANDSHAKE_TIMEOUT 10000
+#define NAMING_TIMEOUT 60000
+#define IDLE_TIMEOUT 1800000
+
+// How long (ms) a chat server handing over to a new one (-H) waits for it to
+// get ready, and the new one waits for each thing handed over
+#define HANDOFF_TIMEOUT 10000
+
+// How often (ms) a chat server reports its load to the directory, and how
+// long the directory goes without a report before dropping the server
+#define HEARTBEAT_INTERVAL 2000
+#define HEARTBEAT_TIMEOUT 7000
+
+// How often (ms) a chat server tells its clients who joined and left, in one
+// digest message for all of them (see presence.h)
+#define PRESENCE_INTERVAL 1000
+
+// Messages queued for a chat server's clients at which the directory stops
+// sending it more clients
+#define OVERLOAD_QUEUE 4096
+
+// Resolution (ms) of the servers' timer wheels
+#define TIMER_TICK 100
+
+// Recent messages a chat server keeps for clients that join late or come back
+#define HISTORY_LEN 256
+
+// Messages and bytes (of text) a second each chat client can send by
+// default, and how many seconds' worth it can send at once (see ratelimit.h)
+#define CLIENT_MSG_RATE 10
+#define CLIENT_BYTE_RATE 1024
+#define CLIENT_BURST 2
+
+// Chat message asking for missed messages: "/resume [last seen sequence number]"
+#define RESUME_CMD "/resume"
+
+
+// Most connections a server accepts per wakeup of its event loop
+#define ACCEPT_BUDGET 64
+
+// Most TLS handshakes a server works on at once, and connections it keeps
+// waiting for a turn past that; any more are closed as soon as their
+// ClientHello comes in (see admission.h)
+#define MAX_HANDSHAKES 32
+#define HANDSHAKE_QUEUE 512
+
+// Clients the directory's main thread can have waiting to be picked up by
+// each of its lookup threads; past that it answers them itself
+#define LOOKUP_INBOX 64
 
 #define MAXTOPICLEN 19
 
@@ -14,44 +69,14 @@
 
 #define MAXMSGLEN 88
 
-// Enable or disable debug mode
+// Most detailed log level built into the servers (see log.h), anything past
+// it compiles to nothing
 //
-// 0 - disable
-// 1 - enable
+// 0 - errors
+// 1 - warnings
+// 2 - info
+// 3 - debug
 //
-#define DEBUG_MODE 1
-
-// ----------------------- Debug Macros
-#ifndef DEBUG_MODE
-#define DEBUG_MODE 0
-#warning                                                                       \
-    "Please define 'DEBUG_MODE' in common.h with either 'true' (enable debugging) or 'false' (disable debugging)!"
-#endif
-
-#if DEBUG_MODE
-#define DEBUG_MSG(...)                                                         \
-  do {                                                                         \
-    fprintf(stderr, "[%s:%d]: ", __FILE__, __LINE__);                          \
-    fprintf(stderr, __VA_ARGS__);                                              \
-  } while (0);
-
-#define DEBUG_DIRTY_MSG(msg, msg_len)                                          \
-  do {                                                                         \
-    for (size_t i = 0; i < (msg_len); i++) {                                   \
-      if ((msg)[i] == '\n')                                                    \
-        fprintf(stderr, "\\n");                                                \
-      else if ((msg)[i] == '\r')                                               \
-        fprintf(stderr, "\\r");                                                \
-      else if ((msg)[i] == '\0')                                               \
-        fprintf(stderr, "\\0");                                                \
-      else                                                                     \
-        fprintf(stderr, "%c", (msg)[i]);                                       \
-    }                                                                          \
-    fprintf(stderr, "\n");                                                     \
-  } while (0);
-#else
-#define DEBUG_MSG(...)
-#define DEBUG_DIRTY_MSG(msg, msg_len)
-#endif
+#define LOG_MAX_LEVEL 3
 
 #endif
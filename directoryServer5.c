@@ -1,22 +1,35 @@
+#define _GNU_SOURCE
 #include "common.h"
 #include "inet.h"
+#include "pool.h"
+#include "capacity.h"
+#include "ktls.h"
+#include "tlsconf.h"
+#include "dirproto.h"
+#include "log.h"
+#include "timerwheel.h"
+#include "regshm.h"
+#include "admission.h"
+#include "rcu.h"
 #include <asm-generic/errno.h>
 #include <assert.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/eventfd.h>
 #include <sys/queue.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
 
-// Prevents an unnecessary warning
-size_t strnlen(const char *s, size_t maxlen);
-
 // Define if you DO NOT want TLS mode
 //
 //#define NON_TLS_MODE
@@ -25,19 +38,77 @@ size_t strnlen(const char *s, size_t maxlen);
 #define KEYFILE "openssl/serverDirectoryServerKey.pem"
 #define CERTFILE "openssl/serverDirectoryServerCert.pem"
 
-#define LOOP_CHECK(rval, cmd) \
-	do {                  \
-		rval = cmd;   \
-	} while (rval == GNUTLS_E_AGAIN || rval == GNUTLS_E_INTERRUPTED)
 gnutls_certificate_credentials_t x509_cred;
+gnutls_priority_t priority_cache; // Parsed once, shared by every session
+gnutls_datum_t ticket_key;        // For the session tickets clients resume with
+
+// Client RX/TX buffers and server topics come from pools, so connection churn
+// doesn't go through the heap for every client.
+pool_t buffer_pool;
+pool_t topic_pool;
+
+// Capacity, set from the command line. Everything is sized for these up front,
+// so accepting a client never allocates.
+size_t max_clients = MAX_CLIENTS;
+size_t max_servers = MAX_SERVERS;
+
+// Whether to hand record encryption to the kernel after handshakes
+int use_ktls = 0;
+
+// Threads answering clients' lookups, none to answer them on the main thread
+size_t lookup_threads = 0;
+
+// How a topic's server is picked for a client when several serve it
+typedef enum {
+  SELECT_LEAST_LOADED, // Fewest members plus queued messages, per the heartbeats
+  SELECT_HASH,         // Rendezvous hash of the client's and servers' addresses
+} select_policy_t;
+select_policy_t select_policy = SELECT_LEAST_LOADED;
+
+// Snapshot of the registered servers for local clients (only with -e), and
+// the timer that keeps it fresh while nothing happens
+regshm_t *registry;
+twtimer_t registry_refresh;
+
+// Handshakes let in at once, and how many wait for a turn (the waiting
+// clients are left in the array, and not polled)
+admission_t admission;
+
+// Connection deadlines, and the time the current pass of the main loop started
+// (each lookup thread has its own)
+__thread timerwheel_t timers;
+__thread uint64_t now;
 
 //frees all allocated memory for TLS by calling corrosponding gnuTLS functions
 //Note that session de-initializization is handled when client is freed
 void closeTLS(){
+  gnutls_priority_deinit(priority_cache);
+  gnutls_memset(ticket_key.data, 0, ticket_key.size);
+  gnutls_free(ticket_key.data);
   gnutls_global_deinit();
   gnutls_certificate_free_credentials(x509_cred);
 }
 
+// Counters reported when the directory shuts down
+struct {
+  unsigned long accepted;       // Connections accepted
+  unsigned long rejected;       // Accepted connections closed because we were full
+  unsigned long accept_batches; // Wakeups that accepted at least one connection
+  int max_batch;                // Most connections accepted in one wakeup
+  unsigned long ktls;           // Sessions offloaded to kernel TLS both ways
+  unsigned long timed_out;      // Connections dropped for taking too long
+  unsigned long heartbeats;     // Heartbeats received from chat servers
+  unsigned long evicted;        // Chat servers dropped for missing heartbeats
+  unsigned long lookups;        // Servers given to clients, by any thread
+} metrics;
+
+// Set by SIGINT, the main loop shuts down once its wait returns
+volatile sig_atomic_t caught_signal;
+
+void sighandler(int signo) {
+  caught_signal = signo;
+}
+
 // Kind of client
 typedef enum {
   CON_SERVER,
@@ -49,11 +120,20 @@ typedef struct {
   int fd;
   client_kind_t kind;
   gnutls_session_t session; //TLS session
+  unsigned ktls; // Directions (KTLS_RX, KTLS_TX) the kernel does TLS for
 
   char* topic;
   size_t topic_len;
   struct sockaddr_in addr_info;
 
+  // Load from a server's last heartbeat
+  uint32_t members;        // Clients chatting on it
+  uint32_t rate;           // Messages per minute
+  uint32_t queue;          // Messages waiting to go out to its clients
+  uint64_t last_heartbeat; // When it was received (ms)
+  uint16_t mesh_port;      // Where the other servers of its topic link to it, 0 if they don't
+  uint32_t id;             // Given when it registers, what the lookup table knows it by
+
   // SERVER -> CLIENT
   char *tx;
   size_t tx_len;
@@ -63,9 +143,19 @@ typedef struct {
   char *rx;
   size_t rx_len;
   size_t rx_cap;
+  dirproto_t parser; // Holds on to partial commands between reads
 
   // If this client should be removed from the list
   int disconnect;
+
+  // TLS handshake still going (driven by poll, like everything else)
+  int handshaking;
+  int admit;   // Where it is in admission control (ADMIT_*)
+  int resumed; // Its ClientHello resumes a session
+
+  // Handshake, first command, idle or heartbeat deadline. Moves with the client when the
+  // array is compacted, see timerwheel_moved().
+  twtimer_t timer;
 } client_t;
 
 // Verifies the integrity of the client stucture. These are common invariants
@@ -82,6 +172,51 @@ typedef struct {
     assert(client->tx);                                                        \
   } while (0);
 
+// The servers clients can be given, as the main thread last published them
+// (see rcu.h). It builds a new table whenever a server registers, goes away
+// or sends a heartbeat, and lookups on any thread read the current one
+// without taking a lock.
+typedef struct {
+  char topic[MAXTOPICLEN + 1];
+  size_t topic_len;
+  uint32_t id;       // The server's `id`
+  uint32_t ip;       // Network order, as in sin_addr
+  uint16_t port;
+  uint64_t load;     // Members plus queued messages, when it was published
+  uint32_t assigned; // Clients given to it since, counted atomically by lookups
+} lookup_server_t;
+
+typedef struct {
+  rcu_node_t node;
+  char list[MAX + 1]; // Reply to "cl", each topic once
+  size_t list_len;
+  size_t count;
+  lookup_server_t servers[];
+} lookup_table_t;
+
+rcu_t lookup_rcu;
+int lookups_stale;       // A server changed since the table was published
+uint32_t next_server_id;
+
+// A thread answering lookups. A client moves to one when it asks for the
+// topic list (servers never do), and the thread runs its own poll loop,
+// deadlines and TLS records for it from then on.
+typedef struct {
+  pthread_t thread;
+  size_t reader; // Its slot in `lookup_rcu`
+  int wakefd;    // eventfd, written when clients are handed to it
+
+  pthread_mutex_t lock; // Guards the inbox
+  client_t inbox[LOOKUP_INBOX];
+  size_t inbox_len;
+} lookup_worker_t;
+
+lookup_worker_t *lookup_workers;
+size_t next_lookup_worker;  // Round robin
+size_t lookup_clients;      // Clients on lookup threads, counted against max_clients
+int lookups_stopping;       // Set, then each thread woken, to have them return
+__thread lookup_worker_t *this_worker; // NULL on the main thread
+
 // Create a new 'empty' client structure.
 client_t new_client(void) {
   client_t client = {.fd = -1,
@@ -93,13 +228,13 @@ client_t new_client(void) {
 
                      // MAX + 1 ensures even if we fill the buffer, there will
                      // still be a '\0'!
-                     .tx = calloc(MAX + 1, sizeof(char)),
+                     .tx = pool_alloc(&buffer_pool),
                      .tx_len = 0,
                      .tx_cap = MAX,
 
                      // MAX + 1 ensures even if we fill the buffer, there will
                      // still be a '\0'!
-                     .rx = calloc(MAX + 1, sizeof(char)),
+                     .rx = pool_alloc(&buffer_pool),
                      .rx_len = 0,
                      .rx_cap = MAX,
 
@@ -117,6 +252,11 @@ client_t new_client(void) {
     exit(1);
   }
 
+  // Pooled buffers are recycled, so clear out the last client's data
+  memset(client.tx, 0, MAX + 1);
+  memset(client.rx, 0, MAX + 1);
+  dirproto_init(&client.parser);
+
   return client;
 }
 
@@ -125,9 +265,12 @@ client_t new_client(void) {
 // This function will also set all fields to zero.
 void free_client(client_t *client) {
   if (!client) return;
-  if (client->rx) free(client->rx);
-  if (client->tx) free(client->tx);
-  if (client->topic) free(client->topic);
+  timerwheel_cancel(&timers, &client->timer);
+  if (client->rx) pool_free(&buffer_pool, client->rx);
+  if (client->tx) pool_free(&buffer_pool, client->tx);
+  if (client->topic) pool_free(&topic_pool, client->topic);
+  if (client->session) gnutls_deinit(client->session);
+  admission_end(&admission, client->admit, client->resumed);
 
   // This is a saftey thing, we cannot double free
   // pointers if we entirely forget what they were
@@ -146,7 +289,10 @@ void disconnect_client(client_t *client) {
 
   client->disconnect = 1;
   client->rx_len = 0;
-  
+
+  // Clients mustn't be given it anymore
+  if (client->kind == CON_SERVER)
+    lookups_stale = 1;
 }
 
 // Send data to client
@@ -161,8 +307,10 @@ void client_tx(client_t *client) {
   // If we are disconnecting the client, and have nothing
   // else to send, we finally disconnect the client.
   if (client->disconnect) {
-    // Close their socket!
-    gnutls_bye(client->session, GNUTLS_SHUT_RDWR);
+    // Close their socket! (gnutls can't write records once the kernel does,
+    // and there's nothing to close before the handshake is done)
+    if (!(client->ktls & KTLS_TX) && !client->handshaking)
+      gnutls_bye(client->session, GNUTLS_SHUT_RDWR);
     close(client->fd);
 
     client->fd = 0;
@@ -173,8 +321,7 @@ void client_tx(client_t *client) {
   if (!client->tx_len)
     return;
 
-  DEBUG_MSG("TX -- ");
-  DEBUG_DIRTY_MSG(client->tx, client->tx_len);
+  LOG_DIRTY(LOG_LVL_DEBUG, "TX -- ", client->tx, client->tx_len);
 
   int tx_amount;
 
@@ -182,14 +329,21 @@ void client_tx(client_t *client) {
   tx_amount = write(client->fd, client->tx, client->tx_len);
 #else
 // ---------------- CONVERT ME TO TLS ----------------
-  tx_amount = gnutls_record_send(client->session, client->tx, client->tx_len);
+  if (client->ktls & KTLS_TX) {
+    // The kernel makes the records
+    tx_amount = write(client->fd, client->tx, client->tx_len);
+    if (tx_amount < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+  } else {
+    tx_amount = gnutls_record_send(client->session, client->tx, client->tx_len);
+  }
 //#error "TLS mode has not been implemented yet!"
 #endif
 
-  if (tx_amount == EWOULDBLOCK)
+  if (tx_amount == GNUTLS_E_AGAIN || tx_amount == GNUTLS_E_INTERRUPTED)
     return;
   if (tx_amount < 0) {
-    DEBUG_MSG("Failed to write to client, disconnecting them!\n");
+    LOG_DEBUG("Failed to write to client, disconnecting them!");
     disconnect_client(client);
     return;
   }
@@ -217,7 +371,7 @@ void client_rx(client_t *client) {
   // client has filled their RX buffer we know we should
   // disconnect them!
   if (client->rx_len >= client->rx_cap) {
-    DEBUG_MSG("Did not expect client to overfill their RX buffer, disconnecting them!\n");
+    LOG_DEBUG("Did not expect client to overfill their RX buffer, disconnecting them!");
     disconnect_client(client);
     return;
   }
@@ -230,25 +384,31 @@ void client_rx(client_t *client) {
 // ---------------- CONVERT ME TO TLS ----------------
   assert(client->session);
   assert(client->rx);
-  DEBUG_MSG("RX=%zu, LEN=%zu, CAP=%zu\n", client->rx, client->rx_len, client->rx_cap);
-  rx_amount = gnutls_record_recv(client->session, client->rx + client->rx_len, client->rx_cap - client->rx_len);
+  LOG_DEBUG("RX=%p, LEN=%zu, CAP=%zu", (void *)client->rx, client->rx_len, client->rx_cap);
+  if (client->ktls & KTLS_RX)
+    rx_amount = read(client->fd, client->rx + client->rx_len, client->rx_cap - client->rx_len);
+  else
+    rx_amount = gnutls_record_recv(client->session, client->rx + client->rx_len, client->rx_cap - client->rx_len);
 
 //#error "TLS mode has not been implemented yet!"
 #endif
 
   if (!rx_amount) {
-    DEBUG_MSG("Failed to read from client, disconnecting them!\n");
+    LOG_DEBUG("Failed to read from client, disconnecting them!");
     disconnect_client(client);
     return;
   }
 
-  if (rx_amount <= 0) {
-    DEBUG_MSG("Errno %d\n", errno);
-    if (errno == EWOULDBLOCK || errno == GNUTLS_E_INTERRUPTED || errno == GNUTLS_E_AGAIN) {
+  if (rx_amount < 0) {
+    // read() fails with -1 and errno, gnutls returns its error code (errno is
+    // stale then, so it can't be trusted for a peer that went away)
+    LOG_DEBUG("Read failed: %d, errno %d", rx_amount, errno);
+    if (rx_amount == GNUTLS_E_AGAIN || rx_amount == GNUTLS_E_INTERRUPTED ||
+        (rx_amount == -1 && (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR))) {
       return;
     }
 
-    DEBUG_MSG("Failed to read from client, disconnecting them!\n");
+    LOG_DEBUG("Failed to read from client, disconnecting them!");
     disconnect_client(client);
     return;
   }
@@ -256,138 +416,259 @@ void client_rx(client_t *client) {
   client->rx_len += rx_amount;
 }
 
-client_t* find_server_with_topic(client_t* clients, size_t clients_len, char* topic, size_t topic_len) {
-  assert(clients);
-  assert(clients_len);
+// Whether a server's last heartbeat says it has too much queued to take more
+// clients
+int server_overloaded(const client_t *server) {
+  return server->queue >= OVERLOAD_QUEUE;
+}
 
-  for (int i = 0; i < clients_len; i++) {
-    client_t* client = &clients[i];
+// Whether `server` is a live server for `topic`
+int serves_topic(const client_t *server, const char *topic, size_t topic_len) {
+  // Not a valid server
+  if (server->kind != CON_SERVER) return 0;
+  if (server->disconnect) return 0;
+  if (!server->topic_len || !server->topic) return 0;
 
-    // Not a valid server
-    if (client->kind != CON_SERVER) continue;
-    if (client->disconnect) continue;
-    if (!client->topic_len || !client->topic) continue;
+  return server->topic_len == topic_len && memcmp(server->topic, topic, topic_len) == 0;
+}
+
+// Rendezvous hash weight of `server` for a client at `client_ip`. Each client
+// goes to the replica with the highest weight, so adding or removing a
+// replica only moves the clients that pick (or picked) that one.
+uint64_t replica_weight(uint32_t client_ip, const lookup_server_t *server) {
+  uint64_t x = ((uint64_t)client_ip << 32 | server->ip) ^ ((uint64_t)server->port * 0x9e3779b97f4a7c15ull);
 
-    // Not the server we are looking for
-    if (client->topic_len != topic_len && 
-        strncmp(client->topic, topic, client->topic_len) != 0) continue;
+  // splitmix64 finalizer
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+// Pick the replica of `topic` in `table` to send `client` to (overloaded
+// ones aren't in it).
+//
+// Returns NULL if there isn't one.
+lookup_server_t* select_server(lookup_table_t *table, const client_t *client,
+                               const char* topic, size_t topic_len) {
+  lookup_server_t *best = NULL;
+  uint64_t best_score = 0;
+
+  for (size_t i = 0; i < table->count; i++) {
+    lookup_server_t* server = &table->servers[i];
+    uint64_t score;
+
+    if (server->topic_len != topic_len || memcmp(server->topic, topic, topic_len) != 0) continue;
+
+    if (select_policy == SELECT_HASH) {
+      score = replica_weight(client->addr_info.sin_addr.s_addr, server);
+    } else {
+      // Lower load wins, so flip it to make higher better
+      score = UINT64_MAX - (server->load + __atomic_load_n(&server->assigned, __ATOMIC_RELAXED));
+    }
 
-    return client;
+    if (!best || score > best_score) {
+      best = server;
+      best_score = score;
+    }
   }
 
-  return NULL;
+  return best;
 }
 
-// Parse and process the client's message. 
-//
-// # Protocol
-// 
-// ## Server Side
-//  1. THEM -> US                      : Server will connect to us
-//  2. THEM("s{TOPIC}; {PORT}\0")      : Server will send its topic and port to us
-//                                     :  - TOPIC is limited to `MAXTOPICLEN` of chars
-//                                     :  - TOPIC cannot contain ',' or ';'
-//                                     :  - PORT is an `uint16_t`
-//  3. THEM -- US                      : Server doesn't disconnect, but keeps connection alive
-//  4. THEM -X US                      : Server died and needs to be removed 
-//
-// ## Client Side
-//  1. THEM -> US                      : Client will connect to us
-//  2. THEM("cl")                      : Client will ask for all servers
-//  3. US("{{TOPIC_N}\n*}")            : We send the client all servers
-//  4. THEM("cl{TOPIC}")               : Client will ask for a server's IP and PORT
-//  5. US("{TOPIC_IP};{TOPIC_PORT}")   : We will send the client the TOPIC's server IP and PORT
-//  6. THEM -X US                      : Client will disconnect
-//
-void parse_client_msg(client_t* clients, size_t clients_len, client_t* client) {
-  VERIFY_CLIENT(client);
-  assert(clients);
-  assert(clients_len);
+// Whether the "{TOPIC}\n" list in `list` has `topic` in it already
+int list_has_topic(const char *list, size_t list_len, const char *topic, size_t topic_len) {
+  const char *line = list, *end = list + list_len;
 
-  DEBUG_MSG("Got message -- ");
-  DEBUG_DIRTY_MSG(client->rx, client->rx_len);
+  while (line < end) {
+    const char *nl = memchr(line, '\n', end - line);
+    if (!nl) break;
+    if ((size_t)(nl - line) == topic_len && memcmp(line, topic, topic_len) == 0)
+      return 1;
+    line = nl + 1;
+  }
+  return 0;
+}
 
-  char topic[MAXTOPICLEN] = { 0 };
-  uint16_t port;
+// Write every live server into the shared memory snapshot, if it changed
+void publish_registry(client_t* clients, size_t clients_len) {
+  static regshm_server_t servers[REGSHM_SERVERS];
+  size_t count = 0;
+
+  memset(servers, 0, sizeof(servers));
+  for (int i = 0; i < clients_len && count < REGSHM_SERVERS; i++) {
+    client_t* server = &clients[i];
+    uint64_t load = (uint64_t)server->members + server->queue;
+
+    if (server->kind != CON_SERVER || server->disconnect) continue;
+    if (!server->topic_len || !server->topic) continue;
+
+    memcpy(servers[count].topic, server->topic, server->topic_len);
+    servers[count].port = server->addr_info.sin_port;
+    servers[count].ip = server->addr_info.sin_addr.s_addr;
+    servers[count].load = load > UINT32_MAX ? UINT32_MAX : load;
+    servers[count].overloaded = server_overloaded(server);
+    count++;
+  }
+  regshm_publish(registry, servers, count, now);
+}
 
-  // If we have nothing to read, we just skip the whole process
-  if (!client->rx || client->disconnect) return;
+// The lookup table, for as long as this thread needs it (until
+// put_lookups())
+lookup_table_t* get_lookups(void) {
+  if (this_worker)
+    return rcu_read(&lookup_rcu, this_worker->reader);
+  return rcu_current(&lookup_rcu);
+}
 
-  // Client Protocol : "Topic's Info Request" (Step 4)
-  if (sscanf(client->rx, "cr%[^\n]", topic) == 1 && client->kind == CON_CLIENT) {
-    DEBUG_MSG("Client server info request!\n");
+void put_lookups(void) {
+  if (this_worker)
+    rcu_done(&lookup_rcu, this_worker->reader);
+}
 
-    int topic_len;
-    if ((topic_len = strnlen(topic, MAXTOPICLEN + 2)) > MAXTOPICLEN) {
-      // Oversized topic request
-      disconnect_client(client);
-      return;
-    }
+// Count the clients lookups have given each server (since the table was
+// published) in its `members`, like they were in its last heartbeat. Main
+// thread only.
+void count_assigned(client_t* clients, size_t clients_len) {
+  lookup_table_t *table = rcu_current(&lookup_rcu);
 
-    client_t* topic_server = find_server_with_topic(clients, clients_len, topic, topic_len);
+  for (size_t i = 0; i < table->count; i++) {
+    uint32_t assigned = __atomic_exchange_n(&table->servers[i].assigned, 0, __ATOMIC_RELAXED);
 
-    // That topic doesn't exist
-    if (!topic_server) {
-      disconnect_client(client);
-      return;
+    for (size_t j = 0; assigned && j < clients_len; j++) {
+      client_t* server = &clients[j];
+
+      if (server->kind != CON_SERVER || server->id != table->servers[i].id) continue;
+      server->members = server->members > UINT32_MAX - assigned ? UINT32_MAX : server->members + assigned;
+      break;
     }
+  }
+}
 
-    // Topic does exist
-    uint32_t ip = topic_server->addr_info.sin_addr.s_addr;
-    uint16_t port = topic_server->addr_info.sin_port;
+// Publish a new lookup table if a server has changed since the last one.
+// Main thread only.
+void publish_lookups(client_t* clients, size_t clients_len) {
+  lookup_table_t *table;
+  size_t count = 0;
 
-    // -- Step 5 : Write "{TOPIC_IP};{TOPIC_PORT}" to client
-    client->tx_len += snprintf(client->tx + client->tx_len, client->tx_cap - client->tx_len, 
-                               "%u;%u", ip, port);
+  rcu_reclaim(&lookup_rcu);
+  if (!lookups_stale && rcu_current(&lookup_rcu))
+    return;
 
-    // Reset client RX because we got a valid command
-    memset(client->rx, 0, client->rx_len);
-    client->rx_len = 0;
-    
+  for (size_t i = 0; i < clients_len; i++) {
+    if (clients[i].kind == CON_SERVER && clients[i].topic && !clients[i].disconnect)
+      count++;
+  }
+  if (!(table = malloc(sizeof(*table) + count * sizeof(table->servers[0])))) {
+    // Lookups carry on with the old one, and this is tried again next pass
+    LOG_ERROR("Can't allocate a lookup table");
     return;
   }
+  if (rcu_current(&lookup_rcu))
+    count_assigned(clients, clients_len);
+
+  table->list_len = 0;
+  table->list[0] = '\0';
+  table->count = 0;
+  for (size_t i = 0; i < clients_len; i++) {
+    client_t* server = &clients[i];
+    lookup_server_t *entry = &table->servers[table->count];
+
+    // Overloaded servers can't take anyone else, so clients don't see them
+    if (server->kind != CON_SERVER || !server->topic || server->disconnect) continue;
+    if (server_overloaded(server)) continue;
+
+    memcpy(entry->topic, server->topic, server->topic_len + 1);
+    entry->topic_len = server->topic_len;
+    entry->id = server->id;
+    entry->ip = server->addr_info.sin_addr.s_addr;
+    entry->port = server->addr_info.sin_port;
+    entry->load = (uint64_t)server->members + server->queue;
+    entry->assigned = 0;
+    table->count++;
+
+    // Topics with several servers are only listed once, and whatever doesn't
+    // fit in one frame is left out
+    if (list_has_topic(table->list, table->list_len, server->topic, server->topic_len)) continue;
+    if (table->list_len + server->topic_len + 1 > MAX) continue;
+    memcpy(table->list + table->list_len, server->topic, server->topic_len);
+    table->list_len += server->topic_len;
+    table->list[table->list_len++] = '\n';
+    table->list[table->list_len] = '\0';
+  }
 
-  // Client Protocol : "Request all Topics" (Step 2)
-  if (strncmp(client->rx, "cl", 2) == 0 && client->kind == CON_NONE) {
-    DEBUG_MSG("Client topic request!\n");
-    client->kind = CON_CLIENT;
+  rcu_publish(&lookup_rcu, table);
+  lookups_stale = 0;
+}
 
-    for (int i = 0; i < clients_len; i++) {
-      client_t* topic_server  = &clients[i];
+// Act on a full command from `client`, parsed into `client->parser`
+void run_client_cmd(client_t* clients, size_t clients_len, client_t* client, int cmd) {
+  char *topic = client->parser.topic;
+  size_t topic_len = client->parser.topic_len;
 
-      // Not a valid server
-      if (topic_server->kind != CON_SERVER) continue;
-      if (topic_server->disconnect) continue;
-      if (!topic_server->topic_len || !topic_server->topic) continue;
+  // Client Protocol : "Topic's Info Request" (Step 4)
+  if (cmd == DIRPROTO_REQUEST && client->kind == CON_CLIENT) {
+    LOG_DEBUG("Client server info request!");
 
-      DEBUG_MSG("TOPIC=");
-      DEBUG_DIRTY_MSG(topic_server->topic, topic_server->topic_len);
+    lookup_table_t *table = get_lookups();
+    lookup_server_t* topic_server = select_server(table, client, topic, topic_len);
 
-      client->tx_len += snprintf(
-                                 client->tx + client->tx_len, 
-                                 client->tx_cap - client->tx_len, 
-                                 "%s\n", topic_server->topic);
+    // That topic doesn't exist, or none of its servers can take anyone else
+    if (!topic_server) {
+      put_lookups();
+      disconnect_client(client);
+      return;
     }
 
-    // Reset client RX because we got a valid command
-    memset(client->rx, 0, client->rx_len);
-    client->rx_len = 0;    
+    // -- Step 5 : Write "{TOPIC_IP};{TOPIC_PORT}" to client. Commands sent
+    // together are all run before anything goes out, so a client asking
+    // again and again could pile up more replies than its buffer holds.
+    char reply[MAX];
+    int len = snprintf(reply, sizeof(reply), "%u;%u", topic_server->ip, topic_server->port);
+    if (len >= client->tx_cap - client->tx_len) {
+      put_lookups();
+      LOG_DEBUG("Client's replies don't fit, disconnecting them!");
+      disconnect_client(client);
+      return;
+    }
 
+    // Count the client against the server until its next heartbeat says how
+    // many it really has, so a burst of requests doesn't all pick the same one
+    __atomic_fetch_add(&topic_server->assigned, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metrics.lookups, 1, __ATOMIC_RELAXED);
+    put_lookups();
+
+    memcpy(client->tx + client->tx_len, reply, len + 1);
+    client->tx_len += len;
+    return;
+  }
+
+  // Client Protocol : "Request all Topics" (Step 2)
+  if (cmd == DIRPROTO_LIST && client->kind == CON_NONE) {
+    LOG_DEBUG("Client topic request!");
+    client->kind = CON_CLIENT;
+    // The user picks a topic next, which can take a while
+    timerwheel_arm(&timers, &client->timer, now, IDLE_TIMEOUT);
+
+    // -- Step 3 : Write every topic, already listed in the table
+    lookup_table_t *table = get_lookups();
+    size_t len = table->list_len;
+
+    if (len > client->tx_cap - client->tx_len)
+      len = client->tx_cap - client->tx_len;
+    LOG_DIRTY(LOG_LVL_DEBUG, "TOPICS=", table->list, len);
+    memcpy(client->tx + client->tx_len, table->list, len);
+    client->tx_len += len;
+    client->tx[client->tx_len] = '\0';
+    put_lookups();
     return;
   }
 
   // Server Protocol : "Send Topic Info" (Step 2)
-  if (sscanf(client->rx, "s%[^;]; %hu", topic, &port) == 2 && client->kind == CON_NONE) {
-    DEBUG_MSG("Talking to a server! -- Topic=%s Port=%u\n", topic, port);
+  if (cmd == DIRPROTO_REGISTER && client->kind == CON_NONE) {
+    uint16_t port = client->parser.port;
+    LOG_DEBUG("Talking to a server! -- Topic=%s Port=%u", topic, port);
     client->kind = CON_SERVER;
 
-    int topic_len;
-    if ((topic_len = strnlen(topic, MAXTOPICLEN + 2)) > MAXTOPICLEN) {
-      // Oversized topic request
-      disconnect_client(client);
-      return;
-    }
-
     int server_count = 0;
     for (int i = 0; i < clients_len; i++) {
       client_t* tserv = &clients[i];
@@ -398,82 +679,672 @@ void parse_client_msg(client_t* clients, size_t clients_len, client_t* client) {
       if (tserv->kind == CON_SERVER) server_count++;      
     }
 
-    if (server_count > MAX_SERVERS) {
+    if (server_count > max_servers) {
       disconnect_client(client);
       return;
     }
 
-    client_t* topic_server = find_server_with_topic(clients, clients_len, topic, topic_len);
+    // Any number of servers can share a topic, but one registering the same
+    // topic at the same address again has restarted, so its old connection is
+    // dead even if no one has noticed yet
+    for (int i = 0; i < clients_len; i++) {
+      client_t* old = &clients[i];
 
-    // If we find a topic server with the same name, we disconnect the new one
-    if (topic_server) {
-      disconnect_client(client);
-      return;
+      if (old == client || !serves_topic(old, topic, topic_len)) continue;
+      if (old->addr_info.sin_addr.s_addr != client->addr_info.sin_addr.s_addr ||
+          old->addr_info.sin_port != port) continue;
+
+      LOG_INFO("Server %s re-registered, dropping its old connection", topic);
+      disconnect_client(old);
     }
 
     // Create a new Topic memory region
-    client->topic = calloc(topic_len + 1, sizeof(char));
+    client->topic = pool_alloc(&topic_pool);
     assert(client->topic);
 
     // Write topic string into topic field
-    client->topic_len = snprintf(client->topic, topic_len + 1, "%s", topic);
+    memcpy(client->topic, topic, topic_len + 1);
+    client->topic_len = topic_len;
 
     // Reassign port
     client->addr_info.sin_port = port;
 
-    // Reset client RX because we got a valid command
-    memset(client->rx, 0, client->rx_len);
-    client->rx_len = 0;    
+    // Clients can be given it from the next lookup table on
+    client->id = ++next_server_id;
+    lookups_stale = 1;
 
+    // Servers stay connected for as long as they keep sending heartbeats
+    client->last_heartbeat = now;
+    timerwheel_arm(&timers, &client->timer, now, HEARTBEAT_TIMEOUT);
     return;
   }
 
-  // If the first char isn't a valid one, we disconnect them
-  if (client->rx[0] != 's' && client->rx[0] != 'c') {
-    disconnect_client(client);
+  // Server Protocol : "Heartbeat" (Step 3)
+  if (cmd == DIRPROTO_HEARTBEAT && client->kind == CON_SERVER) {
+    // Its count replaces the clients lookups have given it since the last
+    // table, as well as its last heartbeat's
+    count_assigned(clients, clients_len);
+    lookups_stale = 1;
+    client->members = client->parser.members;
+    client->rate = client->parser.rate;
+    client->queue = client->parser.queue;
+    client->last_heartbeat = now;
+    metrics.heartbeats++;
+    LOG_DEBUG("Heartbeat from %s: %u members, %u msgs/min, %u queued", client->topic,
+              client->members, client->rate, client->queue);
     return;
   }
 
-  // If the client has filled their buffer, and still not a valid request
-  // we disconnect them.
-  if (client->rx_len >= client->rx_cap) {
-    DEBUG_MSG("Client's RX buffer is full without a valid msg, disconnecting them!\n");
-    disconnect_client(client);
+  // Server Protocol : "Join the Topic's Mesh" (Step 4), once per server
+  if (cmd == DIRPROTO_MESH && client->kind == CON_SERVER && client->topic &&
+      client->parser.port && !client->mesh_port) {
+    char reply[MAX];
+    int len = snprintf(reply, sizeof(reply), "m");
+
+    // -- Step 5 : Write "m" and a "{IP};{MESH_PORT}\n" line for every other
+    // server of the topic that's in the mesh, which the new server links to.
+    // Servers that join later link to this one, so each pair gets one link.
+    for (int i = 0; i < clients_len; i++) {
+      client_t* peer = &clients[i];
+      int line;
+
+      if (peer == client || !peer->mesh_port) continue;
+      if (!serves_topic(peer, client->topic, client->topic_len)) continue;
+
+      line = snprintf(reply + len, sizeof(reply) - len, "%u;%u\n",
+                      peer->addr_info.sin_addr.s_addr, peer->mesh_port);
+      // Whatever doesn't fit in one frame is left out
+      if (line >= sizeof(reply) - len) {
+        reply[len] = '\0';
+        break;
+      }
+      len += line;
+    }
+
+    // Like lookups, the reply has to fit behind whatever is still queued
+    if (len >= client->tx_cap - client->tx_len) {
+      LOG_DEBUG("Server's replies don't fit, disconnecting them!");
+      disconnect_client(client);
+      return;
+    }
+    client->mesh_port = client->parser.port;
+    memcpy(client->tx + client->tx_len, reply, len + 1);
+    client->tx_len += len;
     return;
   }
 
-  // Otherwise we are still waiting for a valid command...
-  DEBUG_MSG("Still waiting for valid msg: ");
-  DEBUG_DIRTY_MSG(client->rx, client->rx_len);
+  // A valid command, but not one this kind of client can send
+  LOG_DEBUG("Command %d not allowed for this client, disconnecting them!", cmd);
+  disconnect_client(client);
 }
 
-int fill_fdset(client_t *clients, size_t clients_len, int serverfd, fd_set *read_set, fd_set *write_set) {
+// Move `client`, which has just asked for the topic list, to a lookup thread
+// along with whatever it sent after that (from `off` in its RX buffer on).
+// The main thread's slot is left to be removed with the disconnected ones.
+//
+// Returns 0 if it was handed over, -1 if it stays here (there are no lookup
+// threads, or the next one is too far behind).
+int hand_to_lookups(client_t *client, size_t off) {
+  lookup_worker_t *worker;
+  uint64_t wake = 1;
+
+  if (!lookup_threads || this_worker)
+    return -1;
+  worker = &lookup_workers[next_lookup_worker++ % lookup_threads];
+
+  pthread_mutex_lock(&worker->lock);
+  if (worker->inbox_len == LOOKUP_INBOX) {
+    pthread_mutex_unlock(&worker->lock);
+    return -1;
+  }
+  timerwheel_cancel(&timers, &client->timer);
+  client->rx_len -= off;
+  memmove(client->rx, client->rx + off, client->rx_len);
+  worker->inbox[worker->inbox_len++] = *client;
+  pthread_mutex_unlock(&worker->lock);
+  __atomic_fetch_add(&lookup_clients, 1, __ATOMIC_RELAXED);
+
+  if (write(worker->wakefd, &wake, sizeof(wake)) < 0)
+    LOG_WARN("Can't wake a lookup thread: %s", strerror(errno));
+
+  // Its socket, session and buffers are the lookup thread's now
+  memset(client, 0, sizeof(*client));
+  return 0;
+}
+
+// Parse and process the client's message. 
+//
+// # Protocol
+// 
+// ## Server Side
+//  1. THEM -> US                      : Server will connect to us
+//  2. THEM("s{TOPIC}; {PORT}\0")      : Server will send its topic and port to us
+//                                     :  - TOPIC is limited to `MAXTOPICLEN` of chars
+//                                     :  - TOPIC cannot contain ',' or ';'
+//                                     :  - PORT is an `uint16_t`
+//                                     : Several servers can register the same topic, clients
+//                                     : are spread between them (see `select_policy`).
+//  3. THEM("h{MEMBERS};{RATE};{QUEUE}\0")
+//                                     : Every `HEARTBEAT_INTERVAL` the server reports its chatting
+//                                     : clients, messages per minute and messages queued for its
+//                                     : clients. One that reports `OVERLOAD_QUEUE` or more queued
+//                                     : isn't given to clients until it reports less.
+//  4. THEM("m{MESH_PORT}\0")          : Server (optionally) takes links from the other servers
+//                                     : of its topic on MESH_PORT (once, and not on port 0)
+//  5. US("m{{IP};{MESH_PORT}\n*}")     : We send it the servers of its topic already taking
+//                                     : links, for it to link to
+//  6. THEM -X US                      : Server died (or went `HEARTBEAT_TIMEOUT` without a
+//                                     : heartbeat) and needs to be removed
+//
+// ## Client Side
+//  1. THEM -> US                      : Client will connect to us
+//  2. THEM("cl")                      : Client will ask for all servers
+//  3. US("{{TOPIC_N}\n*}")            : We send the client all servers
+//  4. THEM("cl{TOPIC}")               : Client will ask for a server's IP and PORT
+//  5. US("{TOPIC_IP};{TOPIC_PORT}")   : We will send the client the TOPIC's server IP and PORT
+//  6. THEM -X US                      : Client will disconnect
+//
+// Commands are parsed as the bytes arrive (see dirproto.h), so each read is
+// only looked at once, and a buffer can hold any number of commands.
+//
+// With lookup threads, a client asking for the topic list is handed to one
+// (see hand_to_lookups()), which answers it and everything after.
+void parse_client_msg(client_t* clients, size_t clients_len, client_t* client) {
+  VERIFY_CLIENT(client);
   assert(clients);
-  assert(read_set);
-  assert(write_set);
+  assert(clients_len);
+
+  LOG_DIRTY(LOG_LVL_DEBUG, "Got message -- ", client->rx, client->rx_len);
+
+  size_t off = 0, used;
+  int cmd;
+
+  while (off < client->rx_len && !client->disconnect) {
+    cmd = dirproto_parse(&client->parser, client->rx + off, client->rx_len - off, &used);
+    off += used;
+
+    if (cmd < 0) {
+      LOG_DEBUG("Client sent an invalid command, disconnecting them!");
+      disconnect_client(client);
+      break;
+    }
+    if (!cmd) {
+      // The rest of the command hasn't arrived yet
+      LOG_DEBUG("Still waiting for a full command");
+      break;
+    }
+    if (cmd == DIRPROTO_LIST && client->kind == CON_NONE && hand_to_lookups(client, off) == 0)
+      return;
+    run_client_cmd(clients, clients_len, client, cmd);
+  }
 
-  FD_ZERO(read_set);
-  FD_ZERO(write_set);
+  // The parser has kept whatever it needs from these bytes
+  client->rx_len = 0;
+}
+
+void client_handshake(client_t *client);
+
+// Set up a freshly accepted (non-blocking) socket as a client, start its TLS
+// handshake, and add it to the end of `clients`.
+//
+// Returns 0 if the client was added, -1 if it was dropped.
+int add_client(client_t *clients, size_t *clients_len, int newsockfd, struct sockaddr_in *cli_addr) {
+  // Create the new client structure
+  client_t client = new_client();
+  client.fd = newsockfd;
+  client.addr_info = *cli_addr;
+
+  //gnuTLS session setup
+  int TLSfail = 0;
+  if(gnutls_init(&client.session, GNUTLS_SERVER) < 0){
+    perror("directoryServer -- TLS error: failed to initialize session");
+    TLSfail = 1;
+  }
+  if(!TLSfail && gnutls_credentials_set(client.session, GNUTLS_CRD_CERTIFICATE, x509_cred) < 0){
+    perror("directoryServer -- TLS error: failed to set credentials");
+    TLSfail = 1;
+  }
+  if(!TLSfail && gnutls_priority_set(client.session, priority_cache) < 0){
+    perror("directoryServer -- TLS error: failed priority set");
+    TLSfail = 1;
+  }
+  if(!TLSfail && gnutls_session_ticket_enable_server(client.session, &ticket_key) < 0){
+    perror("directoryServer -- TLS error: failed to enable session tickets");
+    TLSfail = 1;
+  }
 
-  int max_fd = serverfd;
-  FD_SET(serverfd, read_set);
+  if (TLSfail) { //TLS setup error- close client connection and don't add them to array
+    close(newsockfd);
+    free_client(&client);
+    return -1;
+  }
+
+  // Set up transport layer -- pg 178
+  gnutls_transport_set_int(client.session, newsockfd);
+
+  LOG_DEBUG("len = %zu", *clients_len);
+  // Put the client into the array, then start its handshake (the rest of it
+  // happens as poll() says the socket is ready)
+  client.handshaking = 1;
+  clients[*clients_len] = client;
+  client_t *added = &clients[(*clients_len)++];
+  timerwheel_arm(&timers, &added->timer, now, HANDSHAKE_TIMEOUT);
+  client_handshake(added);
+  return 0;
+}
+
+// Let a client start its handshake, once its ClientHello comes in, if there's
+// room for it. Otherwise it waits for a turn (see admit_waiting()), or is
+// disconnected if too many are waiting already.
+//
+// Returns 1 if it can go ahead, 0 if not.
+int admit_client(client_t *client) {
+  int resumed = admission_hello(client->fd);
+
+  // poll() says when it comes in
+  if (resumed < 0)
+    return 0;
+  client->resumed = resumed;
+  client->admit = admission_offer(&admission, resumed);
+  if (client->admit == ADMIT_REJECTED) {
+    LOG_WARN("Too many handshakes waiting, closing socket");
+    client->admit = ADMIT_NONE;
+    disconnect_client(client);
+  }
+  return client->admit == ADMIT_ACTIVE;
+}
+
+// Take a client's TLS handshake as far as it can go without blocking.
+void client_handshake(client_t *client) {
+  if (client->admit != ADMIT_ACTIVE && !admit_client(client))
+    return;
+
+  int handshake = gnutls_handshake(client->session);
+
+  if (handshake == GNUTLS_E_AGAIN || handshake == GNUTLS_E_INTERRUPTED)
+    return;
+
+  if (handshake < 0) {
+    //disconnect Client- handshake failed
+    // TLS Handshake error handling
+    LOG_WARN("Client Handshake failed: %s", gnutls_strerror(handshake));
+    gnutls_datum_t out;
+    int type = gnutls_certificate_type_get(client->session);
+    unsigned status = gnutls_session_get_verify_cert_status(client->session);
+    gnutls_certificate_verification_status_print(status, type, &out, 0);
+    LOG_WARN("cert verify output: %s", out.data);
+    gnutls_free(out.data);
+    disconnect_client(client);
+    return;
+  }
+
+  //Successful TLS handshake
+  LOG_INFO("Client Handshake completed!");
+  client->handshaking = 0;
+  admission_end(&admission, client->admit, client->resumed);
+  client->admit = ADMIT_NONE;
+  timerwheel_arm(&timers, &client->timer, now, NAMING_TIMEOUT);
+
+  // Let the kernel encrypt and decrypt records from here on
+  if (use_ktls) {
+    int k = ktls_enable(client->session, client->fd);
+    if (k < 0 && errno == ENOENT) {
+      // No tls kernel module, so don't try again for every client
+      LOG_WARN("kTLS unavailable, using gnutls for records: %s", strerror(errno));
+      use_ktls = 0;
+    } else if (k > 0) {
+      client->ktls = k;
+      if (k == (KTLS_RX | KTLS_TX))
+        metrics.ktls++;
+    }
+  }
+}
+
+// Fill `pfds` with every client (in the same order), after the server socket
+// in slot 0. Clients are only polled for writing when they have something to
+// send or are waiting to be disconnected.
+//
+// Returns the number of slots filled.
+size_t fill_pollfds(client_t *clients, size_t clients_len, int serverfd, struct pollfd *pfds) {
+  assert(clients);
+  assert(pfds);
+
+  pfds[0].fd = serverfd;
+  pfds[0].events = POLLIN;
+  pfds[0].revents = 0;
 
   for (int i = 0; i < clients_len; i++) {
     client_t *client = &clients[i];
+    struct pollfd *pfd = &pfds[i + 1];
+
+    pfd->fd = client->fd;
+    pfd->events = POLLIN;
+    pfd->revents = 0;
+    // Nothing is read from a client waiting to start its handshake
+    if (client->admit == ADMIT_WAITING && !client->disconnect)
+      pfd->fd = -1;
+    // A handshake only waits on whichever way gnutls got stuck
+    if (client->handshaking && !client->disconnect && gnutls_record_get_direction(client->session))
+      pfd->events = POLLOUT;
+    if (client->tx_len || client->disconnect)
+      pfd->events |= POLLOUT;
+  }
+
+  return clients_len + 1;
+}
+
+// Act on what poll() said about every client in `pfds` (from fill_pollfds()):
+// move handshakes along, read and parse whatever came in, and send whatever
+// is waiting.
+void serve_clients(client_t *clients, size_t clients_len, struct pollfd *pfds, size_t polled) {
+  for (int i = 0; i + 1 < polled; i++) {
+    client_t *client = &clients[i];
+    short revents = pfds[i + 1].revents;
+
+    if (!client)
+      continue;
+
+    if (client->handshaking && !client->disconnect) {
+      if (revents)
+        client_handshake(client);
+      continue;
+    }
+
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
+      // We want to get anything the client might've sent us
+      client_rx(client);
+
+      // Then we process it each time, regardless if the msg
+      // is finished
+      parse_client_msg(clients, clients_len, client);
+
+      // Handed to a lookup thread
+      if (!client->fd)
+        continue;
+    }
+
+    if (revents & POLLOUT) {
+      client_tx(client);
+    }
+  }
+}
+
+// When we handle a client and its time for disconnect, we won't
+// remove it from the list. Since it can cause UB, so instead we
+// disconnect the client and set it's FD to `0`.
+//
+// Here we look though all the client's that have FDs of zero,
+// and actually remove them from the list.
+//
+// Since we are iter over the list at the same time as modifying
+// the list we need to be extra careful to ensure we don't RW to
+// undefined memory.
+//
+// NOTE:
+// This can be done in the main loop, but its much eaiser to
+// verify the soundness of the above loop without this. That is
+// why it is moved to another loop.
+void remove_disconnected(client_t *clients, size_t *clients_len) {
+  for (int i = 0; i < *clients_len; i++) {
+    client_t *client = &clients[i];
 
     if (!client)
       continue;
-    if (client->fd > max_fd)
-      max_fd = client->fd;
+    if (client->fd)
+      continue;
+
+    LOG_DEBUG("Removing client at index='%d' from the list!", i);
+
+    free_client(client);
+
+    // Pulled from heaplist from previous assignments
+    //
+    // # Steps:
+    // 
+    // So, we have an array like this:
+    //    [ X , X , 4 , 3 , 2 , 1]
+    // 
+    // Where 'X' is an empty element. So, this array will have
+    // a length of 4, and a capacity of 6. If we want to remove
+    // element '2' from the array we need to shift '3' and '4' 
+    // down one element. 
+    //
+    // # Graphic Explaining the process:
+    //
+    //   [ X , X , 4 , 3 , 2 , 1]  | : Starting array
+    //           [ 4 , 3 ]         | : The elements we want to move
+    //               [ 4 , 3 ]     | : Copied one element down
+    //   [ X , X , X , 4 , 3 , 1 ] X : Final Array
+    //
+    // The elements are copied down one at a time rather than with one
+    // memmove(): armed timers point back into the clients, often into the
+    // neighbouring ones (clients accepted together time out together), so
+    // each timer is fixed up right after it moves, while the links to it
+    // still lead where they say.
+    (*clients_len)--;
+    for (size_t m = i; m < *clients_len; m++) {
+      clients[m] = clients[m + 1];
+      timerwheel_moved(&clients[m].timer);
+    }
+    i--;
+  }
+}
+
+// Start the handshakes of waiting clients, oldest first and the ones resuming
+// a session before the rest, while there's room.
+void admit_waiting(client_t *clients, size_t clients_len) {
+  for (int resumed = 1; resumed >= 0; resumed--) {
+    for (size_t i = 0; i < clients_len && admission_room(&admission); i++) {
+      client_t *client = &clients[i];
+
+      if (client->admit != ADMIT_WAITING || client->resumed != resumed || client->disconnect)
+        continue;
+      admission_begin(&admission, resumed);
+      client->admit = ADMIT_ACTIVE;
+      client_handshake(client);
+    }
+  }
+}
+
+// Take the clients the main thread has handed `worker`, answering the topic
+// list they asked for and whatever they sent after it.
+void take_handed(lookup_worker_t *worker, client_t *clients, size_t *clients_len) {
+  client_t handed[LOOKUP_INBOX];
+  uint64_t wakes;
+  size_t n;
+
+  if (read(worker->wakefd, &wakes, sizeof(wakes)) < 0 && errno != EAGAIN)
+    LOG_WARN("Lookup thread can't read its wakeups: %s", strerror(errno));
+
+  pthread_mutex_lock(&worker->lock);
+  n = worker->inbox_len;
+  memcpy(handed, worker->inbox, n * sizeof(client_t));
+  worker->inbox_len = 0;
+  pthread_mutex_unlock(&worker->lock);
+
+  for (size_t i = 0; i < n; i++) {
+    client_t *client = &clients[(*clients_len)++];
+
+    *client = handed[i];
+    run_client_cmd(clients, *clients_len, client, DIRPROTO_LIST);
+    parse_client_msg(clients, *clients_len, client);
+  }
+}
+
+// A lookup thread's loop, like the main one but for clients that have asked
+// for the topic list, and without accepting or registering anything.
+void *lookup_thread(void *arg) {
+  lookup_worker_t *worker = arg;
+  size_t clients_len = 0, before;
+  client_t *clients = calloc(max_clients, sizeof(client_t));
+  struct pollfd *pfds = calloc(max_clients + 1, sizeof(struct pollfd));
+
+  assert(clients);
+  assert(pfds);
+
+  this_worker = worker;
+  now = timerwheel_clock();
+  timerwheel_init(&timers, TIMER_TICK, now);
+
+  for (;;) {
+    size_t polled = fill_pollfds(clients, clients_len, worker->wakefd, pfds);
+
+    if (poll(pfds, polled, timerwheel_timeout(&timers, now)) < 0 && errno != EINTR) {
+      perror("directoryServer -- lookup thread can't poll");
+      exit(1);
+    }
+    if (__atomic_load_n(&lookups_stopping, __ATOMIC_ACQUIRE))
+      break;
+    now = timerwheel_clock();
+
+    if (pfds[0].revents & POLLIN)
+      take_handed(worker, clients, &clients_len);
+
+    // Only clients that were polled (not the ones just handed over)
+    serve_clients(clients, clients_len, pfds, polled);
+
+    twtimer_t *t, *next;
+    for (t = timerwheel_expire(&timers, now); t; t = next) {
+      next = t->next;
+      LOG_INFO("Connection timed out, disconnecting it");
+      __atomic_fetch_add(&metrics.timed_out, 1, __ATOMIC_RELAXED);
+      disconnect_client((client_t *)((char *)t - offsetof(client_t, timer)));
+    }
 
-    FD_SET(client->fd, read_set);
-    FD_SET(client->fd, write_set);
+    before = clients_len;
+    remove_disconnected(clients, &clients_len);
+    __atomic_fetch_sub(&lookup_clients, before - clients_len, __ATOMIC_RELAXED);
   }
+  free(clients);
+  free(pfds);
+  return NULL;
+}
 
-  return max_fd;
+// Start the lookup threads. SIGINT is already blocked by then, so it only
+// reaches the main thread's ppoll().
+//
+// Returns 0 on success, -1 on failure.
+int start_lookup_threads(void) {
+  if (!lookup_threads)
+    return 0;
+  if (!(lookup_workers = calloc(lookup_threads, sizeof(lookup_worker_t))))
+    return -1;
+
+  for (size_t i = 0; i < lookup_threads; i++) {
+    lookup_worker_t *worker = &lookup_workers[i];
+
+    worker->reader = i;
+    if ((worker->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+        pthread_mutex_init(&worker->lock, NULL) != 0 ||
+        (errno = pthread_create(&worker->thread, NULL, lookup_thread, worker)) != 0)
+      return -1;
+  }
+  LOG_INFO("Answering lookups on %zu threads", lookup_threads);
+  return 0;
+}
+
+// Have the lookup threads return, and wait for them. Their clients are left
+// as they are, the process is on its way out.
+void stop_lookup_threads(void) {
+  uint64_t wake = 1;
+
+  __atomic_store_n(&lookups_stopping, 1, __ATOMIC_RELEASE);
+  for (size_t i = 0; i < lookup_threads; i++) {
+    if (write(lookup_workers[i].wakefd, &wake, sizeof(wake)) < 0)
+      LOG_WARN("Can't wake lookup thread: %s", strerror(errno));
+  }
+  for (size_t i = 0; i < lookup_threads; i++)
+    pthread_join(lookup_workers[i].thread, NULL);
+}
+
+// Shut down after SIGINT, from the main loop: the lookup threads go first, so
+// nothing is still using the log, the registry or the TLS state when they're
+// flushed and freed.
+void shut_down(int signo) {
+  stop_lookup_threads();
+  log_flush();
+  fprintf(stderr, "\nCaught signal: %d\n", signo);
+  fprintf(stderr, "Accepted %lu connections (%lu rejected) in %lu batches, largest batch %d\n",
+          metrics.accepted, metrics.rejected, metrics.accept_batches, metrics.max_batch);
+  if (use_ktls)
+    fprintf(stderr, "Kernel TLS: %lu of %lu sessions offloaded\n", metrics.ktls, metrics.accepted - metrics.rejected);
+  fprintf(stderr, "Handshakes: %lu started (%lu resumed), %lu waited for a turn, %lu turned away\n",
+          admission.started, admission.resumed, admission.waited, admission.rejected);
+  fprintf(stderr, "Timed out %lu connections\n", metrics.timed_out);
+  fprintf(stderr, "Heartbeats: %lu received, %lu servers evicted\n", metrics.heartbeats, metrics.evicted);
+  fprintf(stderr, "Lookups: %lu answered, %zu lookup threads\n", metrics.lookups, lookup_threads);
+  if (registry)
+    regshm_destroy(registry, regshm_path());
+  closeTLS();
+  exit(0);
 }
 
 int main(int argc, char** argv) {
+  size_t backlog = 0;
+  const char *priority = NULL;
+  int opt, publish = 0;
+
+  while ((opt = getopt(argc, argv, "c:s:b:kp:r:et:")) != -1) {
+    switch (opt) {
+    case 'c': // Max number of connections
+      if (parse_count(optarg, &max_clients) < 0) {
+        fprintf(stderr, "Could not parse client capacity\n");
+        exit(1);
+      }
+      break;
+    case 's': // Max number of registered servers
+      if (parse_count(optarg, &max_servers) < 0) {
+        fprintf(stderr, "Could not parse server capacity\n");
+        exit(1);
+      }
+      break;
+    case 'b': // Listen backlog
+      if (parse_count(optarg, &backlog) < 0) {
+        fprintf(stderr, "Could not parse listen backlog\n");
+        exit(1);
+      }
+      break;
+    case 'k': // Use kernel TLS once clients finish their handshake
+      use_ktls = 1;
+      break;
+    case 'p': // TLS priority string
+      priority = optarg;
+      break;
+    case 'r': // How to pick between servers of the same topic
+      if (strcmp(optarg, "least") == 0) {
+        select_policy = SELECT_LEAST_LOADED;
+      } else if (strcmp(optarg, "hash") == 0) {
+        select_policy = SELECT_HASH;
+      } else {
+        fprintf(stderr, "Server selection must be least or hash\n");
+        exit(1);
+      }
+      break;
+    case 'e': // Publish the servers for local clients
+      publish = 1;
+      break;
+    case 't': // Threads answering lookups
+      if (parse_count(optarg, &lookup_threads) < 0) {
+        fprintf(stderr, "Could not parse lookup thread count\n");
+        exit(1);
+      }
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-c max clients] [-s max servers] [-b listen backlog] [-k] [-p tls priorities] [-r least|hash] [-e] [-t lookup threads]\n", argv[0]);
+      exit(1);
+    }
+  }
+
+  if (log_init() < 0)
+    perror("directoryServer -- can't start log writer, logging directly");
+
+  size_t fits;
+  if ((fits = raise_fd_limit(max_clients)) < max_clients) {
+    fprintf(stderr, "Open file limit only allows %zu clients\n", fits);
+    max_clients = fits;
+  }
+  if (!backlog)
+    backlog = max_clients;
 
   // gnuTLS INITIALIZATION
   if (gnutls_global_init() < 0){ //FIX needs to be freed with gnutls_global_deinit();
@@ -491,10 +1362,37 @@ int main(int argc, char** argv) {
     gnutls_certificate_free_credentials(x509_cred);
     exit(1);
   }
+  if (tls_priority_init(&priority_cache, priority) < 0) {
+    gnutls_global_deinit();
+    gnutls_certificate_free_credentials(x509_cred);
+    exit(1);
+  }
+  if (gnutls_session_ticket_key_generate(&ticket_key) < 0) {
+    perror("directoryServer -- TLS error: can't generate session ticket key");
+    closeTLS();
+    exit(1);
+  }
+  admission_init(&admission, MAX_HANDSHAKES, HANDSHAKE_QUEUE);
+
+  if (pool_init(&buffer_pool, MAX + 1, 2 * max_clients) < 0 ||
+      pool_init(&topic_pool, MAXTOPICLEN + 1, max_servers) < 0) {
+    perror("directoryServer -- can't allocate client pools");
+    closeTLS();
+    exit(1);
+  }
 
-  // 1. Create communication endpoint
+  // SIGINT is only let through while the main loop waits in ppoll(), so it
+  // can't land between checking for it and going to sleep
+  sigset_t sigint, unblocked;
+  sigemptyset(&sigint);
+  sigaddset(&sigint, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &sigint, &unblocked);
+  signal(SIGINT, sighandler);
+
+  // 1. Create communication endpoint, non-blocking so the backlog can be
+  // drained until it's empty
   int serverfd;
-  if ((serverfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+  if ((serverfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
     perror("chatServer -- can't open stream socket");
     closeTLS();
     exit(1);
@@ -527,205 +1425,141 @@ int main(int argc, char** argv) {
   }
 
   // 4. Set max clients
-  if (listen(serverfd, MAX_CLIENTS) < 0) {
+  if (listen(serverfd, backlog > INT_MAX ? INT_MAX : (int)backlog) < 0) {
     perror("chatServer -- can't set max clients");
     closeTLS();
     exit(1);
   }
 
-  fd_set readset;
-  fd_set writeset;
-
   // Default init clients
   size_t clients_len = 0;
-  size_t clients_cap = 2;
-  client_t *clients = calloc(clients_cap, sizeof(client_t));
+  client_t *clients = calloc(max_clients, sizeof(client_t));
+  struct pollfd *pfds = calloc(max_clients + 1, sizeof(struct pollfd));
 
   assert(clients);
+  assert(pfds);
 
-  // 5. Start our main loop
-  DEBUG_MSG("Starting mainloop!\n");
-  for (;;) {
-    int max_fd = fill_fdset(clients, clients_len, serverfd, &readset, &writeset);
+  now = timerwheel_clock();
+  timerwheel_init(&timers, TIMER_TICK, now);
 
-    if (select(max_fd + 1, &readset, &writeset, NULL, NULL) < 0) {
-      perror("chatServer -- can't select");
+  if (publish) {
+    if (!(registry = regshm_create(regshm_path()))) {
+      perror("directoryServer -- can't create registry snapshot");
       closeTLS();
       exit(1);
     }
+    publish_registry(clients, clients_len);
+    timerwheel_arm(&timers, &registry_refresh, now, REGSHM_REFRESH);
+  }
 
-    // Bind new client
-    if (FD_ISSET(serverfd, &readset)) {
-      DEBUG_MSG("New Client!!\n");
-      struct sockaddr_in cli_addr;
-      socklen_t clilen = sizeof(cli_addr);
-
-      // Accept new socket
-      int newsockfd;
-      if ((newsockfd =
-               accept(serverfd, (struct sockaddr *)&cli_addr, &clilen)) < 0) {
-        perror("chatServer: accept error");
-        continue;
-      }
+  // Lookups start out with an empty table
+  if (rcu_init(&lookup_rcu, lookup_threads) < 0) {
+    perror("directoryServer -- can't set up the lookup table");
+    closeTLS();
+    exit(1);
+  }
+  publish_lookups(clients, clients_len);
+  if (start_lookup_threads() < 0) {
+    perror("directoryServer -- can't start lookup threads");
+    closeTLS();
+    exit(1);
+  }
 
-      // Set socket to non-blocking
-      if (fcntl(newsockfd, F_SETFL, O_NONBLOCK) < 0) {
-        perror("chatServer -- can't set socket to non-blocking...");
-        close(newsockfd);
-        continue;
-      }
+  // 5. Start our main loop
+  LOG_DEBUG("Starting mainloop!");
+  for (;;) {
+    size_t polled = fill_pollfds(clients, clients_len, serverfd, pfds);
+    int timeout = timerwheel_timeout(&timers, now);
+    struct timespec ts = {.tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000L};
 
-      // Create the new client structure
-      client_t client = new_client();
-      client.fd = newsockfd;
-      client.addr_info = cli_addr;
+    // Sleep until there's I/O, the next deadline or SIGINT
+    if (ppoll(pfds, polled, timeout < 0 ? NULL : &ts, &unblocked) < 0 && errno != EINTR) {
+      perror("chatServer -- can't poll");
+      closeTLS();
+      exit(1);
+    }
+    if (caught_signal)
+      shut_down(caught_signal);
+    now = timerwheel_clock();
+
+    // Bind new clients, draining the backlog up to a budget so a connection
+    // storm can't starve the clients we already have
+    if (pfds[0].revents & POLLIN) {
+      int accepted = 0;
+
+      for (int n = 0; n < ACCEPT_BUDGET; n++) {
+        struct sockaddr_in cli_addr;
+        socklen_t clilen = sizeof(cli_addr);
+
+        // Accept new socket, already non-blocking
+        int newsockfd = accept4(serverfd, (struct sockaddr *)&cli_addr, &clilen,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newsockfd < 0) {
+          if (errno == ECONNABORTED || errno == EINTR)
+            continue;
+          if (errno != EAGAIN && errno != EWOULDBLOCK)
+            perror("chatServer: accept error");
+          break;
+        }
 
-      //gnuTLS session setup
-      int TLSfail = 0;
-      if(gnutls_init(&client.session, GNUTLS_SERVER) < 0){
-        perror("directoryServer -- TLS error: failed to initialize session");
-        TLSfail = 1;
-      }
-      if(gnutls_credentials_set(client.session, GNUTLS_CRD_CERTIFICATE, x509_cred) < 0){
-        perror("directoryServer -- TLS error: failed to set credentials");
-        TLSfail = 1;
-      }
-      if(gnutls_set_default_priority(client.session) < 0){
-        perror("directoryServer -- TLS error: failed priority set");
-        TLSfail = 1;
-      }
+        LOG_DEBUG("New Client!!");
+        accepted++;
+        metrics.accepted++;
 
-      if (TLSfail) { //TLS setup error- close client connection and don't add them to array
-        close(newsockfd);
-        free_client(&client);
-        TLSfail = 1;
-        continue;
-      } else{
-        // Set up transport layer -- pg 178
-        gnutls_transport_set_int(client.session, newsockfd);
-        
-        //TLS handshake
-        int handshake;
-        LOOP_CHECK(handshake, gnutls_handshake(client.session));
-        if (handshake < 0 ) {
-          //disconnect Client- handshake failed
+        // Every slot is taken (here or on the lookup threads)
+        if (clients_len + __atomic_load_n(&lookup_clients, __ATOMIC_RELAXED) >= max_clients) {
+          LOG_WARN("Too many clients, closing socket");
           close(newsockfd);
-          free_client(&client);
-          // TLS Handshake error handling
-          fprintf(stderr, "%s:%d Client Handshake failed: %s\n", __FILE__, __LINE__, gnutls_strerror(handshake));
-          gnutls_datum_t out;
-          int type = gnutls_certificate_type_get(client.session);
-          unsigned status = gnutls_session_get_verify_cert_status(client.session);
-          gnutls_certificate_verification_status_print(status, type, &out, 0);
-          fprintf(stderr, "cert verify output: %s\n", out.data);
-          gnutls_free(out.data);
+          metrics.rejected++;
           continue;
         }
-        else { //Successful TLS handshake
-          fprintf(stderr, "directory Server: Client Handshake completed!\n");
-
-          // Need to expand the array
-          if (clients_len >= clients_cap) {
-            clients_cap *= 2;
-
-            clients = realloc(clients, clients_cap * sizeof(client_t));
-
-            assert(clients);
-          }
 
-          DEBUG_MSG("len = %zu\n", clients_len);
-          // Put the client into the array
-          clients[clients_len] = client;
-          clients_len++;
-        }
+        add_client(clients, &clients_len, newsockfd, &cli_addr);
       }
 
-     
+      if (accepted) {
+        metrics.accept_batches++;
+        if (accepted > metrics.max_batch)
+          metrics.max_batch = accepted;
+      }
     }
 
-    for (int i = 0; i < clients_len; i++) {
-      client_t *client = &clients[i];
-
-      if (!client)
+    // Only clients that were polled (not the one just accepted)
+    serve_clients(clients, clients_len, pfds, polled);
+
+    // Disconnect whoever ran out of time (they're closed like any other
+    // disconnect, below)
+    twtimer_t *t, *next;
+    for (t = timerwheel_expire(&timers, now); t; t = next) {
+      next = t->next;
+      if (t == &registry_refresh) {
+        // Rewritten below, even if nothing changed
+        timerwheel_arm(&timers, &registry_refresh, now, REGSHM_REFRESH);
         continue;
-
-      if (FD_ISSET(client->fd, &readset)) {
-        // We want to get anything the client might've sent us
-        client_rx(client);
-
-        // Then we process it each time, regardless if the msg
-        // is finished
-        parse_client_msg(clients, clients_len, client);
       }
+      client_t *client = (client_t *)((char *)t - offsetof(client_t, timer));
 
-      if (FD_ISSET(client->fd, &writeset)) {
-        client_tx(client);
+      // Heartbeats only push the deadline back when it comes around
+      if (client->kind == CON_SERVER) {
+        if (now - client->last_heartbeat < HEARTBEAT_TIMEOUT) {
+          timerwheel_arm(&timers, &client->timer, now, HEARTBEAT_TIMEOUT - (now - client->last_heartbeat));
+          continue;
+        }
+        LOG_WARN("Server %s missed its heartbeats, evicting it", client->topic);
+        metrics.evicted++;
+      } else {
+        LOG_INFO("Connection timed out, disconnecting it");
+        __atomic_fetch_add(&metrics.timed_out, 1, __ATOMIC_RELAXED);
       }
+      disconnect_client(client);
     }
 
-    // When we handle a client and its time for disconnect, we won't
-    // remove it from the list. Since it can cause UB, so instead we
-    // disconnect the client and set it's FD to `0`.
-    //
-    // Here we look though all the client's that have FDs of zero,
-    // and actually remove them from the list.
-    //
-    // Since we are iter over the list at the same time as modifying
-    // the list we need to be extra careful to ensure we don't RW to
-    // undefined memory.
-    //
-    // NOTE:
-    // This can be done in the main loop, but its much eaiser to
-    // verify the soundness of the above loop without this. That is
-    // why it is moved to another loop.
     assert(clients);
+    remove_disconnected(clients, &clients_len);
+    admit_waiting(clients, clients_len);
+    publish_lookups(clients, clients_len);
 
-    for (int i = 0; i < clients_len; i++) {
-      client_t *client = &clients[i];
-
-      if (!client)
-        continue;
-      if (client->fd)
-        continue;
-
-      DEBUG_MSG("Removing client at index='%d' from the list!\n", i);
-
-      free_client(client);
-
-      // Pulled from heaplist from previous assignments
-      //
-      // # Steps:
-      // 
-      // So, we have an array like this:
-      //    [ X , X , 4 , 3 , 2 , 1]
-      // 
-      // Where 'X' is an empty element. So, this array will have
-      // a length of 4, and a capacity of 6. If we want to remove
-      // element '2' from the array we need to shift '3' and '4' 
-      // down one element. 
-      //
-      // 'dest' is the source element of the move (aka the '2' from
-      // our example above) and 'src' is the element above it. 
-      // 
-      // We must also calculate the exact number of _bytes_ needed
-      // for the copy, and the result is stored in 'count'.
-      //
-      // # Graphic Explaining the process:
-      //
-      //   [ X , X , 4 , 3 , 2 , 1]  | : Starting array
-      //           [ 4 , 3 ]         | : The elements we want to move
-      //               [ 4 , 3 ]     | : Copied one element down
-      //   [ X , X , X , 4 , 3 , 1 ] X : Final Array
-      //
-      size_t el_size = sizeof(client_t);
-      char* src = (char*)clients + (el_size * (i + 1));
-      char* dest = (char*)clients + (el_size * i);
-
-      size_t count = (clients_len - i - 1) * el_size;
-      clients_len--;
-
-      memmove(dest, src, count);
-      i--;
-    }
+    if (registry)
+      publish_registry(clients, clients_len);
   }
 }
@@ -0,0 +1,175 @@
+#define _GNU_SOURCE
+#include "dirproto.h"
+#include <string.h>
+
+// Where in a command the parser is
+enum {
+  ST_IDLE,       // Between commands
+  ST_C,          // Got 'c'
+  ST_LIST_END,   // Got "cl", waiting for the end
+  ST_REQ_TOPIC,  // Reading the topic of "cr"
+  ST_REG_TOPIC,  // Reading the topic of "s"
+  ST_REG_SPACE,  // Got ';', skipping spaces before the port
+  ST_REG_PORT,   // Reading the port
+  ST_HB_FIRST,   // Waiting for the first digit of a heartbeat number
+  ST_HB_NUM,     // Reading a heartbeat number
+  ST_MESH_FIRST, // Got 'm', waiting for the first digit of the port
+  ST_MESH_PORT,  // Reading the port of "m"
+};
+
+#define IS_END(c) ((c) == '\0' || (c) == '\n')
+
+void dirproto_init(dirproto_t *p) {
+  memset(p, 0, sizeof(dirproto_t));
+}
+
+int dirproto_parse(dirproto_t *p, const char *buf, size_t len, size_t *used) {
+  // Work on locals, the compiler has to assume writes through `buf` could
+  // change `*p` otherwise
+  int state = p->state, cmd = 0;
+  size_t topic_len = p->topic_len;
+  uint32_t port = p->port;
+  uint64_t num = p->port; // Heartbeat numbers are read in place of the port
+  size_t i = 0;
+
+  while (i < len && !cmd) {
+    char c = buf[i++];
+
+    switch (state) {
+    case ST_IDLE:
+      // Skip the rest of the frame padding in one go
+      if (IS_END(c)) {
+        while (i < len && IS_END(buf[i]))
+          i++;
+        break;
+      }
+      topic_len = 0;
+      port = 0;
+      p->topic[0] = '\0';
+      if (c == 'c')
+        state = ST_C;
+      else if (c == 's')
+        state = ST_REG_TOPIC;
+      else if (c == 'm')
+        state = ST_MESH_FIRST;
+      else if (c == 'h') {
+        state = ST_HB_FIRST;
+        p->field = 0;
+      } else
+        goto invalid;
+      break;
+
+    case ST_C:
+      if (c == 'l')
+        state = ST_LIST_END;
+      else if (c == 'r')
+        state = ST_REQ_TOPIC;
+      else
+        goto invalid;
+      break;
+
+    case ST_LIST_END:
+      if (!IS_END(c))
+        goto invalid;
+      cmd = DIRPROTO_LIST;
+      break;
+
+    case ST_REQ_TOPIC:
+    case ST_REG_TOPIC:
+      // Copy topic chars until one that means something
+      while (!IS_END(c) && c != ';' && c != ',') {
+        if (topic_len >= MAXTOPICLEN - 1)
+          goto invalid;
+        p->topic[topic_len++] = c;
+        if (i == len)
+          goto out;
+        c = buf[i++];
+      }
+      // The topic is done, it must not be empty and has to end the right way
+      if (!topic_len || c == ',')
+        goto invalid;
+      p->topic[topic_len] = '\0';
+      if (state == ST_REQ_TOPIC) {
+        if (c == ';')
+          goto invalid;
+        cmd = DIRPROTO_REQUEST;
+      } else {
+        if (c != ';')
+          goto invalid;
+        state = ST_REG_SPACE;
+      }
+      break;
+
+    case ST_REG_SPACE:
+      if (c == ' ')
+        break;
+      state = ST_REG_PORT;
+      // The first digit needs reading too
+      if (c < '0' || c > '9')
+        goto invalid;
+      port = c - '0';
+      break;
+
+    case ST_MESH_FIRST:
+      if (c < '0' || c > '9')
+        goto invalid;
+      port = c - '0';
+      state = ST_MESH_PORT;
+      break;
+
+    case ST_REG_PORT:
+    case ST_MESH_PORT:
+      if (IS_END(c)) {
+        cmd = state == ST_REG_PORT ? DIRPROTO_REGISTER : DIRPROTO_MESH;
+      } else if (c < '0' || c > '9' || (port = port * 10 + (c - '0')) > UINT16_MAX) {
+        goto invalid;
+      }
+      break;
+
+    case ST_HB_FIRST:
+      if (c < '0' || c > '9')
+        goto invalid;
+      num = c - '0';
+      state = ST_HB_NUM;
+      break;
+
+    case ST_HB_NUM:
+      if (c >= '0' && c <= '9') {
+        if ((num = num * 10 + (c - '0')) > UINT32_MAX)
+          goto invalid;
+        break;
+      }
+      // A number is done, the last one ends the command
+      if (p->field == 0)
+        p->members = num;
+      else if (p->field == 1)
+        p->rate = num;
+      else
+        p->queue = num;
+      if (c == ';' && p->field < 2) {
+        p->field++;
+        state = ST_HB_FIRST;
+      } else if (IS_END(c) && p->field == 2) {
+        cmd = DIRPROTO_HEARTBEAT;
+      } else {
+        goto invalid;
+      }
+      break;
+
+    default:
+      goto invalid;
+    }
+  }
+
+out:
+  p->state = cmd ? ST_IDLE : state;
+  p->topic_len = topic_len;
+  p->port = state == ST_HB_NUM ? (uint32_t)num : port;
+  *used = i;
+  return cmd;
+
+invalid:
+  p->state = state;
+  *used = i;
+  return -1;
+}
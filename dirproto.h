@@ -0,0 +1,59 @@
+#ifndef __DIRPROTO_H__
+#define __DIRPROTO_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+
+// Incremental parser for the commands sent to the directory:
+//
+//   "cl"                 : list every topic
+//   "cr{TOPIC}"          : ask for a topic's server
+//   "s{TOPIC}; {PORT}"   : register a server
+//   "h{MEMBERS};{RATE};{QUEUE}" : heartbeat from a registered server, with
+//                          its load (see `dirproto_t`)
+//   "m{PORT}"            : a registered server's port for links to the
+//                          other servers of its topic
+//
+// Each command ends with a '\0' or '\n', and any number of them can be
+// padding between commands (both programs send fixed `MAX` byte frames).
+// TOPIC is 1 to `MAXTOPICLEN - 1` chars without ',' or ';', and PORT a
+// decimal number that fits a `uint16_t`. Heartbeat numbers are decimal and
+// fit a `uint32_t`.
+//
+// Bytes can be fed in whatever pieces they arrive in. The parser keeps
+// everything it needs from them, so the caller can drop every byte it has
+// fed, and it never allocates.
+
+// Commands
+#define DIRPROTO_LIST     1
+#define DIRPROTO_REQUEST  2
+#define DIRPROTO_REGISTER 3
+#define DIRPROTO_HEARTBEAT 4
+#define DIRPROTO_MESH     5
+
+typedef struct {
+  int state;
+
+  // The command last returned by `dirproto_parse()`, or the one being read
+  char topic[MAXTOPICLEN];
+  size_t topic_len;
+  uint32_t port;
+
+  // Last heartbeat
+  uint32_t members; // Clients chatting on the server
+  uint32_t rate;    // Messages per minute since the last heartbeat
+  uint32_t queue;   // Messages waiting to be sent to its clients
+  int field;        // Which of those is being read
+} dirproto_t;
+
+void dirproto_init(dirproto_t *p);
+
+// Feed `len` bytes of `buf`, stopping at the end of the first command.
+// `*used` is set to how many bytes were fed.
+//
+// Returns the command (the topic and port are in `p`), 0 if every byte was
+// fed without finishing one, or -1 if the bytes aren't a valid command.
+int dirproto_parse(dirproto_t *p, const char *buf, size_t len, size_t *used);
+
+#endif
@@ -0,0 +1,119 @@
+#define _GNU_SOURCE
+#include "handoff.h"
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Sequenced packets keep each message in one piece
+static int handoff_socket(void) {
+  return socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+}
+
+static int handoff_addr(struct sockaddr_un *addr, const char *path) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+static int handoff_timeout(int sock, unsigned timeout_ms) {
+  struct timeval tv = {.tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000};
+  return setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+int handoff_listen(const char *path) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if (handoff_addr(&addr, path) < 0 || (fd = handoff_socket()) < 0)
+    return -1;
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int handoff_accept(int fd, unsigned timeout_ms) {
+  int sock = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+
+  if (sock >= 0 && handoff_timeout(sock, timeout_ms) < 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+int handoff_connect(const char *path, unsigned timeout_ms) {
+  struct sockaddr_un addr;
+  int sock;
+
+  if (handoff_addr(&addr, path) < 0 || (sock = handoff_socket()) < 0)
+    return -1;
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || handoff_timeout(sock, timeout_ms) < 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+int handoff_send(int sock, int type, const void *buf, size_t len, int fd) {
+  uint32_t t = type;
+  struct iovec iov[2] = {{.iov_base = &t, .iov_len = sizeof(t)}, {.iov_base = (void *)buf, .iov_len = len}};
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+  struct cmsghdr *cmsg;
+
+  if (fd >= 0) {
+    memset(&control, 0, sizeof(control));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+ssize_t handoff_recv(int sock, int *type, void *buf, size_t cap, int *fd) {
+  uint32_t t;
+  struct iovec iov[2] = {{.iov_base = &t, .iov_len = sizeof(t)}, {.iov_base = buf, .iov_len = cap}};
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2, .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+  struct cmsghdr *cmsg;
+  ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+
+  *fd = -1;
+  if (n < 0)
+    return -1;
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+  if ((size_t)n < sizeof(t) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+    if (*fd >= 0)
+      close(*fd);
+    *fd = -1;
+    errno = n == 0 ? ECONNRESET : EMSGSIZE;
+    return -1;
+  }
+  *type = t;
+  return n - sizeof(t);
+}
@@ -0,0 +1,48 @@
+#ifndef __HANDOFF_H__
+#define __HANDOFF_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Handing a running server over to a new process (a newer build, say) on the
+// same machine, so it can be restarted without dropping anyone.
+//
+// The running server listens on a Unix socket at some path, and a new one
+// started with the same path connects to it. The two then trade messages,
+// each a type and a record of the caller's choosing, optionally carrying an
+// open descriptor (passed with SCM_RIGHTS, so the receiver gets its own copy
+// of the same socket). Messages keep their boundaries and arrive in order,
+// and both ends block; receiving gives up after `timeout_ms`, so neither
+// server waits forever on the other.
+
+// Listen at `path` for a new server taking over, replacing whatever was
+// there (the server that had it may still be handing over on it).
+//
+// Returns the listening socket, or -1 with errno set.
+int handoff_listen(const char *path);
+
+// Accept a new server on the listening socket `fd`.
+//
+// Returns its socket, or -1 with errno set.
+int handoff_accept(int fd, unsigned timeout_ms);
+
+// Connect to the server listening at `path`.
+//
+// Returns the socket, or -1 with errno set (ENOENT or ECONNREFUSED when no
+// server is there).
+int handoff_connect(const char *path, unsigned timeout_ms);
+
+// Send a message of `type` with the `len` bytes at `buf`, and descriptor `fd`
+// unless it's -1.
+//
+// Returns 0, or -1 with errno set.
+int handoff_send(int sock, int type, const void *buf, size_t len, int fd);
+
+// Receive the next message into `buf` (up to `cap` bytes), with its type in
+// `*type` and its descriptor in `*fd` (-1 if it had none).
+//
+// Returns the bytes in it, or -1 with errno set (ECONNRESET once the other
+// end is gone, EMSGSIZE if it didn't fit).
+ssize_t handoff_recv(int sock, int *type, void *buf, size_t cap, int *fd);
+
+#endif
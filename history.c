@@ -0,0 +1,61 @@
+#define _GNU_SOURCE
+#include "history.h"
+#include <stdlib.h>
+#include <string.h>
+
+int history_init(history_t *h, size_t len) {
+  size_t cap = 1;
+  while (cap < len)
+    cap <<= 1;
+
+  memset(h, 0, sizeof(history_t));
+  h->frames = calloc(cap, sizeof(*h->frames));
+  h->origins = calloc(cap, sizeof(*h->origins));
+  if (!h->frames || !h->origins) {
+    history_free(h);
+    return -1;
+  }
+  h->cap = cap;
+  h->base = h->next = 1;
+  return 0;
+}
+
+void history_free(history_t *h) {
+  free(h->frames);
+  free(h->origins);
+  memset(h, 0, sizeof(history_t));
+}
+
+uint64_t history_first(const history_t *h) {
+  return h->next - h->base > h->cap ? h->next - h->cap : h->base;
+}
+
+uint64_t history_append(history_t *h, const char *msg, uint64_t origin) {
+  size_t slot = h->next & (h->cap - 1);
+
+  // strncpy pads the rest of the frame with zeros, like a fresh buffer
+  strncpy(h->frames[slot], msg, MAX - 1);
+  h->frames[slot][MAX - 1] = '\0';
+  h->origins[slot] = origin;
+  return h->next++;
+}
+
+void history_restore(history_t *h, uint64_t seq, const char *frame, uint64_t origin) {
+  // Anything kept from before a gap isn't part of the sequence anymore
+  if (seq != h->next)
+    h->base = seq;
+  h->next = seq;
+  memcpy(h->frames[seq & (h->cap - 1)], frame, MAX);
+  h->origins[seq & (h->cap - 1)] = origin;
+  h->next++;
+}
+
+const char *history_get(const history_t *h, uint64_t seq, uint64_t *origin) {
+  if (seq >= h->next || seq < history_first(h))
+    return NULL;
+
+  size_t slot = seq & (h->cap - 1);
+  if (origin)
+    *origin = h->origins[slot];
+  return h->frames[slot];
+}
@@ -0,0 +1,46 @@
+#ifndef __HISTORY_H__
+#define __HISTORY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+
+// Recent chat messages of a topic, kept as the exact `MAX` byte frames sent
+// to clients so they can be sent again (to a client catching up) without
+// formatting them again.
+//
+// Every message gets the next sequence number, starting at 1. Only the last
+// `cap` messages are kept; older ones are overwritten.
+typedef struct {
+  char (*frames)[MAX];
+  uint64_t *origins; // Who sent each message, so it isn't echoed back to them
+  size_t cap;        // Always a power of two
+  uint64_t base;     // Oldest sequence number it ever had
+  uint64_t next;     // Sequence number the next message gets
+} history_t;
+
+// Create a history holding at least `len` messages.
+//
+// Returns 0 on success, -1 on failure.
+int history_init(history_t *h, size_t len);
+
+void history_free(history_t *h);
+
+// Oldest sequence number still kept (equal to `h->next` when empty)
+uint64_t history_first(const history_t *h);
+
+// Add a message. `msg` is copied into a zero padded frame.
+//
+// Returns its sequence number.
+uint64_t history_append(history_t *h, const char *msg, uint64_t origin);
+
+// Put back message `seq` with its frame, e.g. from a log after a restart.
+// Messages have to be restored oldest first; the next one appended gets
+// `seq + 1`.
+void history_restore(history_t *h, uint64_t seq, const char *frame, uint64_t origin);
+
+// Frame of message `seq`, with its sender in `*origin`, or NULL if it isn't
+// kept (too old, or not sent yet).
+const char *history_get(const history_t *h, uint64_t seq, uint64_t *origin);
+
+#endif
@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+#include "ktls.h"
+#include <errno.h>
+#include <linux/tls.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+// Big enough for every crypto_info the kernel takes
+union ktls_crypto_info {
+  struct tls_crypto_info info;
+  struct tls12_crypto_info_aes_gcm_128 aes128;
+  struct tls12_crypto_info_aes_gcm_256 aes256;
+  struct tls12_crypto_info_chacha20_poly1305 chacha;
+};
+
+// Fill `ci` with the keys of one direction of `session`.
+//
+// Returns the size of the filled struct, or -1 if the cipher isn't supported.
+static int ktls_crypto_info(gnutls_session_t session, int read, union ktls_crypto_info *ci) {
+  gnutls_datum_t mac_key, iv, key;
+  unsigned char seq[8];
+  unsigned short version;
+  int tls13;
+
+  switch (gnutls_protocol_get_version(session)) {
+  case GNUTLS_TLS1_2:
+    version = TLS_1_2_VERSION;
+    tls13 = 0;
+    break;
+  case GNUTLS_TLS1_3:
+    version = TLS_1_3_VERSION;
+    tls13 = 1;
+    break;
+  default:
+    return -1;
+  }
+
+  if (gnutls_record_get_state(session, read, &mac_key, &iv, &key, seq) < 0)
+    return -1;
+
+  memset(ci, 0, sizeof(*ci));
+  ci->info.version = version;
+
+  // The nonce is salt || iv. Under TLS 1.2 GCM only the salt is implicit, and
+  // gnutls uses the sequence number as the explicit part.
+  switch (gnutls_cipher_get(session)) {
+  case GNUTLS_CIPHER_AES_128_GCM:
+    if (key.size != TLS_CIPHER_AES_GCM_128_KEY_SIZE || iv.size < TLS_CIPHER_AES_GCM_128_SALT_SIZE)
+      return -1;
+    ci->info.cipher_type = TLS_CIPHER_AES_GCM_128;
+    memcpy(ci->aes128.key, key.data, key.size);
+    memcpy(ci->aes128.salt, iv.data, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+    if (tls13)
+      memcpy(ci->aes128.iv, iv.data + TLS_CIPHER_AES_GCM_128_SALT_SIZE, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+    else
+      memcpy(ci->aes128.iv, seq, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+    memcpy(ci->aes128.rec_seq, seq, sizeof(seq));
+    return sizeof(ci->aes128);
+
+  case GNUTLS_CIPHER_AES_256_GCM:
+    if (key.size != TLS_CIPHER_AES_GCM_256_KEY_SIZE || iv.size < TLS_CIPHER_AES_GCM_256_SALT_SIZE)
+      return -1;
+    ci->info.cipher_type = TLS_CIPHER_AES_GCM_256;
+    memcpy(ci->aes256.key, key.data, key.size);
+    memcpy(ci->aes256.salt, iv.data, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+    if (tls13)
+      memcpy(ci->aes256.iv, iv.data + TLS_CIPHER_AES_GCM_256_SALT_SIZE, TLS_CIPHER_AES_GCM_256_IV_SIZE);
+    else
+      memcpy(ci->aes256.iv, seq, TLS_CIPHER_AES_GCM_256_IV_SIZE);
+    memcpy(ci->aes256.rec_seq, seq, sizeof(seq));
+    return sizeof(ci->aes256);
+
+  case GNUTLS_CIPHER_CHACHA20_POLY1305:
+    if (key.size != TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE || iv.size != TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE)
+      return -1;
+    ci->info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+    memcpy(ci->chacha.key, key.data, key.size);
+    memcpy(ci->chacha.iv, iv.data, iv.size);
+    memcpy(ci->chacha.rec_seq, seq, sizeof(seq));
+    return sizeof(ci->chacha);
+
+  default:
+    return -1;
+  }
+}
+
+int ktls_enable(gnutls_session_t session, int fd) {
+  union ktls_crypto_info tx, rx;
+  int tx_len, rx_len, enabled = 0;
+
+  // Check the cipher before touching the socket, so an unsupported session
+  // is left exactly as it was
+  tx_len = ktls_crypto_info(session, 0, &tx);
+  rx_len = ktls_crypto_info(session, 1, &rx);
+  if (tx_len < 0)
+    goto done;
+
+  if (setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+    enabled = -1;
+    goto done;
+  }
+
+  // Until keys are set, the socket still passes bytes through untouched
+  if (setsockopt(fd, SOL_TLS, TLS_TX, &tx, tx_len) == 0)
+    enabled |= KTLS_TX;
+
+  // Records gnutls already pulled off the socket would be lost to the kernel
+  if (rx_len > 0 && gnutls_record_check_pending(session) == 0 &&
+      setsockopt(fd, SOL_TLS, TLS_RX, &rx, rx_len) == 0)
+    enabled |= KTLS_RX;
+
+done:;
+  // The keys are on the stack, don't leave them there
+  int err = errno;
+  explicit_bzero(&tx, sizeof(tx));
+  explicit_bzero(&rx, sizeof(rx));
+  errno = err;
+  return enabled;
+}
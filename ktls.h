@@ -0,0 +1,27 @@
+#ifndef __KTLS_H__
+#define __KTLS_H__
+
+#include <gnutls/gnutls.h>
+
+// Kernel TLS (kTLS) offload for established gnutls sessions.
+//
+// Once a direction is offloaded the kernel encrypts (or decrypts) records
+// itself, so the socket is read and written with plain read()/write() and
+// gnutls must no longer touch that direction of the session.
+
+// Directions that can be offloaded
+#define KTLS_RX 0x1
+#define KTLS_TX 0x2
+
+// Hand the record layer of `session`, which has finished its handshake on
+// `fd`, over to the kernel. Only AES-GCM and ChaCha20-Poly1305 under TLS 1.2
+// and 1.3 are supported; anything else is left to gnutls. Receiving is only
+// offloaded if gnutls hasn't already buffered data past the handshake.
+//
+// Returns the directions now done by the kernel (0 if the cipher isn't
+// supported), or -1 with errno set if the socket won't take kTLS at all
+// (ENOENT when the `tls` kernel module isn't available). Either way the
+// directions not returned keep working through gnutls.
+int ktls_enable(gnutls_session_t session, int fd);
+
+#endif
@@ -0,0 +1,256 @@
+#define _GNU_SOURCE
+#include "log.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+// Ring size, and the longest line a message can take (longer ones are cut)
+#define LOG_SLOTS 1024
+#define LOG_LINE 256
+
+// How long the writer sleeps when the ring is empty
+#define LOG_IDLE_NS (5 * 1000 * 1000)
+
+// Bounded multi-producer queue: a slot is free for the producer whose ticket
+// matches its `seq`, and holds a message for the writer once `seq` is one
+// past that.
+typedef struct {
+  unsigned long seq;
+  size_t len;
+  char text[LOG_LINE];
+} log_slot_t;
+
+static log_slot_t ring[LOG_SLOTS];
+static unsigned long enqueue_pos; // Next ticket for producers
+static unsigned long dequeue_pos; // Next slot to write, under `drain_lock`
+static unsigned long dropped;     // Messages lost to a full ring
+
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t writer;
+static int running = 0;
+
+int log_level = LOG_LVL_INFO;
+
+static const char *level_names[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+
+void log_set_level(int level) {
+  if (level < LOG_LVL_ERROR)
+    level = LOG_LVL_ERROR;
+  if (level > LOG_LVL_DEBUG)
+    level = LOG_LVL_DEBUG;
+  __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+static void write_all(const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(STDERR_FILENO, buf, len);
+    if (n <= 0)
+      return;
+    buf += n;
+    len -= n;
+  }
+}
+
+// Claim a slot to format a message into, or NULL if the ring is full
+static log_slot_t *slot_claim(unsigned long *ticket) {
+  unsigned long pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+
+  for (;;) {
+    log_slot_t *slot = &ring[pos & (LOG_SLOTS - 1)];
+    long diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        *ticket = pos;
+        return slot;
+      }
+      // `pos` was reloaded by the failed exchange
+    } else if (diff < 0) {
+      __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+      return NULL;
+    } else {
+      pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// Hand a filled slot to the writer
+static void slot_publish(log_slot_t *slot, unsigned long ticket) {
+  __atomic_store_n(&slot->seq, ticket + 1, __ATOMIC_RELEASE);
+}
+
+// Write out every published message. Must hold `drain_lock`.
+static void drain(void) {
+  static char batch[16 * LOG_LINE];
+  size_t batch_len = 0;
+  unsigned long lost;
+
+  for (;;) {
+    log_slot_t *slot = &ring[dequeue_pos & (LOG_SLOTS - 1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != dequeue_pos + 1)
+      break;
+
+    if (batch_len + slot->len > sizeof(batch)) {
+      write_all(batch, batch_len);
+      batch_len = 0;
+    }
+    memcpy(batch + batch_len, slot->text, slot->len);
+    batch_len += slot->len;
+
+    // Free the slot for the producer one lap later
+    __atomic_store_n(&slot->seq, dequeue_pos + LOG_SLOTS, __ATOMIC_RELEASE);
+    dequeue_pos++;
+  }
+
+  if ((lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED)) > 0) {
+    int n = snprintf(batch + batch_len, sizeof(batch) - batch_len,
+                     "[log] %lu messages dropped, the ring was full\n", lost);
+    if (n > 0 && batch_len + n <= sizeof(batch))
+      batch_len += n;
+  }
+  write_all(batch, batch_len);
+}
+
+static void *writer_main(void *arg) {
+  struct timespec idle = {0, LOG_IDLE_NS};
+  (void)arg;
+
+  for (;;) {
+    pthread_mutex_lock(&drain_lock);
+    drain();
+    pthread_mutex_unlock(&drain_lock);
+    nanosleep(&idle, NULL);
+  }
+  return NULL;
+}
+
+void log_flush(void) {
+  if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    return;
+  pthread_mutex_lock(&drain_lock);
+  drain();
+  pthread_mutex_unlock(&drain_lock);
+}
+
+int log_init(void) {
+  const char *env = getenv(LOG_LEVEL_ENV);
+
+  for (int i = LOG_LVL_ERROR; env && i <= LOG_LVL_DEBUG; i++) {
+    if (strcasecmp(env, level_names[i]) == 0)
+      log_set_level(i);
+  }
+
+  if (__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    return 0;
+
+  for (unsigned long i = 0; i < LOG_SLOTS; i++)
+    ring[i].seq = i;
+
+  // The writer takes no signals, they go to the threads that wait for them
+  sigset_t all, old;
+  int err;
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  err = pthread_create(&writer, NULL, writer_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err != 0)
+    return -1;
+  pthread_detach(writer);
+  __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+  atexit(log_flush);
+  return 0;
+}
+
+// Start a line with "[file:line] LEVEL: ", returns its length
+static size_t line_header(char *text, int level, const char *file, int line) {
+  int n = snprintf(text, LOG_LINE, "[%s:%d] %s: ", file, line, level_names[level]);
+  if (n < 0)
+    return 0;
+  return (size_t)n < LOG_LINE ? (size_t)n : LOG_LINE - 1;
+}
+
+// End a line with exactly one '\n', cutting it short if need be
+static size_t line_end(char *text, size_t len) {
+  if (len >= LOG_LINE)
+    len = LOG_LINE - 1;
+  while (len > 0 && text[len - 1] == '\n')
+    len--;
+  text[len++] = '\n';
+  return len;
+}
+
+// Where to format a line: a claimed ring slot, or `local` if the writer
+// isn't running. Returns NULL if the ring is full.
+static char *line_begin(log_slot_t **slot, unsigned long *ticket, char *local) {
+  if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+    *slot = NULL;
+    return local;
+  }
+  if (!(*slot = slot_claim(ticket)))
+    return NULL;
+  return (*slot)->text;
+}
+
+// Queue a finished line, or write it out if it isn't in the ring
+static void line_commit(log_slot_t *slot, unsigned long ticket, char *text, size_t len) {
+  len = line_end(text, len);
+  if (slot) {
+    slot->len = len;
+    slot_publish(slot, ticket);
+  } else {
+    write_all(text, len);
+  }
+}
+
+void log_write(int level, const char *file, int line, const char *fmt, ...) {
+  char local[LOG_LINE], *text;
+  log_slot_t *slot;
+  unsigned long ticket;
+  va_list ap;
+  int n;
+
+  if (!(text = line_begin(&slot, &ticket, local)))
+    return;
+
+  size_t len = line_header(text, level, file, line);
+  va_start(ap, fmt);
+  n = vsnprintf(text + len, LOG_LINE - len, fmt, ap);
+  va_end(ap);
+  if (n > 0)
+    len += n;
+  line_commit(slot, ticket, text, len);
+}
+
+void log_dirty(int level, const char *file, int line, const char *prefix,
+               const char *msg, size_t msg_len) {
+  char local[LOG_LINE], *text;
+  log_slot_t *slot;
+  unsigned long ticket;
+
+  if (!(text = line_begin(&slot, &ticket, local)))
+    return;
+
+  size_t len = line_header(text, level, file, line);
+  for (; *prefix && len < LOG_LINE - 1; prefix++)
+    text[len++] = *prefix;
+
+  // Escapes take two chars, leave room for them and the '\n'
+  for (size_t i = 0; i < msg_len && len < LOG_LINE - 3; i++) {
+    char c = msg[i];
+    if (c == '\n' || c == '\r' || c == '\0') {
+      text[len++] = '\\';
+      text[len++] = c == '\n' ? 'n' : c == '\r' ? 'r' : '0';
+    } else {
+      text[len++] = c;
+    }
+  }
+  line_commit(slot, ticket, text, len);
+}
@@ -0,0 +1,75 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stddef.h>
+#include "common.h"
+
+// Leveled logger for the servers.
+//
+// Messages are formatted straight into a lock-free in-memory ring, and a
+// background thread writes them to stderr in batches, so logging never waits
+// on a terminal or file. If the ring is full the message is dropped (and the
+// drop counted) rather than blocking.
+//
+// Levels past `LOG_MAX_LEVEL` (common.h) compile to nothing, the rest are
+// checked against a level picked at runtime.
+
+// Levels, most important first
+#define LOG_LVL_ERROR 0
+#define LOG_LVL_WARN  1
+#define LOG_LVL_INFO  2
+#define LOG_LVL_DEBUG 3
+
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_LVL_DEBUG
+#endif
+
+// Environment variable with the runtime level: error, warn, info or debug
+// (info if it isn't set)
+#define LOG_LEVEL_ENV "CHAT_LOG_LEVEL"
+
+// Most detailed level logged right now, use log_set_level() to change it
+extern int log_level;
+
+// Read the level from the environment and start the writer thread. Whatever
+// is still in the ring is written out at exit().
+//
+// Returns 0 on success, -1 if the thread couldn't start (messages are then
+// written as they're logged).
+int log_init(void);
+
+void log_set_level(int level);
+
+// Write out everything logged so far, waiting until it's done
+void log_flush(void);
+
+// Use the macros below rather than calling these directly
+void log_write(int level, const char *file, int line, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+void log_dirty(int level, const char *file, int line, const char *prefix,
+               const char *msg, size_t len);
+
+#define LOG_ON(level)                                                          \
+  ((level) <= LOG_MAX_LEVEL &&                                                 \
+   (level) <= __atomic_load_n(&log_level, __ATOMIC_RELAXED))
+
+#define LOG_AT(level, ...)                                                     \
+  do {                                                                         \
+    if (LOG_ON(level))                                                         \
+      log_write(level, __FILE__, __LINE__, __VA_ARGS__);                       \
+  } while (0)
+
+#define LOG_ERROR(...) LOG_AT(LOG_LVL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...)  LOG_AT(LOG_LVL_WARN, __VA_ARGS__)
+#define LOG_INFO(...)  LOG_AT(LOG_LVL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LVL_DEBUG, __VA_ARGS__)
+
+// Log `prefix` followed by `len` raw bytes of `msg`, with '\n', '\r' and
+// '\0' escaped so binary frames stay on one line
+#define LOG_DIRTY(level, prefix, msg, len)                                     \
+  do {                                                                         \
+    if (LOG_ON(level))                                                         \
+      log_dirty(level, __FILE__, __LINE__, prefix, msg, len);                  \
+  } while (0)
+
+#endif
@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+#include "msglog.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SEGMENT_BYTES (MSGLOG_SEGMENT_RECORDS * sizeof(msglog_rec_t))
+#define SEGMENT_SUFFIX ".seg"
+
+static void segment_name(char *name, size_t len, uint64_t base) {
+  snprintf(name, len, "%020llu" SEGMENT_SUFFIX, (unsigned long long)base);
+}
+
+// FNV-1a over the record, minus the checksum itself
+static uint32_t record_check(const msglog_rec_t *rec) {
+  const unsigned char *parts[] = {(const unsigned char *)&rec->seq, (const unsigned char *)&rec->origin,
+                                  (const unsigned char *)rec->frame};
+  const size_t lens[] = {sizeof(rec->seq), sizeof(rec->origin), sizeof(rec->frame)};
+  uint32_t h = 2166136261u;
+
+  for (size_t p = 0; p < 3; p++) {
+    for (size_t i = 0; i < lens[p]; i++) {
+      h ^= parts[p][i];
+      h *= 16777619u;
+    }
+  }
+  return h;
+}
+
+// Number of good records at the start of a segment
+static size_t segment_scan(const msglog_rec_t *recs, uint64_t base) {
+  size_t n = 0;
+  while (n < MSGLOG_SEGMENT_RECORDS && recs[n].seq == base + n && recs[n].check == record_check(&recs[n]))
+    n++;
+  return n;
+}
+
+// Map segment `base`, creating it if `create` is set.
+//
+// Returns the mapping, or NULL on failure with errno set.
+static msglog_rec_t *segment_map(msglog_t *log, uint64_t base, int create, int *fdp) {
+  char name[32];
+  struct stat st;
+  msglog_rec_t *recs;
+  int fd, err;
+
+  segment_name(name, sizeof(name), base);
+  if ((fd = openat(log->dirfd, name, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0600)) < 0)
+    return NULL;
+
+  if (create) {
+    // Reserve the blocks now, so running out of disk space is an error here
+    // rather than a SIGBUS when writing to the mapping
+    if ((err = posix_fallocate(fd, 0, SEGMENT_BYTES)) != 0) {
+      errno = err;
+      goto fail;
+    }
+    // And make sure the new file is still there after a crash
+    if (fsync(log->dirfd) < 0)
+      goto fail;
+  } else if (fstat(fd, &st) < 0 || ((size_t)st.st_size < SEGMENT_BYTES && ftruncate(fd, SEGMENT_BYTES) < 0)) {
+    goto fail;
+  }
+
+  recs = mmap(NULL, SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (recs == MAP_FAILED)
+    goto fail;
+  *fdp = fd;
+  return recs;
+
+fail:
+  err = errno;
+  if (create)
+    unlinkat(log->dirfd, name, 0);
+  close(fd);
+  errno = err;
+  return NULL;
+}
+
+// Finds the newest two segments, leaving 0 for ones that don't exist
+static int segment_find(msglog_t *log, uint64_t *tail, uint64_t *prev) {
+  struct dirent *de;
+  DIR *d;
+  int fd;
+
+  *tail = *prev = 0;
+  if ((fd = dup(log->dirfd)) < 0)
+    return -1;
+  if (!(d = fdopendir(fd))) {
+    close(fd);
+    return -1;
+  }
+
+  while ((de = readdir(d))) {
+    char *end;
+    uint64_t base = strtoull(de->d_name, &end, 10);
+    if (end == de->d_name || strcmp(end, SEGMENT_SUFFIX) != 0 || base == 0)
+      continue;
+    if (base > *tail) {
+      *prev = *tail;
+      *tail = base;
+    } else if (base > *prev) {
+      *prev = base;
+    }
+  }
+  closedir(d);
+  return 0;
+}
+
+// Puts the last `want` good records of segment `base` back into the history
+static void segment_restore(msglog_t *log, uint64_t base, size_t want, history_t *h) {
+  msglog_rec_t *recs;
+  size_t n;
+  int fd;
+
+  if (!(recs = segment_map(log, base, 0, &fd)))
+    return;
+  n = segment_scan(recs, base);
+  for (size_t i = n > want ? n - want : 0; i < n; i++)
+    history_restore(h, recs[i].seq, recs[i].frame, recs[i].origin);
+  log->recovered += n > want ? want : n;
+  munmap(recs, SEGMENT_BYTES);
+  close(fd);
+}
+
+int msglog_open(msglog_t *log, const char *dir, history_t *h) {
+  uint64_t tail, prev;
+  struct timespec start, end;
+  int err;
+
+  memset(log, 0, sizeof(msglog_t));
+  log->fd = log->dirfd = -1;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+    return -1;
+  if ((log->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    return -1;
+  if (segment_find(log, &tail, &prev) < 0)
+    goto fail;
+
+  if (!tail) {
+    // New log, starting from wherever the history is
+    log->base = h->next;
+    if (!(log->recs = segment_map(log, log->base, 1, &log->fd)))
+      goto fail;
+  } else {
+    log->base = tail;
+    if (!(log->recs = segment_map(log, log->base, 0, &log->fd)))
+      goto fail;
+    log->used = log->synced = segment_scan(log->recs, log->base);
+
+    // Only look at the previous segment if the tail can't fill the history
+    if (prev && log->used < h->cap)
+      segment_restore(log, prev, h->cap - log->used, h);
+    for (size_t i = log->used > h->cap ? log->used - h->cap : 0; i < log->used; i++)
+      history_restore(h, log->recs[i].seq, log->recs[i].frame, log->recs[i].origin);
+    log->recovered += log->used > h->cap ? h->cap : log->used;
+
+    // A record torn by a crash is followed by ones that may have made it to
+    // disk before it did. They're out of sequence now, so they go too.
+    if (log->used < MSGLOG_SEGMENT_RECORDS && log->recs[log->used].seq != 0) {
+      memset(&log->recs[log->used], 0, (MSGLOG_SEGMENT_RECORDS - log->used) * sizeof(msglog_rec_t));
+      if (msync(log->recs, SEGMENT_BYTES, MS_SYNC) < 0)
+        goto fail;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  log->recovery_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+  return 0;
+
+fail:
+  err = errno;
+  msglog_close(log);
+  errno = err;
+  return -1;
+}
+
+int msglog_append(msglog_t *log, uint64_t seq, const char *frame, uint64_t origin) {
+  if (log->used == MSGLOG_SEGMENT_RECORDS) {
+    char name[32];
+
+    // Segment full, finish it and start the next one
+    msglog_commit(log);
+    munmap(log->recs, SEGMENT_BYTES);
+    close(log->fd);
+    log->recs = NULL;
+    log->fd = -1;
+    log->base = seq;
+    log->used = log->synced = 0;
+    if (!(log->recs = segment_map(log, log->base, 1, &log->fd)))
+      return -1;
+
+    if (seq > (uint64_t)MSGLOG_SEGMENTS * MSGLOG_SEGMENT_RECORDS) {
+      segment_name(name, sizeof(name), seq - (uint64_t)MSGLOG_SEGMENTS * MSGLOG_SEGMENT_RECORDS);
+      unlinkat(log->dirfd, name, 0);
+    }
+  }
+
+  msglog_rec_t *rec = &log->recs[log->used++];
+  rec->seq = seq;
+  rec->origin = origin;
+  memcpy(rec->frame, frame, MAX);
+  rec->check = record_check(rec);
+  log->appended++;
+  return 0;
+}
+
+int msglog_commit(msglog_t *log) {
+  if (log->synced == log->used)
+    return 0;
+
+  // msync() wants a page aligned start
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  char *start = (char *)((uintptr_t)&log->recs[log->synced] & ~(page - 1));
+  char *end = (char *)&log->recs[log->used];
+
+  if (msync(start, end - start, MS_SYNC) < 0)
+    return -1;
+  log->synced = log->used;
+  log->commits++;
+  return 0;
+}
+
+void msglog_close(msglog_t *log) {
+  if (log->recs) {
+    msglog_commit(log);
+    munmap(log->recs, SEGMENT_BYTES);
+    log->recs = NULL;
+  }
+  if (log->fd >= 0)
+    close(log->fd);
+  if (log->dirfd >= 0)
+    close(log->dirfd);
+  log->fd = log->dirfd = -1;
+}
@@ -0,0 +1,72 @@
+#ifndef __MSGLOG_H__
+#define __MSGLOG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+#include "history.h"
+
+// Append-only log of a chat server's messages, so its history survives a
+// restart.
+//
+// The log is a directory of fixed size segment files, each named after the
+// sequence number of its first message. Messages are written as fixed size
+// records straight into the memory mapped tail segment, and made durable in
+// groups by `msglog_commit()` (one msync() for everything appended since the
+// last commit). When a segment fills up the next one is started, and only
+// the newest `MSGLOG_SEGMENTS` are kept.
+//
+// On startup the tail segment (and the one before it, if the tail doesn't
+// hold a full history yet) is mapped and its records are put back into the
+// history, stopping at the first record that was never written or was only
+// partly written before a crash.
+
+// Messages per segment file
+#define MSGLOG_SEGMENT_RECORDS 8192
+
+// Segment files kept, older ones are deleted
+#define MSGLOG_SEGMENTS 4
+
+typedef struct {
+  uint64_t seq; // 0 if the record was never written
+  uint64_t origin;
+  uint32_t check; // Checksum of everything else, to catch torn writes
+  char frame[MAX];
+} msglog_rec_t;
+
+typedef struct {
+  int dirfd;
+  int fd;             // Tail segment, -1 when logging is off
+  msglog_rec_t *recs; // Tail segment mapping
+  uint64_t base;      // Sequence number of the segment's first record
+  size_t used;        // Records written to the segment
+  size_t synced;      // Records of the segment known to be on disk
+
+  // Stats
+  unsigned long appended;  // Messages written
+  unsigned long commits;   // msync() calls made for them
+  unsigned long recovered; // Messages put back into the history at startup
+  double recovery_ms;      // How long that took
+} msglog_t;
+
+// Open (or create) the log in directory `dir` and restore its newest
+// messages into `h`.
+//
+// Returns 0 on success, -1 on failure with errno set (nothing is logged).
+int msglog_open(msglog_t *log, const char *dir, history_t *h);
+
+// Write message `seq`, which has to follow the last one written. It isn't
+// durable until the next commit.
+//
+// Returns 0 on success, -1 if a new segment couldn't be started.
+int msglog_append(msglog_t *log, uint64_t seq, const char *frame, uint64_t origin);
+
+// Flush everything appended since the last commit to disk.
+//
+// Returns 0 on success, -1 on failure with errno set.
+int msglog_commit(msglog_t *log);
+
+// Commit and stop logging.
+void msglog_close(msglog_t *log);
+
+#endif
@@ -0,0 +1,120 @@
+#define _GNU_SOURCE
+#include "nameset.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KEYLEN (MAXNAMELEN - 1)
+
+// FNV-1a over the significant part of the name
+static size_t name_hash(const char *name) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < KEYLEN && name[i]; i++) {
+    h ^= (unsigned char)name[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Find the slot holding `name`, or the free slot where it would go
+static size_t name_slot(const nameset_t *set, const char *name) {
+  size_t mask = set->cap - 1;
+  size_t i = name_hash(name) & mask;
+
+  while (set->keys[i][0] && strncmp(set->keys[i], name, KEYLEN) != 0)
+    i = (i + 1) & mask;
+  return i;
+}
+
+static int nameset_alloc(nameset_t *set, size_t cap) {
+  set->keys = calloc(cap, sizeof(*set->keys));
+  if (!set->keys)
+    return -1;
+  set->cap = cap;
+  set->len = 0;
+  return 0;
+}
+
+int nameset_init(nameset_t *set, size_t expected) {
+  // Keep the load factor at or under 1/2
+  size_t cap = 16;
+  while (cap < expected * 2)
+    cap *= 2;
+  return nameset_alloc(set, cap);
+}
+
+void nameset_free(nameset_t *set) {
+  free(set->keys);
+  memset(set, 0, sizeof(nameset_t));
+}
+
+// Double the table and rehash every name into it
+static int nameset_grow(nameset_t *set) {
+  nameset_t bigger;
+  if (nameset_alloc(&bigger, set->cap * 2) < 0)
+    return -1;
+
+  for (size_t i = 0; i < set->cap; i++) {
+    if (!set->keys[i][0])
+      continue;
+    memcpy(bigger.keys[name_slot(&bigger, set->keys[i])], set->keys[i],
+           MAXNAMELEN);
+    bigger.len++;
+  }
+
+  free(set->keys);
+  *set = bigger;
+  return 0;
+}
+
+int nameset_insert(nameset_t *set, const char *name) {
+  if (!name[0])
+    return 0;
+
+  size_t i = name_slot(set, name);
+  if (set->keys[i][0])
+    return 0;
+
+  if ((set->len + 1) * 2 > set->cap) {
+    if (nameset_grow(set) < 0)
+      return -1;
+    i = name_slot(set, name);
+  }
+
+  strncpy(set->keys[i], name, KEYLEN);
+  set->keys[i][KEYLEN] = '\0';
+  set->len++;
+  return 1;
+}
+
+int nameset_contains(const nameset_t *set, const char *name) {
+  if (!name[0])
+    return 0;
+  return set->keys[name_slot(set, name)][0] != '\0';
+}
+
+void nameset_remove(nameset_t *set, const char *name) {
+  if (!name[0])
+    return;
+
+  size_t mask = set->cap - 1;
+  size_t i = name_slot(set, name);
+  if (!set->keys[i][0])
+    return;
+
+  set->keys[i][0] = '\0';
+  set->len--;
+
+  // Backward-shift deletion: pull later names in the probe run back into the
+  // hole when their home slot allows it, so lookups never need tombstones.
+  size_t hole = i;
+  for (size_t j = (i + 1) & mask; set->keys[j][0]; j = (j + 1) & mask) {
+    size_t home = name_hash(set->keys[j]) & mask;
+    // Move if `home` is not cyclically within (hole, j]
+    if (((j - home) & mask) >= ((j - hole) & mask)) {
+      memcpy(set->keys[hole], set->keys[j], MAXNAMELEN);
+      set->keys[j][0] = '\0';
+      hole = j;
+    }
+  }
+}
@@ -0,0 +1,38 @@
+#ifndef __NAMESET_H__
+#define __NAMESET_H__
+
+#include <stddef.h>
+#include "common.h"
+
+// Set of usernames in use, so checking for a repeated name on join doesn't
+// have to walk every client.
+//
+// Open addressing with linear probing. Names are stored inline in fixed
+// `MAXNAMELEN` slots (an empty string marks a free slot), and only the first
+// `MAXNAMELEN - 1` chars of a name count, the same as a stored username.
+typedef struct {
+  char (*keys)[MAXNAMELEN];
+  size_t len;
+  size_t cap; // Always a power of two
+} nameset_t;
+
+// Create a set sized to hold `expected` names without growing.
+//
+// Returns 0 on success, -1 on failure.
+int nameset_init(nameset_t *set, size_t expected);
+
+void nameset_free(nameset_t *set);
+
+// Add a name to the set.
+//
+// Returns 1 if it was added, 0 if it was already taken, -1 if the set
+// couldn't grow.
+int nameset_insert(nameset_t *set, const char *name);
+
+// Returns 1 if the name is in the set, 0 otherwise.
+int nameset_contains(const nameset_t *set, const char *name);
+
+// Remove a name from the set (no-op if it isn't there).
+void nameset_remove(nameset_t *set, const char *name);
+
+#endif
@@ -0,0 +1,569 @@
+#define _GNU_SOURCE
+#include "netio.h"
+#include <errno.h>
+#include <stdio.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// What a completion (or epoll event) is for, kept in the low bits of its
+// user data. Connections are at least 8 byte aligned, so their address fills
+// the rest; watches store their id there instead.
+#define TAG_RECV  0x1
+#define TAG_SEND  0x2
+#define TAG_WATCH 0x4
+#define TAG_MASK  0x7
+
+#define CONN_DATA(conn, tag) ((uint64_t)(uintptr_t)(conn) | (tag))
+#define WATCH_DATA(id) (((uint64_t)(id) << 3) | TAG_WATCH)
+#define TIMEOUT_DATA 0 // No connection or watch has this
+#define CANCEL_DATA 8  // Nor this, connections aren't in the first page
+
+// Hard limits on io_uring queue sizes
+#define URING_MAX_SQ 4096
+#define URING_MAX_CQ 65536
+
+static unsigned pow2_at_least(size_t n, unsigned cap) {
+  unsigned p = 64;
+  while (p < n && p < cap)
+    p *= 2;
+  return p;
+}
+
+int netio_init(netio_t *io, int kind, size_t max_conns, int max_events) {
+  memset(io, 0, sizeof(netio_t));
+  io->epfd = -1;
+  io->ring.fd = -1;
+
+  if (kind == NETIO_URING) {
+    size_t ops = 2 * max_conns + NETIO_MAX_WATCH;
+    if (uring_init(&io->ring, pow2_at_least(ops, URING_MAX_SQ),
+                   pow2_at_least(ops, URING_MAX_CQ)) == 0 &&
+        pool_init(&io->rxpool, NETIO_RXBUF, max_conns) == 0 &&
+        // Only connections with data to send hold a TX buffer
+        pool_init(&io->txpool, NETIO_TXBUF, 0) == 0) {
+      io->kind = NETIO_URING;
+      return 0;
+    }
+    perror("netio: io_uring unavailable, falling back to epoll");
+    if (io->ring.fd >= 0)
+      uring_free(&io->ring);
+  }
+
+  io->kind = NETIO_EPOLL;
+  io->max_events = max_events;
+  io->epevs = calloc(max_events, sizeof(struct epoll_event));
+  if (!io->epevs)
+    return -1;
+  if ((io->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    return -1;
+  return 0;
+}
+
+const char *netio_name(netio_t *io) {
+  return io->kind == NETIO_URING ? "io_uring" : "epoll";
+}
+
+int netio_watch(netio_t *io, int fd) {
+  if (io->nwatch >= NETIO_MAX_WATCH)
+    return -1;
+
+  int id = io->nwatch;
+  if (io->kind == NETIO_EPOLL) {
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = WATCH_DATA(id)};
+    if (epoll_ctl(io->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+      return -1;
+  }
+
+  // io_uring watches are armed by the next netio_wait()
+  io->watch_fds[id] = fd;
+  io->watch_armed[id] = 0;
+  io->nwatch++;
+  return id;
+}
+
+// ---------------- io_uring helpers ----------------
+
+// Post a recv into the free end of the connection's RX buffer
+static void uring_arm_recv(netio_conn_t *conn) {
+  struct io_uring_sqe *sqe;
+  if (conn->io->frozen)
+    return;
+  if (!(sqe = uring_get_sqe(&conn->io->ring))) {
+    conn->flags |= NETIO_ERROR;
+    return;
+  }
+
+  uring_prep_recv(sqe, conn->fd, conn->rx + conn->rx_len,
+                  NETIO_RXBUF - conn->rx_len, CONN_DATA(conn, TAG_RECV));
+  conn->flags |= NETIO_RECVING;
+  conn->inflight++;
+  conn->io->inflight++;
+}
+
+// Post a send for everything in the connection's TX buffer
+static void uring_arm_send(netio_conn_t *conn) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&conn->io->ring);
+  if (!sqe) {
+    conn->flags |= NETIO_ERROR;
+    return;
+  }
+
+  uring_prep_send(sqe, conn->fd, conn->tx + conn->tx_off,
+                  conn->tx_len - conn->tx_off, CONN_DATA(conn, TAG_SEND));
+  conn->flags |= NETIO_SENDING;
+  conn->inflight++;
+  conn->io->inflight++;
+}
+
+static void uring_mark_dirty(netio_conn_t *conn) {
+  if (conn->flags & NETIO_DIRTY)
+    return;
+  conn->flags |= NETIO_DIRTY;
+  conn->next_dirty = conn->io->dirty;
+  conn->io->dirty = conn;
+}
+
+// Free everything a closed connection held
+static void uring_release(netio_conn_t *conn) {
+  close(conn->fd);
+  pool_free(&conn->io->rxpool, conn->rx);
+  pool_free(&conn->io->txpool, conn->tx);
+  conn->rx = conn->tx = NULL;
+}
+
+// ---------------- Connections ----------------
+
+int netio_add(netio_t *io, netio_conn_t *conn, int fd, void *owner) {
+  memset(conn, 0, sizeof(netio_conn_t));
+  conn->io = io;
+  conn->fd = fd;
+  conn->owner = owner;
+
+  if (io->kind == NETIO_EPOLL) {
+    // Edge triggered, so a connection is only reported again once something
+    // changes; readers drain until EAGAIN and writers wait for NETIO_WRITABLE
+    // only after being blocked.
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                             .data.u64 = CONN_DATA(conn, 0)};
+    return epoll_ctl(io->epfd, EPOLL_CTL_ADD, fd, &ev);
+  }
+
+  if (!(conn->rx = pool_alloc(&io->rxpool)))
+    return -1;
+
+  uring_arm_recv(conn);
+  return 0;
+}
+
+int netio_close(netio_t *io, netio_conn_t *conn) {
+  if (io->kind == NETIO_EPOLL) {
+    close(conn->fd);
+    return 1;
+  }
+
+  // Buffers still belong to the kernel (or the connection is still queued to
+  // send), so shut the socket down to hurry any operations along and let
+  // netio_wait() release it.
+  if (conn->inflight || (conn->flags & NETIO_DIRTY)) {
+    conn->flags |= NETIO_CLOSING;
+    shutdown(conn->fd, SHUT_RDWR);
+    return 0;
+  }
+
+  uring_release(conn);
+  return 1;
+}
+
+ssize_t netio_recv(netio_conn_t *conn, void *buf, size_t len) {
+  netio_t *io = conn->io;
+
+  if (io->kind == NETIO_EPOLL) {
+    io->syscalls++;
+    io->ops++;
+    return recv(conn->fd, buf, len, 0);
+  }
+
+  if (conn->rx_off < conn->rx_len) {
+    size_t n = conn->rx_len - conn->rx_off;
+    if (n > len)
+      n = len;
+    memcpy(buf, conn->rx + conn->rx_off, n);
+    conn->rx_off += n;
+
+    // Drained, so start filling the buffer again from the top
+    if (conn->rx_off == conn->rx_len) {
+      conn->rx_off = conn->rx_len = 0;
+      if (!(conn->flags & (NETIO_RECVING | NETIO_EOF | NETIO_ERROR)))
+        uring_arm_recv(conn);
+    }
+    return n;
+  }
+
+  if (conn->flags & NETIO_ERROR) {
+    errno = ECONNRESET;
+    return -1;
+  }
+  if (conn->flags & NETIO_EOF)
+    return 0;
+
+  if (!(conn->flags & NETIO_RECVING))
+    uring_arm_recv(conn);
+  errno = EAGAIN;
+  return -1;
+}
+
+ssize_t netio_send(netio_conn_t *conn, const void *buf, size_t len) {
+  netio_t *io = conn->io;
+  ssize_t n;
+
+  if (io->kind == NETIO_EPOLL) {
+    io->syscalls++;
+    io->ops++;
+    n = send(conn->fd, buf, len, MSG_NOSIGNAL);
+    if ((n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) ||
+        (n >= 0 && (size_t)n < len))
+      conn->flags |= NETIO_WBLOCKED;
+    return n;
+  }
+
+  if (conn->flags & NETIO_ERROR) {
+    errno = EPIPE;
+    return -1;
+  }
+  if (!conn->tx && !(conn->tx = pool_alloc(&io->txpool))) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  // Slide unsent data to the front, unless the kernel is reading it
+  if (conn->tx_off && !(conn->flags & NETIO_SENDING)) {
+    memmove(conn->tx, conn->tx + conn->tx_off, conn->tx_len - conn->tx_off);
+    conn->tx_len -= conn->tx_off;
+    conn->tx_off = 0;
+  }
+
+  size_t space = NETIO_TXBUF - conn->tx_len;
+  if (!space) {
+    conn->flags |= NETIO_WBLOCKED;
+    errno = EAGAIN;
+    return -1;
+  }
+
+  n = len < space ? len : space;
+  memcpy(conn->tx + conn->tx_len, buf, n);
+  conn->tx_len += n;
+  if ((size_t)n < len)
+    conn->flags |= NETIO_WBLOCKED;
+
+  io->ops++;
+  uring_mark_dirty(conn);
+  return n;
+}
+
+// ---------------- Handing over ----------------
+
+static uint64_t monotonic_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int netio_freeze(netio_t *io, int timeout_ms) {
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  uint64_t deadline = monotonic_ms() + timeout_ms, left;
+  int cancelled = 0;
+
+  io->frozen = 1;
+  if (io->kind == NETIO_EPOLL)
+    return 0;
+
+  // Recvs wait for data and sends for room, so they're cancelled rather than
+  // waited out
+  if (!(sqe = uring_get_sqe(&io->ring))) {
+    errno = EBUSY;
+    goto thaw;
+  }
+  uring_prep_cancel_all(sqe, CANCEL_DATA);
+  while (!cancelled || io->inflight) {
+    if ((left = monotonic_ms()) >= deadline) {
+      errno = ETIMEDOUT;
+      goto thaw;
+    }
+    left = deadline - left;
+
+    // The kernel reads the timespec when the SQE is submitted
+    struct __kernel_timespec ts = {.tv_sec = left / 1000, .tv_nsec = (left % 1000) * 1000000L};
+    if (!(sqe = uring_get_sqe(&io->ring))) {
+      errno = EBUSY;
+      goto thaw;
+    }
+    uring_prep_timeout(sqe, &ts, 1, TIMEOUT_DATA);
+    if (uring_submit(&io->ring, 1) < 0)
+      goto thaw;
+
+    while ((cqe = uring_peek_cqe(&io->ring))) {
+      uint64_t data = cqe->user_data;
+      int res = cqe->res;
+      uring_cqe_seen(&io->ring);
+
+      if (data == CANCEL_DATA) {
+        // Nothing in flight is fine, but older kernels don't know the flags
+        if (res < 0 && res != -ENOENT) {
+          errno = -res;
+          goto thaw;
+        }
+        cancelled = 1;
+        continue;
+      }
+      if (data == TIMEOUT_DATA || (data & TAG_WATCH))
+        continue;
+
+      // Kept as netio_wait() would, in case the freeze fails
+      netio_conn_t *conn = (netio_conn_t *)(uintptr_t)(data & ~(uint64_t)TAG_MASK);
+      conn->inflight--;
+      io->inflight--;
+      conn->flags |= NETIO_THAWED;
+      uring_mark_dirty(conn);
+      if (data & TAG_RECV) {
+        conn->flags &= ~NETIO_RECVING;
+        if (res > 0)
+          conn->rx_len += res;
+        else if (res == 0)
+          conn->flags |= NETIO_EOF;
+        else if (res != -ECANCELED && res != -EAGAIN && res != -EINTR)
+          conn->flags |= NETIO_ERROR;
+      } else {
+        conn->flags &= ~NETIO_SENDING;
+        if (res > 0)
+          conn->tx_off += res;
+        else if (res < 0 && res != -ECANCELED && res != -EAGAIN && res != -EINTR)
+          conn->flags |= NETIO_ERROR;
+      }
+    }
+  }
+  return 0;
+
+thaw:
+  io->frozen = 0;
+  return -1;
+}
+
+size_t netio_pending(const netio_conn_t *conn) {
+  return conn->rx_len - conn->rx_off;
+}
+
+const char *netio_unsent(const netio_conn_t *conn, size_t *len) {
+  *len = conn->tx_len - conn->tx_off;
+  return conn->tx ? conn->tx + conn->tx_off : NULL;
+}
+
+// ---------------- gnutls transport ----------------
+
+static ssize_t netio_pull(gnutls_transport_ptr_t ptr, void *buf, size_t len) {
+  return netio_recv(ptr, buf, len);
+}
+
+static ssize_t netio_push(gnutls_transport_ptr_t ptr, const void *buf, size_t len) {
+  return netio_send(ptr, buf, len);
+}
+
+static int netio_pull_timeout(gnutls_transport_ptr_t ptr, unsigned int ms) {
+  netio_conn_t *conn = ptr;
+
+  if (conn->io->kind == NETIO_EPOLL) {
+    struct pollfd pfd = {.fd = conn->fd, .events = POLLIN};
+    return poll(&pfd, 1, ms);
+  }
+  return conn->rx_off < conn->rx_len || (conn->flags & (NETIO_EOF | NETIO_ERROR));
+}
+
+void netio_set_session(gnutls_session_t session, netio_conn_t *conn) {
+  gnutls_transport_set_ptr(session, conn);
+  gnutls_transport_set_pull_function(session, netio_pull);
+  gnutls_transport_set_pull_timeout_function(session, netio_pull_timeout);
+  gnutls_transport_set_push_function(session, netio_push);
+}
+
+// ---------------- Waiting ----------------
+
+static int epoll_backend_wait(netio_t *io, netio_event_t *events, int max_events, int timeout_ms) {
+  if (max_events > io->max_events)
+    max_events = io->max_events;
+
+  io->syscalls++;
+  int nev = epoll_wait(io->epfd, io->epevs, max_events, timeout_ms);
+  if (nev < 0)
+    return errno == EINTR ? 0 : -1;
+
+  int n = 0;
+  for (int i = 0; i < nev; i++) {
+    uint64_t data = io->epevs[i].data.u64;
+    uint32_t revents = io->epevs[i].events;
+
+    if (data & TAG_WATCH) {
+      events[n++] = (netio_event_t){.type = NETIO_EV_WATCH, .id = data >> 3};
+      continue;
+    }
+
+    netio_conn_t *conn = (netio_conn_t *)(uintptr_t)(data & ~(uint64_t)TAG_MASK);
+    unsigned mask = 0;
+    if (revents & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+      mask |= NETIO_READABLE;
+    if ((revents & EPOLLOUT) && (conn->flags & NETIO_WBLOCKED)) {
+      conn->flags &= ~NETIO_WBLOCKED;
+      mask |= NETIO_WRITABLE;
+    }
+    if (mask)
+      events[n++] = (netio_event_t){.type = NETIO_EV_CONN, .mask = mask, .conn = conn};
+  }
+  return n;
+}
+
+static int uring_backend_wait(netio_t *io, netio_event_t *events, int max_events, int timeout_ms) {
+  int n = 0;
+
+  // Watches are one-shot polls, put back any that fired
+  for (int id = 0; id < io->nwatch; id++) {
+    if (io->watch_armed[id])
+      continue;
+    struct io_uring_sqe *sqe = uring_get_sqe(&io->ring);
+    if (!sqe)
+      return -1;
+    uring_prep_poll(sqe, io->watch_fds[id], POLLIN, WATCH_DATA(id));
+    io->watch_armed[id] = 1;
+  }
+
+  // Send everything written since the last pass
+  while (io->dirty && n < max_events) {
+    netio_conn_t *conn = io->dirty;
+    io->dirty = conn->next_dirty;
+    conn->flags &= ~NETIO_DIRTY;
+
+    if (conn->flags & NETIO_CLOSING) {
+      conn->flags &= ~NETIO_THAWED;
+      if (!conn->inflight) {
+        uring_release(conn);
+        events[n++] = (netio_event_t){.type = NETIO_EV_RELEASE, .conn = conn};
+      }
+      continue;
+    }
+    if (conn->flags & NETIO_THAWED) {
+      // Whatever finished while a freeze was being tried, and a recv posted
+      // again if it was cancelled. Reporting it readable is always safe.
+      conn->flags &= ~NETIO_THAWED;
+      if (conn->rx_off == conn->rx_len && !(conn->flags & (NETIO_RECVING | NETIO_EOF | NETIO_ERROR))) {
+        conn->rx_off = conn->rx_len = 0;
+        uring_arm_recv(conn);
+      }
+      if (conn->tx && conn->tx_off == conn->tx_len) {
+        conn->tx_off = conn->tx_len = 0;
+        pool_free(&io->txpool, conn->tx);
+        conn->tx = NULL;
+      }
+      unsigned mask = NETIO_READABLE;
+      if ((conn->flags & NETIO_WBLOCKED) && conn->tx_len - conn->tx_off < NETIO_TXBUF) {
+        conn->flags &= ~NETIO_WBLOCKED;
+        mask |= NETIO_WRITABLE;
+      }
+      events[n++] = (netio_event_t){.type = NETIO_EV_CONN, .mask = mask, .conn = conn};
+    }
+    if (!(conn->flags & (NETIO_SENDING | NETIO_ERROR)) && conn->tx_off < conn->tx_len)
+      uring_arm_send(conn);
+  }
+
+  // Only block if there's nothing to report yet, and then no longer than asked
+  int wait = !n && !uring_peek_cqe(&io->ring);
+  if (wait && timeout_ms >= 0) {
+    // The kernel reads the timespec when the SQE is submitted
+    struct __kernel_timespec ts = {.tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L};
+    struct io_uring_sqe *sqe = uring_get_sqe(&io->ring);
+    if (!sqe)
+      return -1;
+    uring_prep_timeout(sqe, &ts, 1, TIMEOUT_DATA);
+    if (uring_submit(&io->ring, 1) < 0)
+      return -1;
+  } else if (uring_submit(&io->ring, wait) < 0)
+    return -1;
+  io->syscalls = io->ring.enters;
+
+  struct io_uring_cqe *cqe;
+  while (n < max_events && (cqe = uring_peek_cqe(&io->ring))) {
+    uint64_t data = cqe->user_data;
+    int res = cqe->res;
+    uring_cqe_seen(&io->ring);
+
+    // A wait timing out (or being cut short by another completion), or a
+    // freeze that gave up before its cancel finished
+    if (data == TIMEOUT_DATA || data == CANCEL_DATA)
+      continue;
+
+    if (data & TAG_WATCH) {
+      io->watch_armed[data >> 3] = 0;
+      events[n++] = (netio_event_t){.type = NETIO_EV_WATCH, .id = data >> 3};
+      continue;
+    }
+
+    netio_conn_t *conn = (netio_conn_t *)(uintptr_t)(data & ~(uint64_t)TAG_MASK);
+    conn->inflight--;
+    io->inflight--;
+
+    if (conn->flags & NETIO_CLOSING) {
+      conn->flags &= ~(NETIO_RECVING | NETIO_SENDING);
+      if (!conn->inflight && !(conn->flags & NETIO_DIRTY)) {
+        uring_release(conn);
+        events[n++] = (netio_event_t){.type = NETIO_EV_RELEASE, .conn = conn};
+      }
+      continue;
+    }
+
+    if (data & TAG_RECV) {
+      conn->flags &= ~NETIO_RECVING;
+      if (res > 0)
+        conn->rx_len += res;
+      else if (res == 0)
+        conn->flags |= NETIO_EOF;
+      else if (res != -EAGAIN && res != -EINTR)
+        conn->flags |= NETIO_ERROR;
+      events[n++] = (netio_event_t){.type = NETIO_EV_CONN, .mask = NETIO_READABLE, .conn = conn};
+      continue;
+    }
+
+    // Send finished
+    conn->flags &= ~NETIO_SENDING;
+    if (res >= 0) {
+      conn->tx_off += res;
+      if (conn->tx_off == conn->tx_len) {
+        // All sent, the buffer goes back until there's more
+        conn->tx_off = conn->tx_len = 0;
+        pool_free(&io->txpool, conn->tx);
+        conn->tx = NULL;
+      } else
+        uring_mark_dirty(conn);
+    } else if (res == -EAGAIN || res == -EINTR) {
+      uring_mark_dirty(conn);
+    } else {
+      // Surface the failure through the next read
+      conn->flags |= NETIO_ERROR;
+      events[n++] = (netio_event_t){.type = NETIO_EV_CONN, .mask = NETIO_READABLE, .conn = conn};
+      continue;
+    }
+
+    if ((conn->flags & NETIO_WBLOCKED) && conn->tx_len - conn->tx_off < NETIO_TXBUF) {
+      conn->flags &= ~NETIO_WBLOCKED;
+      events[n++] = (netio_event_t){.type = NETIO_EV_CONN, .mask = NETIO_WRITABLE, .conn = conn};
+    }
+  }
+
+  return n;
+}
+
+int netio_wait(netio_t *io, netio_event_t *events, int max_events, int timeout_ms) {
+  if (io->kind == NETIO_URING)
+    return uring_backend_wait(io, events, max_events, timeout_ms);
+  return epoll_backend_wait(io, events, max_events, timeout_ms);
+}
@@ -0,0 +1,172 @@
+#ifndef __NETIO_H__
+#define __NETIO_H__
+
+#include <gnutls/gnutls.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/types.h>
+#include "pool.h"
+#include "uring.h"
+
+// Connection I/O for the chat server, with two backends picked at startup:
+//
+//  - NETIO_EPOLL : Readiness based. Reads and writes go straight to the
+//                  socket, one syscall each, when the caller asks for them.
+//  - NETIO_URING : Completion based. Every connection keeps a recv posted
+//                  into its own RX buffer, and writes are copied into a TX
+//                  buffer that is sent later. All of the recvs and sends
+//                  gathered during one pass of the event loop go to the
+//                  kernel in a single io_uring_enter().
+//
+// Callers don't need to care which one is running: `netio_recv()` and
+// `netio_send()` behave like nonblocking recv()/send() either way, and
+// `netio_set_session()` routes a gnutls session through them.
+
+enum { NETIO_EPOLL, NETIO_URING };
+
+// Per-connection buffers for the io_uring backend. A TLS record carrying one
+// chat frame is well under this, so they only fill up when a client falls
+// behind. Every connection keeps an RX buffer for its posted recv, but only
+// holds a TX buffer while it has data waiting to be sent.
+#define NETIO_RXBUF 2048
+#define NETIO_TXBUF 4096
+
+// Most extra descriptors (listening sockets and such) a backend can watch
+#define NETIO_MAX_WATCH 8
+
+// Connection flags
+#define NETIO_RECVING  0x01 // A recv is in flight (io_uring)
+#define NETIO_SENDING  0x02 // A send is in flight (io_uring)
+#define NETIO_DIRTY    0x04 // Has TX data waiting to be submitted (io_uring)
+#define NETIO_EOF      0x08 // Peer closed the connection
+#define NETIO_ERROR    0x10 // The connection failed
+#define NETIO_CLOSING  0x20 // Closed by us, waiting for operations in flight
+#define NETIO_WBLOCKED 0x40 // Last send couldn't take everything
+#define NETIO_THAWED   0x80 // Finished operations during a freeze that failed (io_uring)
+
+typedef struct netio netio_t;
+
+typedef struct netio_conn {
+  netio_t *io;
+  int fd;
+  unsigned flags;
+  void *owner; // Whatever the caller wants back in events
+
+  // io_uring staging buffers
+  char *rx;
+  unsigned rx_off, rx_len; // Received but not yet read by the caller
+  char *tx;                // NULL while there's nothing to send
+  unsigned tx_off, tx_len; // Written by the caller but not yet sent
+  unsigned inflight;       // Operations the kernel still owns
+  struct netio_conn *next_dirty;
+} netio_conn_t;
+
+// Event types
+#define NETIO_EV_WATCH   1 // A watched descriptor is readable (`id`)
+#define NETIO_EV_CONN    2 // Something happened on `conn`, see `mask`
+#define NETIO_EV_RELEASE 3 // A closed `conn` is no longer used by the kernel
+
+// Event masks
+#define NETIO_READABLE 0x1 // Data, EOF or an error waits for netio_recv()
+#define NETIO_WRITABLE 0x2 // A connection that blocked can take writes again
+
+typedef struct {
+  int type;
+  int id;
+  unsigned mask;
+  netio_conn_t *conn;
+} netio_event_t;
+
+struct netio {
+  int kind;
+
+  // epoll
+  int epfd;
+  struct epoll_event *epevs;
+  int max_events;
+
+  // io_uring
+  uring_t ring;
+  pool_t rxpool, txpool;
+  netio_conn_t *dirty;
+  int watch_fds[NETIO_MAX_WATCH];
+  int watch_armed[NETIO_MAX_WATCH];
+  unsigned inflight; // Connection operations the kernel still owns
+
+  int nwatch;
+  int frozen; // See netio_freeze()
+
+  // Stats
+  unsigned long syscalls; // Syscalls made for network I/O and waiting
+  unsigned long ops;      // Reads and writes done (or submitted)
+};
+
+// Set up a backend for up to `max_conns` connections, delivering at most
+// `max_events` events per `netio_wait()`. If io_uring was asked for but isn't
+// available, falls back to epoll; check `io->kind` for what was picked.
+//
+// Returns 0 on success, -1 on failure.
+int netio_init(netio_t *io, int kind, size_t max_conns, int max_events);
+
+// Name of the backend in use, for logs
+const char *netio_name(netio_t *io);
+
+// Report readability of an extra descriptor as NETIO_EV_WATCH events.
+//
+// Returns the watch id, or -1 on failure.
+int netio_watch(netio_t *io, int fd);
+
+// Start doing I/O on a connected, nonblocking socket.
+//
+// Returns 0 on success, -1 on failure (the socket is left open).
+int netio_add(netio_t *io, netio_conn_t *conn, int fd, void *owner);
+
+// Stop doing I/O on a connection and close its socket.
+//
+// Returns 1 if `conn` (and its owner) can be freed right away, or 0 if the
+// kernel still holds operations on it, in which case a NETIO_EV_RELEASE event
+// says when it can be.
+int netio_close(netio_t *io, netio_conn_t *conn);
+
+// Stop all I/O on every connection, so their sockets can be handed to
+// another process without this one reading or sending anything behind its
+// back. Operations the kernel still holds are cancelled and waited for (any
+// that got somewhere first keep what they did), and none are started after.
+//
+// What was received but not read yet can still be read with `netio_recv()`
+// (see `netio_pending()`), and `netio_unsent()` says what was written but
+// never sent. Nothing should be waited for once frozen.
+//
+// Returns 0, or -1 if the kernel can't cancel them (before Linux 5.19) or
+// they aren't all done within `timeout_ms`. I/O then carries on as before,
+// with whatever finished meanwhile reported by the next netio_wait().
+int netio_freeze(netio_t *io, int timeout_ms);
+
+// Bytes received on `conn` but not read yet (always 0 with epoll, where they
+// wait in the socket)
+size_t netio_pending(const netio_conn_t *conn);
+
+// Data written to `conn` but not sent yet, with its length in `*len` (none
+// with epoll, where writes go straight to the socket)
+const char *netio_unsent(const netio_conn_t *conn, size_t *len);
+
+// Read like a nonblocking recv(): returns bytes read, 0 at EOF, or -1 with
+// errno set (EAGAIN when there is nothing to read yet).
+ssize_t netio_recv(netio_conn_t *conn, void *buf, size_t len);
+
+// Write like a nonblocking send(): returns bytes taken, or -1 with errno set
+// (EAGAIN when nothing more can be taken until a NETIO_WRITABLE event).
+ssize_t netio_send(netio_conn_t *conn, const void *buf, size_t len);
+
+// Route a gnutls session's record I/O through `conn`.
+void netio_set_session(gnutls_session_t session, netio_conn_t *conn);
+
+// Submit pending work and wait for events, for at most `timeout_ms` (-1 to
+// wait as long as it takes).
+//
+// Returns the number of events stored in `events` (0 if it timed out), or -1
+// on failure.
+int netio_wait(netio_t *io, netio_event_t *events, int max_events, int timeout_ms);
+
+#endif
@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+#include "pool.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Every slab starts with this header, followed by its objects
+struct pool_slab {
+  pool_slab_t *next;
+  size_t objs;
+};
+
+// A thread's private stash of free objects for one pool
+typedef struct {
+  void *head;
+  size_t count;
+} pool_cache_t;
+
+static __thread pool_cache_t thread_caches[POOL_MAX_CACHED];
+static int next_cache_id = 0;
+
+// Objects are linked through their first bytes while free, and must be able
+// to hold anything the connection structs hold.
+#define POOL_ALIGN 16
+#define NEXT(obj) (*(void **)(obj))
+
+static size_t round_up(size_t n, size_t align) {
+  return (n + align - 1) & ~(align - 1);
+}
+
+// Carve a new slab and push its objects onto the shared free list.
+//
+// Must be called with `pool->lock` held. Returns 0 on success, -1 on failure.
+static int pool_grow(pool_t *pool, size_t objs) {
+  size_t header = round_up(sizeof(pool_slab_t), POOL_ALIGN);
+  pool_slab_t *slab = malloc(header + objs * pool->obj_size);
+  pool->heap_calls++;
+  if (!slab)
+    return -1;
+
+  slab->objs = objs;
+  slab->next = pool->slabs;
+  pool->slabs = slab;
+
+  // Push in reverse so objects are handed out in address order
+  char *base = (char *)slab + header;
+  for (size_t i = objs; i > 0; i--) {
+    void *obj = base + (i - 1) * pool->obj_size;
+    NEXT(obj) = pool->free_list;
+    pool->free_list = obj;
+  }
+
+  pool->capacity += objs;
+  return 0;
+}
+
+int pool_init(pool_t *pool, size_t obj_size, size_t prealloc) {
+  memset(pool, 0, sizeof(pool_t));
+
+  if (obj_size < sizeof(void *))
+    obj_size = sizeof(void *);
+  pool->obj_size = round_up(obj_size, POOL_ALIGN);
+  pool->slab_objs = prealloc ? prealloc : POOL_DEFAULT_SLAB;
+
+  pool->cache_id = __atomic_fetch_add(&next_cache_id, 1, __ATOMIC_RELAXED);
+  if (pool->cache_id >= POOL_MAX_CACHED)
+    pool->cache_id = -1;
+
+  if (pthread_mutex_init(&pool->lock, NULL) != 0)
+    return -1;
+
+  if (prealloc && pool_grow(pool, prealloc) < 0) {
+    pthread_mutex_destroy(&pool->lock);
+    return -1;
+  }
+
+  return 0;
+}
+
+void pool_destroy(pool_t *pool) {
+  if (!pool)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool_slab_t *slab = pool->slabs;
+  while (slab) {
+    pool_slab_t *next = slab->next;
+    free(slab);
+    slab = next;
+  }
+  pool->slabs = NULL;
+  pool->free_list = NULL;
+  pool->capacity = 0;
+  pthread_mutex_unlock(&pool->lock);
+
+  // Only the calling thread's cache can be reached from here; other threads
+  // must be done with the pool before it is destroyed.
+  if (pool->cache_id >= 0)
+    memset(&thread_caches[pool->cache_id], 0, sizeof(pool_cache_t));
+
+  pthread_mutex_destroy(&pool->lock);
+}
+
+// Take one object off the shared list, growing the pool if it is empty.
+//
+// Must be called with `pool->lock` held.
+static void *pool_take_shared(pool_t *pool) {
+  if (!pool->free_list && pool_grow(pool, pool->slab_objs) < 0)
+    return NULL;
+
+  void *obj = pool->free_list;
+  pool->free_list = NEXT(obj);
+  return obj;
+}
+
+void *pool_alloc(pool_t *pool) {
+  void *obj;
+
+  if (pool->cache_id < 0) {
+    pthread_mutex_lock(&pool->lock);
+    obj = pool_take_shared(pool);
+    pthread_mutex_unlock(&pool->lock);
+    return obj;
+  }
+
+  pool_cache_t *cache = &thread_caches[pool->cache_id];
+
+  // Refill the thread's cache with a batch from the shared list. The pool
+  // only grows when the shared list is completely empty, never just to top
+  // off a batch.
+  if (!cache->head) {
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->free_list)
+      pool_grow(pool, pool->slab_objs);
+    for (size_t i = 0; i < POOL_CACHE_BATCH && pool->free_list; i++) {
+      obj = pool->free_list;
+      pool->free_list = NEXT(obj);
+      NEXT(obj) = cache->head;
+      cache->head = obj;
+      cache->count++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!cache->head)
+      return NULL;
+  }
+
+  obj = cache->head;
+  cache->head = NEXT(obj);
+  cache->count--;
+  return obj;
+}
+
+void pool_free(pool_t *pool, void *obj) {
+  if (!obj)
+    return;
+
+  if (pool->cache_id < 0) {
+    pthread_mutex_lock(&pool->lock);
+    NEXT(obj) = pool->free_list;
+    pool->free_list = obj;
+    pthread_mutex_unlock(&pool->lock);
+    return;
+  }
+
+  pool_cache_t *cache = &thread_caches[pool->cache_id];
+  NEXT(obj) = cache->head;
+  cache->head = obj;
+  cache->count++;
+
+  // Spill a batch back so other threads can use it
+  if (cache->count >= POOL_CACHE_MAX) {
+    pthread_mutex_lock(&pool->lock);
+    for (size_t i = 0; i < POOL_CACHE_BATCH; i++) {
+      void *spill = cache->head;
+      cache->head = NEXT(spill);
+      NEXT(spill) = pool->free_list;
+      pool->free_list = spill;
+    }
+    cache->count -= POOL_CACHE_BATCH;
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+void pool_get_stats(pool_t *pool, pool_stats_t *stats) {
+  pthread_mutex_lock(&pool->lock);
+  stats->heap_calls = pool->heap_calls;
+  stats->capacity = pool->capacity;
+  stats->obj_size = pool->obj_size;
+  pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,71 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <pthread.h>
+#include <stddef.h>
+
+// Fixed-size object pool (slab allocator).
+//
+// Objects are carved out of large slabs that are only ever returned to the
+// heap by `pool_destroy()`, so once a pool has grown to its working size,
+// allocating and freeing connection objects never touches malloc/free.
+//
+// Each thread keeps a small cache of free objects per pool, so the common
+// alloc/free path takes no lock. Only when a thread's cache runs dry (or
+// overflows) does it trade a batch of objects with the pool's shared free
+// list under `lock`.
+
+// Number of pools a process can create that get a per-thread cache. Pools
+// past this limit still work, they just always use the shared free list.
+#define POOL_MAX_CACHED 16
+
+// Per-thread cache size, and how many objects move at once between a
+// thread's cache and the shared free list.
+#define POOL_CACHE_MAX 64
+#define POOL_CACHE_BATCH 32
+
+// Objects per slab when the pool was created without a preallocation
+#define POOL_DEFAULT_SLAB 64
+
+typedef struct pool_slab pool_slab_t;
+
+typedef struct {
+  size_t obj_size;  // Size of each object, rounded up for alignment
+  size_t slab_objs; // Objects carved from each new slab
+  int cache_id;     // Index into the per-thread caches, -1 if none
+
+  pthread_mutex_t lock; // Guards everything below
+  void *free_list;      // Shared free objects (linked through their storage)
+  pool_slab_t *slabs;   // Every slab, so they can be released on destroy
+
+  // Stats
+  size_t heap_calls; // Number of times this pool called into the heap
+  size_t capacity;   // Total objects carved from slabs
+} pool_t;
+
+typedef struct {
+  size_t heap_calls;
+  size_t capacity;
+  size_t obj_size;
+} pool_stats_t;
+
+// Create a pool of `obj_size` objects, carving `prealloc` of them up front.
+//
+// Returns 0 on success, -1 on failure.
+int pool_init(pool_t *pool, size_t obj_size, size_t prealloc);
+
+// Release every slab. Objects still handed out become invalid.
+void pool_destroy(pool_t *pool);
+
+// Get an object from the pool, growing it by a slab if needed.
+//
+// The returned memory is NOT zeroed. Returns NULL if the heap is exhausted.
+void *pool_alloc(pool_t *pool);
+
+// Return an object to the pool it came from.
+void pool_free(pool_t *pool, void *obj);
+
+// Snapshot the pool's counters
+void pool_get_stats(pool_t *pool, pool_stats_t *stats);
+
+#endif
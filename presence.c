@@ -0,0 +1,67 @@
+#define _GNU_SOURCE
+#include "presence.h"
+#include <stdio.h>
+#include <string.h>
+
+int presence_add(presence_t *p, const char *name, uint64_t origin, int joined) {
+  int first = p->joined + p->left == 0;
+
+  if (joined) {
+    if (p->njoinnames < PRESENCE_NAMES)
+      snprintf(p->joinnames[p->njoinnames++], MAXNAMELEN, "%s", name);
+    p->joined++;
+  } else {
+    if (p->nleftnames < PRESENCE_NAMES)
+      snprintf(p->leftnames[p->nleftnames++], MAXNAMELEN, "%s", name);
+    p->left++;
+  }
+  if (first)
+    p->origin = origin;
+  return first;
+}
+
+// Writes "<count> <what>: name, name, +<rest>" into `out`, listing the names
+// that fit in `room` bytes (with its terminator)
+// Returns the length written
+static size_t section(char *out, size_t room, unsigned long count, const char *what,
+                      char (*names)[MAXNAMELEN], size_t nnames) {
+  char more[32];
+  size_t len, k, morelen;
+
+  len = snprintf(out, room, "%lu %s", count, what);
+  for (k = 0; k < nnames; k++) {
+    // Room for the name, and for counting the rest if it's the last to fit
+    morelen = count > k + 1 ? (size_t)snprintf(more, sizeof(more), ", +%lu", count - k - 1) : 0;
+    if (len + 2 + strlen(names[k]) + morelen >= room)
+      break;
+    len += snprintf(out + len, room - len, "%s%s", k ? ", " : ": ", names[k]);
+  }
+  if (k > 0 && k < count)
+    len += snprintf(out + len, room - len, ", +%lu", count - k);
+  return len;
+}
+
+int presence_flush(presence_t *p, char *frame, uint64_t *origin) {
+  size_t len = 0;
+
+  if (p->joined + p->left == 0)
+    return 0;
+
+  memset(frame, '\0', MAX);
+  if (p->joined + p->left == 1) {
+    snprintf(frame, MAX, "%s has %s the chat", p->joined ? p->joinnames[0] : p->leftnames[0],
+             p->joined ? "joined" : "left");
+    *origin = p->origin;
+  } else {
+    // Joins get up to half the frame when there are leaves too
+    if (p->joined)
+      len = section(frame, p->left ? MAX / 2 : MAX, p->joined, "joined", p->joinnames, p->njoinnames);
+    if (p->joined && p->left)
+      len += snprintf(frame + len, MAX - len, "; ");
+    if (p->left)
+      section(frame + len, MAX - len, p->left, "left", p->leftnames, p->nleftnames);
+    *origin = 0;
+  }
+  memset(p, 0, sizeof(presence_t));
+  return 1;
+}
@@ -0,0 +1,41 @@
+#ifndef __PRESENCE_H__
+#define __PRESENCE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+
+// Joins and leaves of a topic's users, collected between digests so a chat
+// server sends everyone one line per `PRESENCE_INTERVAL` instead of a message
+// per event. A reconnect storm of N users then costs each client a few
+// frames rather than N of them.
+//
+// Only the first `PRESENCE_NAMES` names of each kind are kept; the rest are
+// just counted, and a digest names as many as fit in its frame.
+
+// Names of each kind (joined, left) kept per digest
+#define PRESENCE_NAMES 8
+
+typedef struct {
+  unsigned long joined, left; // Events since the last digest
+  size_t njoinnames, nleftnames;
+  char joinnames[PRESENCE_NAMES][MAXNAMELEN];
+  char leftnames[PRESENCE_NAMES][MAXNAMELEN];
+  uint64_t origin; // Sender id of the only user in it, while there's just one
+} presence_t;
+
+// Note that `name` (sender id `origin`) joined, or left if `joined` is 0.
+//
+// Returns 1 if it's the first event since the last digest, 0 otherwise.
+int presence_add(presence_t *p, const char *name, uint64_t origin, int joined);
+
+// Write the digest of everything since the last one into `frame` (`MAX`
+// bytes), with its sender in `*origin`, and start over. A digest of one event
+// reads like a message about that user, e.g. "bob has left the chat", and
+// keeps their id so it isn't echoed back to them; a bigger one, e.g.
+// "12 joined: ann, bob, +10; 3 left: cy, dee, eve", has origin 0.
+//
+// Returns 1 if there was a digest, 0 if nothing happened since the last one.
+int presence_flush(presence_t *p, char *frame, uint64_t *origin);
+
+#endif
@@ -0,0 +1,32 @@
+#define _GNU_SOURCE
+#include "ratelimit.h"
+
+void ratelimit_init(ratelimit_t *rl, unsigned long rate, unsigned long burst) {
+  *rl = (ratelimit_t){0};
+  if (!rate)
+    return;
+  rl->per = 1000000000 / rate ? 1000000000 / rate : 1;
+  rl->depth = rl->per * (burst ? burst : 1);
+}
+
+// A bucket full at `*b` has a token as long as it's less than a full bucket
+// minus one token away from being full
+uint64_t ratelimit_wait(const ratelimit_t *rl, const ratebucket_t *b, uint64_t now_us) {
+  uint64_t now = now_us * 1000, ready;
+
+  if (!rl->per)
+    return 0;
+  ready = *b > rl->depth - rl->per ? *b - (rl->depth - rl->per) : 0;
+  return ready > now ? (ready - now + 999) / 1000 : 0;
+}
+
+void ratelimit_take(const ratelimit_t *rl, ratebucket_t *b, uint64_t now_us, unsigned long cost) {
+  uint64_t now = now_us * 1000;
+
+  if (!rl->per)
+    return;
+  // Nothing is earned past a full bucket
+  if (*b < now)
+    *b = now;
+  *b += rl->per * cost;
+}
@@ -0,0 +1,38 @@
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+#include <stdint.h>
+
+// Token buckets for what each chat client sends.
+//
+// A limit earns `rate` tokens a second into a bucket that holds `burst` of
+// them, and every message (or byte) takes one. A client whose bucket is empty
+// isn't read until it has earned a token again, so whatever it keeps sending
+// waits in its socket (and then in the client, once TCP's window closes)
+// instead of being dropped, and one client can't take a topic's whole
+// fan-out.
+//
+// The limit is shared by every client; each client only keeps a
+// `ratebucket_t`, the time (ns) at which its bucket would be full again,
+// rather than a token count and when it was last topped up.
+
+typedef uint64_t ratebucket_t;
+
+typedef struct {
+  uint64_t per;   // Time (ns) to earn a token, 0 if there's no limit
+  uint64_t depth; // Time (ns) to fill the bucket from empty
+} ratelimit_t;
+
+// Earn `rate` tokens a second, up to `burst` (at least one); a `rate` of 0
+// means no limit.
+void ratelimit_init(ratelimit_t *rl, unsigned long rate, unsigned long burst);
+
+// Returns how long (us, rounded up) until `*b` has a token at time `now_us`,
+// 0 if it has one now.
+uint64_t ratelimit_wait(const ratelimit_t *rl, const ratebucket_t *b, uint64_t now_us);
+
+// Take `cost` tokens from `*b` at time `now_us`. Taking more than there are
+// leaves the bucket in debt, to be earned back before the next token.
+void ratelimit_take(const ratelimit_t *rl, ratebucket_t *b, uint64_t now_us, unsigned long cost);
+
+#endif
@@ -0,0 +1,70 @@
+#define _GNU_SOURCE
+#include "rcu.h"
+#include <stdlib.h>
+
+// Both sides use sequentially consistent stores and loads: the writer swaps
+// `current` and then looks at the slots, a reader fills its slot and then
+// looks at `current` again. Either the writer sees the reader's slot, or the
+// reader sees the new snapshot and tries again, so a snapshot is never freed
+// under a reader.
+
+int rcu_init(rcu_t *rcu, size_t nreaders) {
+  rcu->current = NULL;
+  rcu->retired = NULL;
+  rcu->nreaders = nreaders;
+  rcu->readers = calloc(nreaders ? nreaders : 1, sizeof(rcu_node_t *));
+  return rcu->readers ? 0 : -1;
+}
+
+void rcu_publish(rcu_t *rcu, void *snapshot) {
+  rcu_node_t *old = __atomic_exchange_n(&rcu->current, (rcu_node_t *)snapshot, __ATOMIC_SEQ_CST);
+
+  if (old) {
+    old->retired_next = rcu->retired;
+    rcu->retired = old;
+  }
+  rcu_reclaim(rcu);
+}
+
+void *rcu_current(rcu_t *rcu) {
+  return rcu->current;
+}
+
+void *rcu_read(rcu_t *rcu, size_t reader) {
+  rcu_node_t *snapshot;
+
+  do {
+    snapshot = __atomic_load_n(&rcu->current, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&rcu->readers[reader], snapshot, __ATOMIC_SEQ_CST);
+  } while (snapshot != __atomic_load_n(&rcu->current, __ATOMIC_SEQ_CST));
+  return snapshot;
+}
+
+void rcu_done(rcu_t *rcu, size_t reader) {
+  __atomic_store_n(&rcu->readers[reader], NULL, __ATOMIC_RELEASE);
+}
+
+// Whether some reader is using `snapshot`
+static int rcu_in_use(rcu_t *rcu, rcu_node_t *snapshot) {
+  for (size_t i = 0; i < rcu->nreaders; i++) {
+    if (__atomic_load_n(&rcu->readers[i], __ATOMIC_SEQ_CST) == snapshot)
+      return 1;
+  }
+  return 0;
+}
+
+size_t rcu_reclaim(rcu_t *rcu) {
+  rcu_node_t **link = &rcu->retired, *snapshot;
+  size_t left = 0;
+
+  while ((snapshot = *link)) {
+    if (rcu_in_use(rcu, snapshot)) {
+      link = &snapshot->retired_next;
+      left++;
+      continue;
+    }
+    *link = snapshot->retired_next;
+    free(snapshot);
+  }
+  return left;
+}
@@ -0,0 +1,54 @@
+#ifndef __RCU_H__
+#define __RCU_H__
+
+#include <stddef.h>
+
+// Read-mostly data shared between threads without readers taking a lock.
+//
+// One writer thread builds each version of the data as an immutable snapshot
+// and publishes it with a single pointer swap. Readers load whichever
+// snapshot is current and use it for as long as they like, never seeing a
+// half-written one. A replaced snapshot is retired rather than freed, and only
+// freed once no reader can still be looking at it.
+//
+// Each reader thread has a slot where it announces the snapshot it's using
+// (a hazard pointer), so reading costs two atomic loads and a store, and the
+// writer frees a retired snapshot as soon as no slot holds it.
+
+// Every snapshot starts with this, and is allocated with malloc()
+typedef struct rcu_node {
+  struct rcu_node *retired_next; // Next retired snapshot
+} rcu_node_t;
+
+typedef struct {
+  rcu_node_t *current;  // The published snapshot
+  rcu_node_t *retired;  // Replaced ones that may still be in use
+  rcu_node_t **readers; // What each reader is using, NULL if nothing
+  size_t nreaders;
+} rcu_t;
+
+// Set up for `nreaders` reader threads (besides the writer), with nothing
+// published yet.
+//
+// Returns 0 on success, -1 on failure.
+int rcu_init(rcu_t *rcu, size_t nreaders);
+
+// Make `snapshot` current, and retire the one it replaces. Writer only.
+void rcu_publish(rcu_t *rcu, void *snapshot);
+
+// The current snapshot, which the writer can always use since only it frees
+// them. Writer only.
+void *rcu_current(rcu_t *rcu);
+
+// Start using the current snapshot as reader `reader`, until rcu_done().
+void *rcu_read(rcu_t *rcu, size_t reader);
+
+// Reader `reader` is done with the snapshot rcu_read() gave it.
+void rcu_done(rcu_t *rcu, size_t reader);
+
+// Free the retired snapshots no reader is using. Writer only.
+//
+// Returns how many are still retired.
+size_t rcu_reclaim(rcu_t *rcu);
+
+#endif
@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+#include "regshm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REGSHM_MAGIC 0x43524547 // "CREG"
+
+// Copies a reader makes before giving up on a directory that keeps writing
+#define REGSHM_TRIES 1000
+
+const char *regshm_path(void) {
+  const char *path = getenv(REGSHM_ENV);
+  return path && *path ? path : REGSHM_PATH;
+}
+
+regshm_t *regshm_create(const char *path) {
+  char tmp[PATH_MAX];
+  regshm_t *r;
+  int fd, err;
+
+  // Built under another name and renamed into place, so readers never map a
+  // half made file
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+    return NULL;
+  if (ftruncate(fd, sizeof(regshm_t)) < 0)
+    goto fail;
+  r = mmap(NULL, sizeof(regshm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (r == MAP_FAILED)
+    goto fail;
+
+  r->magic = REGSHM_MAGIC;
+  r->size = sizeof(regshm_t);
+  if (rename(tmp, path) < 0) {
+    err = errno;
+    munmap(r, sizeof(regshm_t));
+    errno = err;
+    goto fail;
+  }
+  close(fd);
+  return r;
+
+fail:
+  err = errno;
+  unlink(tmp);
+  close(fd);
+  errno = err;
+  return NULL;
+}
+
+void regshm_publish(regshm_t *r, const regshm_server_t *servers, size_t count, uint64_t now_ms) {
+  if (count > REGSHM_SERVERS)
+    count = REGSHM_SERVERS;
+
+  // Only the directory writes, so it can read its own snapshot freely
+  if (r->count == count && memcmp(r->servers, servers, count * sizeof(regshm_server_t)) == 0 &&
+      now_ms - r->stamp < REGSHM_REFRESH)
+    return;
+
+  uint32_t seq = r->seq;
+  __atomic_store_n(&r->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(r->servers, servers, count * sizeof(regshm_server_t));
+  r->count = count;
+  r->stamp = now_ms;
+  __atomic_store_n(&r->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void regshm_destroy(regshm_t *r, const char *path) {
+  munmap(r, sizeof(regshm_t));
+  unlink(path);
+}
+
+const regshm_t *regshm_open(const char *path) {
+  struct stat st;
+  const regshm_t *r;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    return NULL;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(regshm_t)) {
+    close(fd);
+    return NULL;
+  }
+  r = mmap(NULL, sizeof(regshm_t), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (r == MAP_FAILED)
+    return NULL;
+
+  if (r->magic != REGSHM_MAGIC || r->size != sizeof(regshm_t)) {
+    munmap((void *)r, sizeof(regshm_t));
+    return NULL;
+  }
+  return r;
+}
+
+int regshm_read(const regshm_t *r, regshm_server_t *servers) {
+  struct timespec ts;
+  uint64_t now_ms, stamp;
+  uint32_t seq, count;
+
+  for (int tries = 0; tries < REGSHM_TRIES; tries++) {
+    seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+      continue;
+
+    count = r->count;
+    stamp = r->stamp;
+    if (count > REGSHM_SERVERS)
+      count = REGSHM_SERVERS;
+    memcpy(servers, r->servers, count * sizeof(regshm_server_t));
+
+    // Anything torn by a write in the meantime is thrown away
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) != seq)
+      continue;
+
+    // clock_gettime() is answered by the vDSO, not a syscall
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    if (stamp > now_ms || now_ms - stamp > REGSHM_STALE)
+      return -1;
+    return count;
+  }
+  return -1;
+}
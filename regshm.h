@@ -0,0 +1,81 @@
+#ifndef __REGSHM_H__
+#define __REGSHM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+
+// Snapshot of the directory's registered chat servers in a shared memory
+// file, so clients on the same host can look up a topic without connecting
+// to the directory (and doing a TLS handshake) at all.
+//
+// The directory owns the file and rewrites it whenever a server comes, goes
+// or reports a different load. Readers map it read-only and copy it out
+// under a sequence lock: the directory makes `seq` odd while it writes and
+// even again once it's done, so a reader that sees the same even `seq`
+// before and after its copy knows the copy is whole. Neither side takes a
+// lock or makes a syscall per lookup.
+//
+// `stamp` is rewritten at least every `REGSHM_REFRESH`, and a snapshot that
+// hasn't been for `REGSHM_STALE` is left alone, so clients don't keep using
+// the servers of a directory that has died.
+
+// Environment variable that moves the file, for both the directory and
+// clients
+#define REGSHM_ENV "CHAT_REGISTRY"
+#define REGSHM_PATH "/dev/shm/chatRegistry5"
+
+// Most servers in a snapshot, the rest are left out
+#define REGSHM_SERVERS 64
+
+// How often (ms) the directory rewrites the snapshot when nothing changes,
+// and how old a snapshot readers still trust
+#define REGSHM_REFRESH 1000
+#define REGSHM_STALE 3000
+
+typedef struct {
+  char topic[MAXTOPICLEN];
+  uint16_t port;   // Host order
+  uint32_t ip;     // Network order, as in sin_addr
+  uint32_t load;   // Members plus queued messages, from its last heartbeat
+  uint32_t overloaded;
+} regshm_server_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t size;   // sizeof(regshm_t), so other builds don't misread it
+  uint32_t seq;    // Odd while the directory is writing
+  uint32_t count;  // Servers in `servers`
+  uint64_t stamp;  // CLOCK_MONOTONIC time (ms) of the last write
+  regshm_server_t servers[REGSHM_SERVERS];
+} regshm_t;
+
+// Path of the file: $CHAT_REGISTRY, or `REGSHM_PATH`
+const char *regshm_path(void);
+
+// Create an empty snapshot (replacing any old one) for the directory.
+//
+// Returns its mapping, or NULL on failure with errno set.
+regshm_t *regshm_create(const char *path);
+
+// Write `count` servers into the snapshot at time `now_ms` (CLOCK_MONOTONIC),
+// unless they're what it holds already and it isn't due for a refresh.
+// Compared byte for byte, so zero `servers` before filling it in.
+void regshm_publish(regshm_t *r, const regshm_server_t *servers, size_t count, uint64_t now_ms);
+
+// Unmap the snapshot and remove its file.
+void regshm_destroy(regshm_t *r, const char *path);
+
+// Map a snapshot for reading.
+//
+// Returns its mapping, or NULL if there isn't a usable one.
+const regshm_t *regshm_open(const char *path);
+
+// Copy the servers out of the snapshot into `servers` (room for
+// `REGSHM_SERVERS`).
+//
+// Returns how many there are, or -1 if the snapshot is stale or the
+// directory kept writing it.
+int regshm_read(const regshm_t *r, regshm_server_t *servers);
+
+#endif
@@ -0,0 +1,63 @@
+#define _GNU_SOURCE
+#include "relay.h"
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+
+int relay_newid(uint64_t *id) {
+  if (gnutls_rnd(GNUTLS_RND_NONCE, id, sizeof(*id)) < 0)
+    return -1;
+  *id |= RELAY_REMOTE;
+  return 0;
+}
+
+// Servers of a topic can run on different machines, so the numbers go out
+// big endian
+void relay_encode(char *rec, uint64_t origin, uint64_t seq, const char *frame) {
+  origin = htobe64(origin);
+  seq = htobe64(seq);
+  memcpy(rec, &origin, 8);
+  memcpy(rec + 8, &seq, 8);
+  memcpy(rec + 16, frame, MAX);
+}
+
+const char *relay_decode(const char *rec, uint64_t *origin, uint64_t *seq) {
+  memcpy(origin, rec, 8);
+  memcpy(seq, rec + 8, 8);
+  *origin = be64toh(*origin);
+  *seq = be64toh(*seq);
+  return rec + 16;
+}
+
+int relay_parse_peers(const char *list, struct sockaddr_in *peers, size_t max) {
+  const char *p = list;
+  int n = 0;
+
+  if (*p++ != 'm')
+    return -1;
+
+  while (*p) {
+    char *end;
+    unsigned long ip, port;
+
+    ip = strtoul(p, &end, 10);
+    if (end == p || *end != ';' || ip > UINT32_MAX)
+      return -1;
+    p = end + 1;
+    port = strtoul(p, &end, 10);
+    if (end == p || *end != '\n' || port == 0 || port > UINT16_MAX)
+      return -1;
+    p = end + 1;
+
+    if ((size_t)n < max) {
+      memset(&peers[n], 0, sizeof(struct sockaddr_in));
+      peers[n].sin_family = AF_INET;
+      peers[n].sin_addr.s_addr = ip;
+      peers[n].sin_port = htons(port);
+    }
+    n++;
+  }
+  return n;
+}
@@ -0,0 +1,55 @@
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include "common.h"
+
+// Records passed between the chat servers of one topic, so the clients of
+// every server see the messages sent on all of them.
+//
+// Each server of the topic links to each other one once: the directory tells
+// a server joining the mesh which servers are in it already, and the new one
+// connects to them. A record is a chat frame prefixed with the id of the
+// server it was sent on (its origin) and its sequence number in that server's
+// history.
+//
+// A server only relays messages from its own clients, never ones it got from
+// another server, so every message crosses each link once and can't loop. As
+// a backstop, a record whose origin isn't the server at the other end of the
+// link, or whose sequence number isn't past the last one from it, is dropped.
+//
+// The first record each way is a hello, with sequence number `RELAY_HELLO`
+// and the topic as its frame, saying which server is at the other end.
+
+// Bytes in a record: origin, sequence number, then the `MAX` byte frame
+#define RELAY_FRAME (MAX + 16)
+
+#define RELAY_HELLO 0
+
+// Server ids have this bit set and client ids never do, so messages from
+// other servers can share the history's origins with local clients
+#define RELAY_REMOTE ((uint64_t)1 << 63)
+#define relay_is_remote(origin) (((origin) & RELAY_REMOTE) != 0)
+
+// Pick a random id for this server.
+//
+// Returns 0 on success, -1 on failure.
+int relay_newid(uint64_t *id);
+
+// Write a record for `frame` (`MAX` bytes) into `rec` (`RELAY_FRAME` bytes).
+void relay_encode(char *rec, uint64_t origin, uint64_t seq, const char *frame);
+
+// Read the origin and sequence number of record `rec`.
+//
+// Returns its frame, which points into `rec`.
+const char *relay_decode(const char *rec, uint64_t *origin, uint64_t *seq);
+
+// Parse the directory's "m{{IP};{PORT}\n*}" list of servers to link to into
+// `peers`, keeping the first `max`.
+//
+// Returns how many there were, or -1 if `list` isn't one.
+int relay_parse_peers(const char *list, struct sockaddr_in *peers, size_t max);
+
+#endif
@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+#include "timerwheel.h"
+#include <string.h>
+#include <time.h>
+
+#define SLOT_BITS 6 // log2(TIMERWHEEL_SLOTS)
+#define SLOT_MASK (TIMERWHEEL_SLOTS - 1)
+
+uint64_t timerwheel_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timerwheel_init(timerwheel_t *tw, unsigned tick_ms, uint64_t now_ms) {
+  memset(tw, 0, sizeof(timerwheel_t));
+  tw->tick_ms = tick_ms ? tick_ms : 1;
+  tw->start_ms = now_ms;
+}
+
+// File `t` under the slot for its expiry tick
+static void wheel_insert(timerwheel_t *tw, twtimer_t *t) {
+  uint64_t delta = t->expires - tw->now;
+  int level = 0;
+
+  while (level < TIMERWHEEL_LEVELS - 1 && delta >= (uint64_t)1 << (SLOT_BITS * (level + 1)))
+    level++;
+
+  // Past the top level, park it in the furthest slot and let cascading sort
+  // it out when it comes around
+  uint64_t expires = t->expires;
+  if (delta >= (uint64_t)1 << (SLOT_BITS * TIMERWHEEL_LEVELS))
+    expires = tw->now + ((uint64_t)1 << (SLOT_BITS * TIMERWHEEL_LEVELS)) - 1;
+
+  size_t slot = (expires >> (SLOT_BITS * level)) & SLOT_MASK;
+  twtimer_t **head = &tw->slots[level][slot];
+
+  t->next = *head;
+  if (t->next)
+    t->next->pprev = &t->next;
+  t->pprev = head;
+  *head = t;
+  tw->occupied[level] |= (uint64_t)1 << slot;
+}
+
+// Unlink `t`, keeping the slot's occupied bit right
+static void wheel_remove(timerwheel_t *tw, twtimer_t *t) {
+  *t->pprev = t->next;
+  if (t->next)
+    t->next->pprev = t->pprev;
+
+  // The head pointer of a slot lives inside `slots`, find out which one
+  for (int level = 0; level < TIMERWHEEL_LEVELS; level++) {
+    twtimer_t **first = &tw->slots[level][0];
+    if (t->pprev >= first && t->pprev < first + TIMERWHEEL_SLOTS) {
+      if (!*t->pprev)
+        tw->occupied[level] &= ~((uint64_t)1 << (t->pprev - first));
+      break;
+    }
+  }
+
+  t->next = NULL;
+  t->pprev = NULL;
+}
+
+// Tick that `ms` falls in
+static uint64_t wheel_tick(const timerwheel_t *tw, uint64_t ms) {
+  return ms > tw->start_ms ? (ms - tw->start_ms) / tw->tick_ms : 0;
+}
+
+void timerwheel_arm(timerwheel_t *tw, twtimer_t *t, uint64_t now_ms, uint64_t timeout_ms) {
+  if (twtimer_armed(t))
+    timerwheel_cancel(tw, t);
+
+  // An empty wheel isn't advanced, catch it up so it isn't walked later
+  if (!tw->armed && wheel_tick(tw, now_ms) > tw->now)
+    tw->now = wheel_tick(tw, now_ms);
+
+  // Round up, so it never fires early
+  t->expires = wheel_tick(tw, now_ms + timeout_ms + tw->tick_ms - 1);
+  if (t->expires <= tw->now)
+    t->expires = tw->now + 1;
+  wheel_insert(tw, t);
+  tw->armed++;
+}
+
+void timerwheel_cancel(timerwheel_t *tw, twtimer_t *t) {
+  if (!twtimer_armed(t))
+    return;
+  wheel_remove(tw, t);
+  tw->armed--;
+}
+
+void timerwheel_moved(twtimer_t *t) {
+  if (!twtimer_armed(t))
+    return;
+  *t->pprev = t;
+  if (t->next)
+    t->next->pprev = &t->next;
+}
+
+// Empty a slot of a higher level into the levels below it
+static void wheel_cascade(timerwheel_t *tw, int level, size_t slot) {
+  twtimer_t *t = tw->slots[level][slot];
+
+  tw->slots[level][slot] = NULL;
+  tw->occupied[level] &= ~((uint64_t)1 << slot);
+  while (t) {
+    twtimer_t *next = t->next;
+    wheel_insert(tw, t);
+    t = next;
+  }
+}
+
+twtimer_t *timerwheel_expire(timerwheel_t *tw, uint64_t now_ms) {
+  uint64_t target = wheel_tick(tw, now_ms);
+  twtimer_t *expired = NULL;
+
+  // Nothing can fire, so there's no need to walk the ticks
+  if (!tw->armed) {
+    if (target > tw->now)
+      tw->now = target;
+    return NULL;
+  }
+
+  while (tw->now < target) {
+    tw->now++;
+    size_t slot = tw->now & SLOT_MASK;
+
+    // The bottom level wrapped, bring the next slot of each level that
+    // wrapped down with it (top first, so timers can fall all the way)
+    if (slot == 0) {
+      int top = 1;
+      while (top < TIMERWHEEL_LEVELS - 1 && ((tw->now >> (SLOT_BITS * top)) & SLOT_MASK) == 0)
+        top++;
+      for (int level = top; level > 0; level--)
+        wheel_cascade(tw, level, (tw->now >> (SLOT_BITS * level)) & SLOT_MASK);
+    }
+
+    twtimer_t *t = tw->slots[0][slot];
+    tw->slots[0][slot] = NULL;
+    tw->occupied[0] &= ~((uint64_t)1 << slot);
+    while (t) {
+      twtimer_t *next = t->next;
+      t->pprev = NULL;
+      t->next = expired;
+      expired = t;
+      tw->armed--;
+      t = next;
+    }
+  }
+  return expired;
+}
+
+int timerwheel_timeout(const timerwheel_t *tw, uint64_t now_ms) {
+  uint64_t ticks;
+
+  if (!tw->armed)
+    return -1;
+
+  // Next bottom level slot with timers in it, otherwise the next cascade
+  uint64_t ahead = tw->occupied[0];
+  size_t from = (tw->now + 1) & SLOT_MASK;
+  ahead = (ahead >> from) | (from ? ahead << (TIMERWHEEL_SLOTS - from) : 0);
+  if (ahead)
+    ticks = 1 + __builtin_ctzll(ahead);
+  else
+    ticks = TIMERWHEEL_SLOTS - (tw->now & SLOT_MASK);
+
+  uint64_t due = tw->start_ms + (tw->now + ticks) * tw->tick_ms;
+  if (due <= now_ms)
+    return 0;
+  return due - now_ms > INT32_MAX ? INT32_MAX : (int)(due - now_ms);
+}
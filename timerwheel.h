@@ -0,0 +1,67 @@
+#ifndef __TIMERWHEEL_H__
+#define __TIMERWHEEL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Hierarchical timer wheel for connection timeouts.
+//
+// Time is counted in ticks of `tick_ms`. Each level has `TIMERWHEEL_SLOTS`
+// slots, and every slot of a level covers as many ticks as the whole level
+// below it, so a timer is filed under the coarsest slot that still tells it
+// apart from now. When the level below wraps around, the next slot of a level
+// is emptied into the finer ones ("cascading"), until timers reach the bottom
+// level and fire on their exact tick.
+//
+// Timers are linked into their slot, so arming and cancelling are O(1) no
+// matter how many there are, and the wheel never allocates.
+
+#define TIMERWHEEL_LEVELS 4
+#define TIMERWHEEL_SLOTS  64 // A power of two
+
+typedef struct twtimer {
+  struct twtimer *next;
+  struct twtimer **pprev; // NULL when the timer isn't armed
+  uint64_t expires;       // Tick it fires on
+} twtimer_t;
+
+typedef struct {
+  twtimer_t *slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+  uint64_t occupied[TIMERWHEEL_LEVELS]; // Bit per slot with timers in it
+  unsigned tick_ms;
+  uint64_t start_ms; // Clock time of tick 0
+  uint64_t now;      // Last tick processed
+  size_t armed;      // Timers in the wheel
+} timerwheel_t;
+
+// Whether `t` is waiting to fire
+#define twtimer_armed(t) ((t)->pprev != NULL)
+
+// Monotonic clock in milliseconds
+uint64_t timerwheel_clock(void);
+
+void timerwheel_init(timerwheel_t *tw, unsigned tick_ms, uint64_t now_ms);
+
+// Make `t` fire `timeout_ms` after `now_ms` (rounded up to a tick),
+// replacing whatever it was armed for.
+void timerwheel_arm(timerwheel_t *tw, twtimer_t *t, uint64_t now_ms, uint64_t timeout_ms);
+
+// Disarm `t`, doing nothing if it isn't armed.
+void timerwheel_cancel(timerwheel_t *tw, twtimer_t *t);
+
+// Fix up the links to an armed `t` after it has been moved in memory. The
+// timers it's linked to have to be where its links say, so when several
+// move at once each has to be fixed up as it moves.
+void timerwheel_moved(twtimer_t *t);
+
+// Advance to `now_ms`.
+//
+// Returns the timers that came due, linked through `next` and no longer
+// armed, or NULL if none did.
+twtimer_t *timerwheel_expire(timerwheel_t *tw, uint64_t now_ms);
+
+// Milliseconds from `now_ms` until the wheel needs to advance again, for
+// poll() style timeouts, or -1 if nothing is armed.
+int timerwheel_timeout(const timerwheel_t *tw, uint64_t now_ms);
+
+#endif
@@ -0,0 +1,22 @@
+#define _GNU_SOURCE
+#include "tlsconf.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+int tls_priority_init(gnutls_priority_t *prio, const char *str) {
+  const char *err = NULL;
+  int ret;
+
+  if (!str)
+    str = getenv(TLS_PRIORITY_ENV);
+
+  // NULL gets the defaults
+  if ((ret = gnutls_priority_init(prio, str, &err)) < 0) {
+    if (ret == GNUTLS_E_INVALID_REQUEST && err)
+      fprintf(stderr, "TLS error: bad priority string at \"%s\"\n", err);
+    else
+      fprintf(stderr, "TLS error: can't set priorities: %s\n", gnutls_strerror(ret));
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef __TLSCONF_H__
+#define __TLSCONF_H__
+
+#include <gnutls/gnutls.h>
+
+// Environment variable that overrides the TLS priority string of every
+// program, e.g. CHAT_TLS_PRIORITY="NORMAL:-VERS-TLS1.2"
+#define TLS_PRIORITY_ENV "CHAT_TLS_PRIORITY"
+
+// Parse a gnutls priority string once, for every session to share with
+// gnutls_priority_set(). Uses `str` if given, otherwise $CHAT_TLS_PRIORITY,
+// otherwise gnutls's default priorities (what gnutls_set_default_priority()
+// would use).
+//
+// Returns 0 on success, -1 (after saying what's wrong) on a bad string.
+int tls_priority_init(gnutls_priority_t *prio, const char *str);
+
+#endif
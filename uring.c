@@ -0,0 +1,196 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, _NSIG / 8);
+}
+
+int uring_init(uring_t *ring, unsigned entries, unsigned cq_entries) {
+  struct io_uring_params p;
+
+  memset(ring, 0, sizeof(uring_t));
+  memset(&p, 0, sizeof(p));
+  if (cq_entries > entries) {
+    p.flags |= IORING_SETUP_CQSIZE;
+    p.cq_entries = cq_entries;
+  }
+
+  if ((ring->fd = sys_io_uring_setup(entries, &p)) < 0)
+    return -1;
+  ring->features = p.features;
+
+  ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  // Newer kernels map both rings with one mmap
+  if (ring->features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_sz > ring->sq_ring_sz)
+      ring->sq_ring_sz = ring->cq_ring_sz;
+    ring->cq_ring_sz = ring->sq_ring_sz;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED)
+    goto fail;
+
+  if (ring->features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      ring->cq_ring = NULL;
+      goto fail;
+    }
+  }
+
+  ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto fail;
+  }
+
+  char *sq = ring->sq_ring;
+  ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+  ring->sq_entries = p.sq_entries;
+
+  char *cq = ring->cq_ring;
+  ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  // SQE slot `i` always sits at array index `i`, so the array never changes
+  for (unsigned i = 0; i < p.sq_entries; i++)
+    ring->sq_array[i] = i;
+
+  ring->sqe_tail = ring->submitted = *ring->sq_tail;
+  return 0;
+
+fail:;
+  int err = errno;
+  uring_free(ring);
+  errno = err;
+  return -1;
+}
+
+void uring_free(uring_t *ring) {
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqes_sz);
+  if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_sz);
+  if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+    munmap(ring->sq_ring, ring->sq_ring_sz);
+  if (ring->fd >= 0)
+    close(ring->fd);
+  memset(ring, 0, sizeof(uring_t));
+  ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  if (ring->sqe_tail - head >= ring->sq_entries) {
+    // Full, so hand what we have to the kernel to make room
+    if (uring_submit(ring, 0) < 0)
+      return NULL;
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries)
+      return NULL;
+  }
+
+  struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+  ring->sqe_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+int uring_submit(uring_t *ring, unsigned wait_nr) {
+  unsigned to_submit = ring->sqe_tail - ring->submitted;
+  unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+
+  if (!to_submit && !wait_nr)
+    return 0;
+
+  // Publish the new SQEs before telling the kernel about them
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+  ring->submitted = ring->sqe_tail;
+
+  int ret = sys_io_uring_enter(ring->fd, to_submit, wait_nr, flags);
+  ring->enters++;
+
+  // A signal only interrupts the wait, the caller just waits again
+  if (ret < 0)
+    return errno == EINTR ? 0 : -1;
+
+  ring->ops += ret;
+  return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring) {
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, void *buf, size_t len, uint64_t user_data) {
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = len;
+  sqe->user_data = user_data;
+}
+
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf, size_t len, uint64_t user_data) {
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = len;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = user_data;
+}
+
+void uring_prep_poll(struct io_uring_sqe *sqe, int fd, unsigned events, uint64_t user_data) {
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->user_data = user_data;
+}
+
+void uring_prep_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts, unsigned count, uint64_t user_data) {
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->fd = -1;
+  sqe->addr = (uint64_t)(uintptr_t)ts;
+  sqe->len = 1;
+  sqe->off = count;
+  sqe->user_data = user_data;
+}
+
+void uring_prep_cancel_all(struct io_uring_sqe *sqe, uint64_t user_data) {
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data = user_data;
+}
@@ -0,0 +1,71 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Minimal io_uring wrapper built directly on the system calls, so the chat
+// server doesn't depend on liburing. Only what the server's I/O backend needs
+// is here: one ring, getting and submitting SQEs, and reaping CQEs.
+typedef struct {
+  int fd;
+  unsigned features;
+
+  // Submission queue
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sq_entries;
+  unsigned sqe_tail;  // SQEs handed out by uring_get_sqe(), not yet published
+  unsigned submitted; // Tail as last published to the kernel
+
+  // Completion queue
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  // Mappings, for teardown
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+
+  // Stats
+  unsigned long enters; // io_uring_enter() calls
+  unsigned long ops;    // SQEs submitted
+} uring_t;
+
+// Create a ring with room for `entries` queued submissions (rounded up to a
+// power of two by the kernel). The completion queue is made larger than that,
+// since every connection can have operations in flight at once.
+//
+// Returns 0 on success, -1 (with errno set) if io_uring isn't available.
+int uring_init(uring_t *ring, unsigned entries, unsigned cq_entries);
+
+void uring_free(uring_t *ring);
+
+// Get a blank SQE to fill in. If the submission queue is full, everything
+// queued so far is submitted first.
+//
+// Returns NULL only if the kernel won't take more submissions.
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+// Submit everything queued and wait until at least `wait_nr` completions are
+// ready.
+//
+// Returns the number submitted, or -1 (with errno set) on failure.
+int uring_submit(uring_t *ring, unsigned wait_nr);
+
+// Next unread completion, or NULL if none are ready
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+
+// Mark the completion returned by `uring_peek_cqe()` as read
+void uring_cqe_seen(uring_t *ring);
+
+// Helpers for filling in SQEs
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, void *buf, size_t len, uint64_t user_data);
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf, size_t len, uint64_t user_data);
+void uring_prep_poll(struct io_uring_sqe *sqe, int fd, unsigned events, uint64_t user_data);
+// Completes after `ts`, or once `count` other completions have arrived
+void uring_prep_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts, unsigned count, uint64_t user_data);
+// Cancels every request in flight on the ring
+void uring_prep_cancel_all(struct io_uring_sqe *sqe, uint64_t user_data);
+
+#endif